@@ -36,58 +36,170 @@
 namespace android_audio_legacy
 {
 
+struct ctl_elem_t
+{
+    ctl_elem_t() :
+        id(0),
+        value(0),
+        type(SND_CTL_ELEM_TYPE_NONE),
+        count(0)
+    {
+    }
+
+    ~ctl_elem_t()
+    {
+        if (id) snd_ctl_elem_id_free(id);
+        if (value) snd_ctl_elem_value_free(value);
+    }
+
+    snd_ctl_elem_id_t *     id;
+    snd_ctl_elem_value_t *  value;
+    snd_ctl_elem_type_t     type;
+    int                     count;
+    Vector<String8>         items;      // enumerated item names, on first use
+};
+
 ALSAControl::ALSAControl(const char *device)
 {
-    snd_ctl_open(&mHandle, device, 0);
+    // Non-blocking so handleEvents() can drain the event queue.
+    if (snd_ctl_open(&mHandle, device, SND_CTL_NONBLOCK) < 0) {
+        mHandle = NULL;
+        return;
+    }
+
+    if (snd_ctl_subscribe_events(mHandle, 1) < 0)
+        LOGW("Control '%s' cannot subscribe to events, hot-plug goes unnoticed", device);
 }
 
 ALSAControl::~ALSAControl()
 {
+    for (size_t i = 0; i < mElems.size(); i++)
+        delete mElems.valueAt(i);
+    mElems.clear();
+
     if (mHandle) snd_ctl_close(mHandle);
 }
 
-status_t ALSAControl::get(const char *name, unsigned int &value, int index)
+// The event queue is only read here, so get/set stay free of extra syscalls;
+// an element that vanished in between still recovers through -ENOENT.
+void ALSAControl::refresh()
 {
-    if (!mHandle) {
-        LOGE("Control not initialized");
-        return NO_INIT;
+    if (!mHandle) return;
+
+    AutoMutex lock(mCacheLock);
+    handleEvents();
+}
+
+void ALSAControl::forget(const char *name)
+{
+    ssize_t i = mElems.indexOfKey(String8(name));
+    if (i < 0) return;
+
+    delete mElems.valueAt(i);
+    mElems.removeItemsAt(i);
+}
+
+// Forget the elements the driver removed or changed the shape of since the
+// last call. Called with mCacheLock held.
+void ALSAControl::handleEvents()
+{
+    snd_ctl_event_t *event;
+    snd_ctl_event_alloca(&event);
+
+    while (snd_ctl_read(mHandle, event) > 0) {
+        if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
+            continue;
+
+        unsigned int mask = snd_ctl_event_elem_get_mask(event);
+        if (mask == SND_CTL_EVENT_MASK_REMOVE || (mask & SND_CTL_EVENT_MASK_INFO))
+            forget(snd_ctl_event_elem_get_name(event));
     }
+}
 
-    snd_ctl_elem_id_t *id;
-    snd_ctl_elem_info_t *info;
-    snd_ctl_elem_value_t *control;
+// Resolve a control once and keep its full id, type and a value buffer so
+// later get/set calls skip the element info round trip. Called with
+// mCacheLock held.
+ctl_elem_t *ALSAControl::lookup(const char *name)
+{
+    ssize_t i = mElems.indexOfKey(String8(name));
+    if (i >= 0) return mElems.valueAt(i);
 
-    snd_ctl_elem_id_alloca(&id);
+    snd_ctl_elem_info_t *info;
     snd_ctl_elem_info_alloca(&info);
-    snd_ctl_elem_value_alloca(&control);
 
-    snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
-    snd_ctl_elem_id_set_name(id, name);
-    snd_ctl_elem_info_set_id(info, id);
+    ctl_elem_t *elem = new ctl_elem_t;
+    if (snd_ctl_elem_id_malloc(&elem->id) < 0 ||
+        snd_ctl_elem_value_malloc(&elem->value) < 0) {
+        delete elem;
+        return NULL;
+    }
+
+    snd_ctl_elem_id_set_interface(elem->id, SND_CTL_ELEM_IFACE_MIXER);
+    snd_ctl_elem_id_set_name(elem->id, name);
+    snd_ctl_elem_info_set_id(info, elem->id);
 
     int ret = snd_ctl_elem_info(mHandle, info);
     if (ret < 0) {
         LOGE("Control '%s' cannot get element info: %d", name, ret);
-        return BAD_VALUE;
+        delete elem;
+        return NULL;
     }
 
-    int count = snd_ctl_elem_info_get_count(info);
-    if (index >= count) {
-        LOGE("Control '%s' index is out of range (%d >= %d)", name, index, count);
-        return BAD_VALUE;
+    snd_ctl_elem_info_get_id(info, elem->id);
+    elem->type = snd_ctl_elem_info_get_type(info);
+    elem->count = snd_ctl_elem_info_get_count(info);
+
+    if (elem->type == SND_CTL_ELEM_TYPE_ENUMERATED) {
+        int items = snd_ctl_elem_info_get_items(info);
+        for (int item = 0; item < items; item++) {
+            snd_ctl_elem_info_set_item(info, item);
+            if (snd_ctl_elem_info(mHandle, info) < 0)
+                elem->items.add(String8());
+            else
+                elem->items.add(String8(snd_ctl_elem_info_get_item_name(info)));
+        }
     }
 
-    snd_ctl_elem_info_get_id(info, id);
-    snd_ctl_elem_value_set_id(control, id);
+    mElems.add(String8(name), elem);
+    return elem;
+}
+
+status_t ALSAControl::get(const char *name, unsigned int &value, int index)
+{
+    if (!mHandle) {
+        LOGE("Control not initialized");
+        return NO_INIT;
+    }
+
+    AutoMutex lock(mCacheLock);
+
+    ctl_elem_t *elem;
+    int ret;
+
+    // A stale entry (the card went away and came back) fails with -ENOENT;
+    // look it up again once.
+    for (int attempt = 0; ; attempt++) {
+        elem = lookup(name);
+        if (!elem) return BAD_VALUE;
+
+        if (index >= elem->count) {
+            LOGE("Control '%s' index is out of range (%d >= %d)", name, index, elem->count);
+            return BAD_VALUE;
+        }
+
+        snd_ctl_elem_value_set_id(elem->value, elem->id);
+        ret = snd_ctl_elem_read(mHandle, elem->value);
+        if (ret != -ENOENT || attempt) break;
+        forget(name);
+    }
 
-    ret = snd_ctl_elem_read(mHandle, control);
     if (ret < 0) {
         LOGE("Control '%s' cannot read element value: %d", name, ret);
         return BAD_VALUE;
     }
 
-    snd_ctl_elem_type_t type = snd_ctl_elem_info_get_type(info);
-    switch (type) {
+    snd_ctl_elem_value_t *control = elem->value;
+    switch (elem->type) {
         case SND_CTL_ELEM_TYPE_BOOLEAN:
             value = snd_ctl_elem_value_get_boolean(control, index);
             break;
@@ -117,63 +229,56 @@ status_t ALSAControl::set(const char *name, unsigned int value, int index)
         return NO_INIT;
     }
 
-    snd_ctl_elem_id_t *id;
-    snd_ctl_elem_info_t *info;
+    AutoMutex lock(mCacheLock);
 
-    snd_ctl_elem_id_alloca(&id);
-    snd_ctl_elem_info_alloca(&info);
+    int ret;
 
-    snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
-    snd_ctl_elem_id_set_name(id, name);
-    snd_ctl_elem_info_set_id(info, id);
+    for (int attempt = 0; ; attempt++) {
+        ctl_elem_t *elem = lookup(name);
+        if (!elem) return BAD_VALUE;
 
-    int ret = snd_ctl_elem_info(mHandle, info);
-    if (ret < 0) {
-        LOGE("Control '%s' cannot get element info: %d", name, ret);
-        return BAD_VALUE;
-    }
+        int count = elem->count;
+        int first = index;
+        if (first >= count) {
+            LOGE("Control '%s' index is out of range (%d >= %d)", name, first, count);
+            return BAD_VALUE;
+        }
 
-    int count = snd_ctl_elem_info_get_count(info);
-    if (index >= count) {
-        LOGE("Control '%s' index is out of range (%d >= %d)", name, index, count);
-        return BAD_VALUE;
+        if (first == -1)
+            first = 0; // Range over all of them
+        else
+            count = first + 1; // Just do the one specified
+
+        snd_ctl_elem_value_t *control = elem->value;
+        snd_ctl_elem_value_clear(control);
+        snd_ctl_elem_value_set_id(control, elem->id);
+
+        for (int i = first; i < count; i++)
+            switch (elem->type) {
+                case SND_CTL_ELEM_TYPE_BOOLEAN:
+                    snd_ctl_elem_value_set_boolean(control, i, value);
+                    break;
+                case SND_CTL_ELEM_TYPE_INTEGER:
+                    snd_ctl_elem_value_set_integer(control, i, value);
+                    break;
+                case SND_CTL_ELEM_TYPE_INTEGER64:
+                    snd_ctl_elem_value_set_integer64(control, i, value);
+                    break;
+                case SND_CTL_ELEM_TYPE_ENUMERATED:
+                    snd_ctl_elem_value_set_enumerated(control, i, value);
+                    break;
+                case SND_CTL_ELEM_TYPE_BYTES:
+                    snd_ctl_elem_value_set_byte(control, i, value);
+                    break;
+                default:
+                    break;
+            }
+
+        ret = snd_ctl_elem_write(mHandle, control);
+        if (ret != -ENOENT || attempt) break;
+        forget(name);
     }
 
-    if (index == -1)
-        index = 0; // Range over all of them
-    else
-        count = index + 1; // Just do the one specified
-
-    snd_ctl_elem_type_t type = snd_ctl_elem_info_get_type(info);
-
-    snd_ctl_elem_value_t *control;
-    snd_ctl_elem_value_alloca(&control);
-
-    snd_ctl_elem_info_get_id(info, id);
-    snd_ctl_elem_value_set_id(control, id);
-
-    for (int i = index; i < count; i++)
-        switch (type) {
-            case SND_CTL_ELEM_TYPE_BOOLEAN:
-                snd_ctl_elem_value_set_boolean(control, i, value);
-                break;
-            case SND_CTL_ELEM_TYPE_INTEGER:
-                snd_ctl_elem_value_set_integer(control, i, value);
-                break;
-            case SND_CTL_ELEM_TYPE_INTEGER64:
-                snd_ctl_elem_value_set_integer64(control, i, value);
-                break;
-            case SND_CTL_ELEM_TYPE_ENUMERATED:
-                snd_ctl_elem_value_set_enumerated(control, i, value);
-                break;
-            case SND_CTL_ELEM_TYPE_BYTES:
-                snd_ctl_elem_value_set_byte(control, i, value);
-                break;
-            default:
-                break;
-        }
-
-    ret = snd_ctl_elem_write(mHandle, control);
     return (ret < 0) ? BAD_VALUE : NO_ERROR;
 }
 
@@ -184,30 +289,22 @@ status_t ALSAControl::set(const char *name, const char *value)
         return NO_INIT;
     }
 
-    snd_ctl_elem_id_t *id;
-    snd_ctl_elem_info_t *info;
-
-    snd_ctl_elem_id_alloca(&id);
-    snd_ctl_elem_info_alloca(&info);
+    int item = -1;
+    {
+        AutoMutex lock(mCacheLock);
 
-    snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
-    snd_ctl_elem_id_set_name(id, name);
-    snd_ctl_elem_info_set_id(info, id);
+        ctl_elem_t *elem = lookup(name);
+        if (!elem) return BAD_VALUE;
 
-    int ret = snd_ctl_elem_info(mHandle, info);
-    if (ret < 0) {
-        LOGE("Control '%s' cannot get element info: %d", name, ret);
-        return BAD_VALUE;
+        for (size_t i = 0; i < elem->items.size(); i++)
+            if (elem->items[i] == value) {
+                item = i;
+                break;
+            }
     }
 
-    int items = snd_ctl_elem_info_get_items(info);
-    for (int i = 0; i < items; i++) {
-        snd_ctl_elem_info_set_item(info, i);
-        ret = snd_ctl_elem_info(mHandle, info);
-        if (ret < 0) continue;
-        if (strcmp(value, snd_ctl_elem_info_get_item_name(info)) == 0)
-            return set(name, i, -1);
-    }
+    if (item >= 0)
+        return set(name, item, -1);
 
     LOGE("Control '%s' has no enumerated value of '%s'", name, value);
 
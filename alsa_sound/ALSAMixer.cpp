@@ -157,55 +157,59 @@ static const setVolume_t setVol[] = {
     snd_mixer_selem_set_capture_volume_all
 };
 
-ALSAMixer::ALSAMixer()
+// Forget an element the driver removed so the cached pointer is not used
+// after alsa-lib frees it.
+static int elementCallback(snd_mixer_elem_t *elem, unsigned int mask)
 {
-    int err;
-
-    initMixer (&mMixer[SND_PCM_STREAM_PLAYBACK], "AndroidOut");
-    initMixer (&mMixer[SND_PCM_STREAM_CAPTURE], "AndroidIn");
+    if (mask == SND_CTL_EVENT_MASK_REMOVE) {
+        mixer_info_t *info = (mixer_info_t *)snd_mixer_elem_get_callback_private(elem);
+        if (info && info->elem == elem) info->elem = NULL;
+    }
+    return 0;
+}
 
+static void findElement(snd_mixer_t *mixer, int stream, mixer_info_t *info)
+{
     snd_mixer_selem_id_t *sid;
     snd_mixer_selem_id_alloca(&sid);
 
-    for (int i = 0; i <= SND_PCM_STREAM_LAST; i++) {
+    info->elem = NULL;
 
-        if (!mMixer[i]) continue;
+    for (snd_mixer_elem_t *elem = snd_mixer_first_elem(mixer);
+         elem;
+         elem = snd_mixer_elem_next(elem)) {
 
-        mixer_info_t *info = mixerMasterProp[i].mInfo = new mixer_info_t;
+        if (!snd_mixer_selem_is_active(elem))
+            continue;
 
-        property_get (mixerMasterProp[i].propName,
-                      info->name,
-                      mixerMasterProp[i].propDefault);
-
-        for (snd_mixer_elem_t *elem = snd_mixer_first_elem(mMixer[i]);
-             elem;
-             elem = snd_mixer_elem_next(elem)) {
+        snd_mixer_selem_get_id(elem, sid);
 
-            if (!snd_mixer_selem_is_active(elem))
-                continue;
+        // Find PCM playback volume control element.
+        const char *elementName = snd_mixer_selem_id_get_name(sid);
 
-            snd_mixer_selem_get_id(elem, sid);
+        if (strcmp(elementName, info->name) == 0 &&
+            hasVolume[stream] (elem)) {
 
-            // Find PCM playback volume control element.
-            const char *elementName = snd_mixer_selem_id_get_name(sid);
+            info->elem = elem;
+            getVolumeRange[stream] (elem, &info->min, &info->max);
+            snd_mixer_elem_set_callback(elem, elementCallback);
+            snd_mixer_elem_set_callback_private(elem, info);
+            break;
+        }
+    }
+}
 
-            if (info->elem == NULL &&
-                strcmp(elementName, info->name) == 0 &&
-                hasVolume[i] (elem)) {
+ALSAMixer::ALSAMixer()
+{
+    initMixer (&mMixer[SND_PCM_STREAM_PLAYBACK], "AndroidOut");
+    initMixer (&mMixer[SND_PCM_STREAM_CAPTURE], "AndroidIn");
 
-                info->elem = elem;
-                getVolumeRange[i] (elem, &info->min, &info->max);
-                //info->volume = info->max;
-                //setVol[i] (elem, info->volume);
-                //if (i == SND_PCM_STREAM_PLAYBACK &&
-                //    snd_mixer_selem_has_playback_switch (elem))
-                //    snd_mixer_selem_set_playback_switch_all (elem, 1);
-                break;
-            }
-        }
+    memset(mDeviceInfo, 0, sizeof(mDeviceInfo));
 
-        LOGV("Mixer: master '%s' %s.", info->name, info->elem ? "found" : "not found");
+    for (int i = 0; i <= SND_PCM_STREAM_LAST; i++) {
 
+        // Allocate the route infos even without a mixer, so lookups report
+        // INVALID_OPERATION for known devices instead of silently passing.
         for (int j = 0; mixerProp[j][i].device; j++) {
 
             mixer_info_t *info = mixerProp[j][i].mInfo = new mixer_info_t;
@@ -214,34 +218,21 @@ ALSAMixer::ALSAMixer()
                           info->name,
                           mixerProp[j][i].propDefault);
 
-            for (snd_mixer_elem_t *elem = snd_mixer_first_elem(mMixer[i]);
-                 elem;
-                 elem = snd_mixer_elem_next(elem)) {
-
-                if (!snd_mixer_selem_is_active(elem))
-                    continue;
+            uint32_t device = mixerProp[j][i].device;
+            for (int bit = 0; bit < 32; bit++)
+                if ((device & (1 << bit)) && !mDeviceInfo[i][bit])
+                    mDeviceInfo[i][bit] = info;
+        }
 
-                snd_mixer_selem_get_id(elem, sid);
+        if (!mMixer[i]) continue;
 
-                // Find PCM playback volume control element.
-                const char *elementName = snd_mixer_selem_id_get_name(sid);
+        mixer_info_t *info = mixerMasterProp[i].mInfo = new mixer_info_t;
 
-               if (info->elem == NULL &&
-                    strcmp(elementName, info->name) == 0 &&
-                    hasVolume[i] (elem)) {
+        property_get (mixerMasterProp[i].propName,
+                      info->name,
+                      mixerMasterProp[i].propDefault);
 
-                    info->elem = elem;
-                    getVolumeRange[i] (elem, &info->min, &info->max);
-                    //info->volume = info->max;
-                    //setVol[i] (elem, info->volume);
-                    //if (i == SND_PCM_STREAM_PLAYBACK &&
-                    //    snd_mixer_selem_has_playback_switch (elem))
-                    //    snd_mixer_selem_set_playback_switch_all (elem, 1);
-                    break;
-                }
-            }
-            LOGV("Mixer: route '%s' %s.", info->name, info->elem ? "found" : "not found");
-        }
+        resolveElements(i);
     }
     LOGV("mixer initialized.");
 }
@@ -264,11 +255,52 @@ ALSAMixer::~ALSAMixer()
     LOGV("mixer destroyed.");
 }
 
-status_t ALSAMixer::setMasterVolume(float volume)
+void ALSAMixer::resolveElements(int stream)
 {
-    mixer_info_t *info = mixerMasterProp[SND_PCM_STREAM_PLAYBACK].mInfo;
-    if (!info || !info->elem) return INVALID_OPERATION;
+    mixer_info_t *info = mixerMasterProp[stream].mInfo;
+
+    findElement(mMixer[stream], stream, info);
+    LOGV("Mixer: master '%s' %s.", info->name, info->elem ? "found" : "not found");
+
+    for (int j = 0; mixerProp[j][stream].device; j++) {
+        info = mixerProp[j][stream].mInfo;
+        findElement(mMixer[stream], stream, info);
+        LOGV("Mixer: route '%s' %s.", info->name, info->elem ? "found" : "not found");
+    }
+}
+
+void ALSAMixer::refresh()
+{
+    AutoMutex lock(mLock);
+
+    for (int i = 0; i <= SND_PCM_STREAM_LAST; i++) {
+        if (!mMixer[i]) continue;
+
+        // Process pending add/remove events; removals clear the cached
+        // element through elementCallback().
+        int err = snd_mixer_handle_events(mMixer[i]);
+        if (err < 0)
+            LOGW("Unable to handle mixer events: %s", snd_strerror(err));
+
+        resolveElements(i);
+    }
+}
 
+// Return the next route info for the device bits left in 'devices', clearing
+// the bits it consumed. Returns NULL when no routed device remains. Called
+// with mLock held.
+mixer_info_t *ALSAMixer::nextInfo(int stream, uint32_t &devices)
+{
+    while (devices) {
+        int bit = __builtin_ctz(devices);
+        devices &= devices - 1;
+        if (mDeviceInfo[stream][bit]) return mDeviceInfo[stream][bit];
+    }
+    return NULL;
+}
+
+static inline long scaleVolume(mixer_info_t *info, float volume)
+{
     long minVol = info->min;
     long maxVol = info->max;
 
@@ -277,98 +309,115 @@ status_t ALSAMixer::setMasterVolume(float volume)
     if (vol > maxVol) vol = maxVol;
     if (vol < minVol) vol = minVol;
 
-    info->volume = vol;
-    snd_mixer_selem_set_playback_volume_all (info->elem, vol);
+    return vol;
+}
+
+status_t ALSAMixer::setMasterVolume(float volume)
+{
+    AutoMutex lock(mLock);
+
+    mixer_info_t *info = mixerMasterProp[SND_PCM_STREAM_PLAYBACK].mInfo;
+    if (!info || !info->elem) return INVALID_OPERATION;
+
+    info->volume = scaleVolume(info, volume);
+    snd_mixer_selem_set_playback_volume_all (info->elem, info->volume);
 
     return NO_ERROR;
 }
 
 status_t ALSAMixer::setMasterGain(float gain)
 {
+    AutoMutex lock(mLock);
+
     mixer_info_t *info = mixerMasterProp[SND_PCM_STREAM_CAPTURE].mInfo;
     if (!info || !info->elem) return INVALID_OPERATION;
 
-    long minVol = info->min;
-    long maxVol = info->max;
-
-    // Make sure volume is between bounds.
-    long vol = minVol + gain * (maxVol - minVol);
-    if (vol > maxVol) vol = maxVol;
-    if (vol < minVol) vol = minVol;
-
-    info->volume = vol;
-    snd_mixer_selem_set_capture_volume_all (info->elem, vol);
+    info->volume = scaleVolume(info, gain);
+    snd_mixer_selem_set_capture_volume_all (info->elem, info->volume);
 
     return NO_ERROR;
 }
 
 status_t ALSAMixer::setVolume(uint32_t device, float left, float right)
 {
-    for (int j = 0; mixerProp[j][SND_PCM_STREAM_PLAYBACK].device; j++)
-        if (mixerProp[j][SND_PCM_STREAM_PLAYBACK].device & device) {
+    alsa_mixer_volume_t volume = { device, left };
+
+    return setVolumes(&volume, 1);
+}
+
+status_t ALSAMixer::setVolumes(const alsa_mixer_volume_t *volumes, size_t count)
+{
+    mixer_info_t *pending[32];
+    int npending = 0;
+    status_t status = NO_ERROR;
 
-            mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_PLAYBACK].mInfo;
-            if (!info || !info->elem) return INVALID_OPERATION;
+    AutoMutex lock(mLock);
 
-            long minVol = info->min;
-            long maxVol = info->max;
+    // Resolve every request first so an element shared by several devices
+    // is written once, with the last volume requested for it.
+    for (size_t k = 0; k < count; k++) {
+        uint32_t device = volumes[k].device;
+        mixer_info_t *info;
 
-            // Make sure volume is between bounds.
-            long vol = minVol + left * (maxVol - minVol);
-            if (vol > maxVol) vol = maxVol;
-            if (vol < minVol) vol = minVol;
+        while ((info = nextInfo(SND_PCM_STREAM_PLAYBACK, device))) {
+            if (!info->elem) {
+                status = INVALID_OPERATION;
+                continue;
+            }
 
-            info->volume = vol;
-            snd_mixer_selem_set_playback_volume_all (info->elem, vol);
+            info->volume = scaleVolume(info, volumes[k].volume);
+
+            int p = 0;
+            while (p < npending && pending[p]->elem != info->elem) p++;
+            if (p == npending && npending < 32) pending[npending++] = info;
+            else if (p < npending) pending[p] = info;
         }
+    }
 
-    return NO_ERROR;
+    for (int p = 0; p < npending; p++)
+        snd_mixer_selem_set_playback_volume_all (pending[p]->elem, pending[p]->volume);
+
+    return status;
 }
 
 status_t ALSAMixer::setGain(uint32_t device, float gain)
 {
-    for (int j = 0; mixerProp[j][SND_PCM_STREAM_CAPTURE].device; j++)
-        if (mixerProp[j][SND_PCM_STREAM_CAPTURE].device & device) {
-
-            mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_CAPTURE].mInfo;
-            if (!info || !info->elem) return INVALID_OPERATION;
+    AutoMutex lock(mLock);
 
-            long minVol = info->min;
-            long maxVol = info->max;
+    mixer_info_t *info;
 
-            // Make sure volume is between bounds.
-            long vol = minVol + gain * (maxVol - minVol);
-            if (vol > maxVol) vol = maxVol;
-            if (vol < minVol) vol = minVol;
+    while ((info = nextInfo(SND_PCM_STREAM_CAPTURE, device))) {
+        if (!info->elem) return INVALID_OPERATION;
 
-            info->volume = vol;
-            snd_mixer_selem_set_capture_volume_all (info->elem, vol);
-        }
+        info->volume = scaleVolume(info, gain);
+        snd_mixer_selem_set_capture_volume_all (info->elem, info->volume);
+    }
 
     return NO_ERROR;
 }
 
 status_t ALSAMixer::setCaptureMuteState(uint32_t device, bool state)
 {
-    for (int j = 0; mixerProp[j][SND_PCM_STREAM_CAPTURE].device; j++)
-        if (mixerProp[j][SND_PCM_STREAM_CAPTURE].device & device) {
+    AutoMutex lock(mLock);
 
-            mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_CAPTURE].mInfo;
-            if (!info || !info->elem) return INVALID_OPERATION;
+    mixer_info_t *info;
 
-            if (snd_mixer_selem_has_capture_switch (info->elem)) {
+    while ((info = nextInfo(SND_PCM_STREAM_CAPTURE, device))) {
+        if (!info->elem) return INVALID_OPERATION;
 
-                int err = snd_mixer_selem_set_capture_switch_all (info->elem, static_cast<int>(!state));
-                if (err < 0) {
-                    LOGE("Unable to %s capture mixer switch %s",
-                        state ? "enable" : "disable", info->name);
-                    return INVALID_OPERATION;
-                }
-            }
+        if (snd_mixer_selem_has_capture_switch (info->elem)) {
 
-            info->mute = state;
+            int err = snd_mixer_selem_set_capture_switch_all (info->elem, static_cast<int>(!state));
+            if (err < 0) {
+                LOGE("Unable to %s capture mixer switch %s",
+                    state ? "enable" : "disable", info->name);
+                return INVALID_OPERATION;
+            }
         }
 
+        info->mute = state;
+    }
+
     return NO_ERROR;
 }
 
@@ -376,40 +425,38 @@ status_t ALSAMixer::getCaptureMuteState(uint32_t device, bool *state)
 {
     if (!state) return BAD_VALUE;
 
-    for (int j = 0; mixerProp[j][SND_PCM_STREAM_CAPTURE].device; j++)
-        if (mixerProp[j][SND_PCM_STREAM_CAPTURE].device & device) {
-
-            mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_CAPTURE].mInfo;
-            if (!info || !info->elem) return INVALID_OPERATION;
+    AutoMutex lock(mLock);
 
-            *state = info->mute;
-            return NO_ERROR;
-        }
+    mixer_info_t *info = nextInfo(SND_PCM_STREAM_CAPTURE, device);
+    if (!info) return BAD_VALUE;
+    if (!info->elem) return INVALID_OPERATION;
 
-    return BAD_VALUE;
+    *state = info->mute;
+    return NO_ERROR;
 }
 
 status_t ALSAMixer::setPlaybackMuteState(uint32_t device, bool state)
 {
-    for (int j = 0; mixerProp[j][SND_PCM_STREAM_PLAYBACK].device; j++)
-        if (mixerProp[j][SND_PCM_STREAM_PLAYBACK].device & device) {
+    AutoMutex lock(mLock);
 
-            mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_PLAYBACK].mInfo;
-            if (!info || !info->elem) return INVALID_OPERATION;
+    mixer_info_t *info;
 
-            if (snd_mixer_selem_has_playback_switch (info->elem)) {
+    while ((info = nextInfo(SND_PCM_STREAM_PLAYBACK, device))) {
+        if (!info->elem) return INVALID_OPERATION;
 
-                int err = snd_mixer_selem_set_playback_switch_all (info->elem, static_cast<int>(!state));
-                if (err < 0) {
-                    LOGE("Unable to %s playback mixer switch %s",
-                        state ? "enable" : "disable", info->name);
-                    return INVALID_OPERATION;
-                }
-            }
+        if (snd_mixer_selem_has_playback_switch (info->elem)) {
 
-            info->mute = state;
+            int err = snd_mixer_selem_set_playback_switch_all (info->elem, static_cast<int>(!state));
+            if (err < 0) {
+                LOGE("Unable to %s playback mixer switch %s",
+                    state ? "enable" : "disable", info->name);
+                return INVALID_OPERATION;
+            }
         }
 
+        info->mute = state;
+    }
+
     return NO_ERROR;
 }
 
@@ -417,17 +464,14 @@ status_t ALSAMixer::getPlaybackMuteState(uint32_t device, bool *state)
 {
     if (!state) return BAD_VALUE;
 
-    for (int j = 0; mixerProp[j][SND_PCM_STREAM_PLAYBACK].device; j++)
-        if (mixerProp[j][SND_PCM_STREAM_PLAYBACK].device & device) {
+    AutoMutex lock(mLock);
 
-            mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_PLAYBACK].mInfo;
-            if (!info || !info->elem) return INVALID_OPERATION;
+    mixer_info_t *info = nextInfo(SND_PCM_STREAM_PLAYBACK, device);
+    if (!info) return BAD_VALUE;
+    if (!info->elem) return INVALID_OPERATION;
 
-            *state = info->mute;
-            return NO_ERROR;
-        }
-
-    return BAD_VALUE;
+    *state = info->mute;
+    return NO_ERROR;
 }
 
 };        // namespace android
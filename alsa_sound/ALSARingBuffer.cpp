@@ -0,0 +1,100 @@
+/* ALSARingBuffer.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+#include <cutils/atomic.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android_audio_legacy
+{
+
+// The indices run freely and wrap at 2^32; with a power of 2 size the
+// difference rear - front is always the fill level.
+
+ALSARingBuffer::ALSARingBuffer(size_t size) :
+    mData(0),
+    mSize(size),
+    mFront(0),
+    mRear(0)
+{
+    if (!size || (size & (size - 1))) {
+        LOGE("Ring size %d is not a power of 2", (int)size);
+        return;
+    }
+
+    mData = (char *)malloc(size);
+}
+
+ALSARingBuffer::~ALSARingBuffer()
+{
+    free(mData);
+}
+
+size_t ALSARingBuffer::availableToWrite() const
+{
+    uint32_t front = (uint32_t)android_atomic_acquire_load(&mFront);
+    return mSize - ((uint32_t)mRear - front);
+}
+
+size_t ALSARingBuffer::availableToRead() const
+{
+    uint32_t rear = (uint32_t)android_atomic_acquire_load(&mRear);
+    return rear - (uint32_t)mFront;
+}
+
+size_t ALSARingBuffer::write(const void *buffer, size_t bytes)
+{
+    size_t avail = availableToWrite();
+    if (bytes > avail) bytes = avail;
+    if (!bytes) return 0;
+
+    uint32_t rear = (uint32_t)mRear;
+    size_t offset = rear & (mSize - 1);
+    size_t part = mSize - offset;
+    if (part > bytes) part = bytes;
+
+    memcpy(mData + offset, buffer, part);
+    memcpy(mData, (const char *)buffer + part, bytes - part);
+
+    // Publish the data before the new index.
+    android_atomic_release_store((int32_t)(rear + bytes), &mRear);
+    return bytes;
+}
+
+size_t ALSARingBuffer::read(void *buffer, size_t bytes)
+{
+    size_t avail = availableToRead();
+    if (bytes > avail) bytes = avail;
+    if (!bytes) return 0;
+
+    uint32_t front = (uint32_t)mFront;
+    size_t offset = front & (mSize - 1);
+    size_t part = mSize - offset;
+    if (part > bytes) part = bytes;
+
+    memcpy(buffer, mData + offset, part);
+    memcpy((char *)buffer + part, mData, bytes - part);
+
+    // Hand the space back only once the copy is done.
+    android_atomic_release_store((int32_t)(front + bytes), &mFront);
+    return bytes;
+}
+
+}       // namespace android
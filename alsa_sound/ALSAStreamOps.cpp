@@ -163,6 +163,25 @@ status_t ALSAStreamOps::setParameters(const String8& keyValuePairs)
     if (param.getInt(key, device) == NO_ERROR) {
         AutoMutex lock(mLock);
         mParent->mALSADevice->route(mHandle, (uint32_t)device, mParent->mode());
+        // A route change is where plugged cards show up; re-resolve the
+        // cached mixer elements.
+        if (mixer()) mixer()->refresh();
+        param.remove(key);
+    }
+
+    String8 value;
+    key = String8(ALSA_KEY_LATENCY_PROFILE);
+    if (param.get(key, value) == NO_ERROR) {
+        int profile = alsaProfileFromName(value.string());
+        if (profile == ALSA_PROFILE_AUTO && value != "auto") {
+            status = BAD_VALUE;
+        } else {
+            // Only takes effect the next time the PCM is opened: AudioFlinger
+            // sizes its buffers from bufferSize() once, when the stream is
+            // created, and the writer may be inside the PCM right now.
+            AutoMutex lock(mLock);
+            mHandle->profile = profile;
+        }
         param.remove(key);
     }
 
@@ -182,6 +201,22 @@ String8 ALSAStreamOps::getParameters(const String8& keys)
         param.addInt(key, (int)mHandle->curDev);
     }
 
+    key = String8(ALSA_KEY_LATENCY_PROFILE);
+    if (param.get(key, value) == NO_ERROR) {
+        param.add(key, String8(alsaProfileName(mHandle->curProfile)));
+    }
+
+    key = String8(ALSA_KEY_PERF_STATS);
+    if (param.get(key, value) == NO_ERROR) {
+        param.add(key, mStats.toString());
+    }
+
+    key = String8(ALSA_KEY_ACCESS_MODE);
+    if (param.get(key, value) == NO_ERROR) {
+        param.add(key, String8(mHandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED ?
+                "mmap" : "rw"));
+    }
+
     LOGV("getParameters() %s", param.toString().string());
     return param.toString();
 }
@@ -196,12 +231,9 @@ uint32_t ALSAStreamOps::sampleRate() const
 //
 size_t ALSAStreamOps::bufferSize() const
 {
-    snd_pcm_uframes_t bufferSize = mHandle->bufferSize;
-    snd_pcm_uframes_t periodSize;
-
-    snd_pcm_get_params(mHandle->handle, &bufferSize, &periodSize);
-
-    size_t bytes = static_cast<size_t>(snd_pcm_frames_to_bytes(mHandle->handle, bufferSize));
+    // mHandle->bufferSize holds the size negotiated for the current profile.
+    size_t bytes = mHandle->bufferSize * mHandle->channels *
+            snd_pcm_format_physical_width(mHandle->format) / 8;
 
     // Not sure when this happened, but unfortunately it now
     // appears that the bufferSize must be reported as a
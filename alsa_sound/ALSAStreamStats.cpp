@@ -0,0 +1,119 @@
+/* ALSAStreamStats.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdio.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+#include <utils/String8.h>
+#include <cutils/atomic.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android_audio_legacy
+{
+
+const uint32_t ALSAStreamStats::kBucketLimitUs[HISTOGRAM_BUCKETS - 1] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000
+};
+
+ALSAStreamStats::ALSAStreamStats()
+{
+    reset();
+}
+
+void ALSAStreamStats::reset()
+{
+    android_atomic_release_store(0, &mXruns);
+    android_atomic_release_store(0, &mRecovers);
+    android_atomic_release_store(0, &mReopens);
+    android_atomic_release_store(0, &mTransfers);
+    {
+        AutoMutex lock(mFramesLock);
+        mFrames = 0;
+    }
+    android_atomic_release_store(0, &mMaxDurationUs);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        android_atomic_release_store(0, &mHistogram[i]);
+}
+
+void ALSAStreamStats::transfer(nsecs_t duration, size_t frames)
+{
+    int32_t us = (int32_t)(duration / 1000);
+    int bucket = 0;
+
+    while (bucket < HISTOGRAM_BUCKETS - 1 && (uint32_t)us >= kBucketLimitUs[bucket])
+        bucket++;
+
+    android_atomic_inc(&mHistogram[bucket]);
+    android_atomic_inc(&mTransfers);
+    {
+        AutoMutex lock(mFramesLock);
+        mFrames += frames;
+    }
+
+    // Only the audio thread raises the maximum, a plain compare is enough.
+    if (us > mMaxDurationUs)
+        android_atomic_release_store(us, &mMaxDurationUs);
+}
+
+int64_t ALSAStreamStats::frames() const
+{
+    AutoMutex lock(mFramesLock);
+    return mFrames;
+}
+
+void ALSAStreamStats::dump(String8 &result) const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+
+    snprintf(buffer, SIZE, "\txruns: %d recovers: %d reopens: %d\n",
+             mXruns, mRecovers, mReopens);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\ttransfers: %d frames: %lld max: %d us\n",
+             mTransfers, (long long)frames(), mMaxDurationUs);
+    result.append(buffer);
+
+    result.append("\ttransfer time:");
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (i < HISTOGRAM_BUCKETS - 1)
+            snprintf(buffer, SIZE, " <%ums: %d", kBucketLimitUs[i] / 1000, mHistogram[i]);
+        else
+            snprintf(buffer, SIZE, " >=%ums: %d", kBucketLimitUs[i - 1] / 1000, mHistogram[i]);
+        result.append(buffer);
+    }
+    result.append("\n");
+}
+
+String8 ALSAStreamStats::toString() const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    snprintf(buffer, SIZE, "xruns:%d,recovers:%d,reopens:%d,transfers:%d,frames:%lld,max_us:%d,hist:",
+             mXruns, mRecovers, mReopens, mTransfers, (long long)frames(), mMaxDurationUs);
+    result.append(buffer);
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        snprintf(buffer, SIZE, i ? "/%d" : "%d", mHistogram[i]);
+        result.append(buffer);
+    }
+
+    return result;
+}
+
+}       // namespace android
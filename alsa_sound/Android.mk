@@ -20,7 +20,9 @@ ifeq ($(strip $(BOARD_USES_ALSA_AUDIO)),true)
 	AudioStreamInALSA.cpp \
 	ALSAStreamOps.cpp \
 	ALSAMixer.cpp \
-	ALSAControl.cpp
+	ALSAControl.cpp \
+	ALSARingBuffer.cpp \
+	ALSAStreamStats.cpp
 
   LOCAL_MODULE := audio.primary.amlogic
   LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
@@ -281,6 +281,27 @@ status_t AudioHardwareALSA::getMicMute(bool *state)
 
 status_t AudioHardwareALSA::dump(int fd, const Vector<String16>& args)
 {
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    result.append("AudioHardwareALSA::dump\n");
+    snprintf(buffer, SIZE, "\tmode: %d mixer: %s\n", mMode,
+             mMixer && mMixer->isValid() ? "valid" : "invalid");
+    result.append(buffer);
+
+    // Per-stream counters are printed by the streams' own dump().
+    for(ALSAHandleList::iterator it = mDeviceList.begin();
+        it != mDeviceList.end(); ++it) {
+        snprintf(buffer, SIZE, "\t%s: %s devices 0x%08x profile %s buffer %lu period %lu latency %u us\n",
+                 (it->devices & AudioSystem::DEVICE_OUT_ALL) ? "out" : "in",
+                 it->handle ? "open" : "closed", it->curDev,
+                 alsaProfileName(it->curProfile), (unsigned long)it->bufferSize,
+                 (unsigned long)it->periodSize, it->latency);
+        result.append(buffer);
+    }
+    ::write(fd, result.string(), result.size());
+
     return NO_ERROR;
 }
 
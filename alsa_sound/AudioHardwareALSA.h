@@ -19,8 +19,11 @@
 #define ANDROID_AUDIO_HARDWARE_ALSA_H
 
 #include <utils/List.h>
+#include <utils/KeyedVector.h>
+#include <utils/String8.h>
 #include <utils/threads.h>
 #include <hardware_legacy/AudioHardwareBase.h>
+#include <cutils/atomic.h>
 
 #include <alsa/asoundlib.h>
 
@@ -39,6 +42,58 @@ class AudioHardwareALSA;
 #define ALSA_HARDWARE_MODULE_ID "alsa"
 #define ALSA_HARDWARE_NAME      "alsa"
 
+/**
+ * Stream parameter reporting the PCM transfer mode ("mmap" or "rw")
+ */
+#define ALSA_KEY_ACCESS_MODE    "alsa_access_mode"
+
+/**
+ * Stream parameter reporting "<frames>,<monotonic ns>" of the last
+ * presentation position reading
+ */
+#define ALSA_KEY_PRESENTATION_POSITION "presentation_position"
+
+/**
+ * Stream parameter returning the stream's performance counters
+ */
+#define ALSA_KEY_PERF_STATS     "perf_stats"
+
+/**
+ * Stream parameter selecting the period/buffer layout: "auto",
+ * "low_latency", "default" or "deep_buffer". Applied when the PCM is next
+ * opened; an open stream keeps its layout across re-routes and re-opens.
+ */
+#define ALSA_KEY_LATENCY_PROFILE "alsa_latency_profile"
+
+/**
+ * Period/buffer layouts. ALSA_PROFILE_AUTO lets the module pick one from the
+ * devices and mode the stream is opened with.
+ */
+enum {
+    ALSA_PROFILE_AUTO = -1,
+    ALSA_PROFILE_LOW_LATENCY = 0,   // short periods, quick start
+    ALSA_PROFILE_DEFAULT,
+    ALSA_PROFILE_DEEP_BUFFER,       // long periods, few wakeups
+    ALSA_PROFILE_COUNT
+};
+
+static inline const char *alsaProfileName(int profile)
+{
+    switch (profile) {
+        case ALSA_PROFILE_LOW_LATENCY:  return "low_latency";
+        case ALSA_PROFILE_DEFAULT:      return "default";
+        case ALSA_PROFILE_DEEP_BUFFER:  return "deep_buffer";
+        default:                        return "auto";
+    }
+}
+
+static inline int alsaProfileFromName(const char *name)
+{
+    for (int i = 0; i < ALSA_PROFILE_COUNT; i++)
+        if (strcmp(name, alsaProfileName(i)) == 0) return i;
+    return ALSA_PROFILE_AUTO;
+}
+
 struct alsa_device_t;
 
 struct alsa_handle_t {
@@ -54,6 +109,10 @@ struct alsa_handle_t {
     unsigned int        bufferSize;      // Size of sample buffer
     pthread_mutex_t    mLock;
     void *              modPrivate;
+    snd_pcm_access_t    access;          // Negotiated PCM access type
+    int                 profile;         // Requested ALSA_PROFILE_*
+    int                 curProfile;      // Profile in effect
+    snd_pcm_uframes_t   periodSize;      // Negotiated period in frames
 };
 
 typedef List<alsa_handle_t> ALSAHandleList;
@@ -93,6 +152,13 @@ struct acoustic_device_t {
 
 // ----------------------------------------------------------------------------
 
+struct mixer_info_t;
+
+struct alsa_mixer_volume_t {
+    uint32_t            device;
+    float               volume;
+};
+
 class ALSAMixer
 {
 public:
@@ -106,15 +172,35 @@ public:
     status_t                setVolume(uint32_t device, float left, float right);
     status_t                setGain(uint32_t device, float gain);
 
+    // Apply several playback volumes, writing each mixer element once.
+    // setVolume() goes through here, so devices sharing an element only
+    // write it once.
+    status_t                setVolumes(const alsa_mixer_volume_t *volumes, size_t count);
+
+    // Pick up mixer elements added or removed since construction.
+    void                    refresh();
+
     status_t                setCaptureMuteState(uint32_t device, bool state);
     status_t                getCaptureMuteState(uint32_t device, bool *state);
     status_t                setPlaybackMuteState(uint32_t device, bool state);
     status_t                getPlaybackMuteState(uint32_t device, bool *state);
 
 private:
+    void                    resolveElements(int stream);
+    mixer_info_t *          nextInfo(int stream, uint32_t &devices);
+
     snd_mixer_t *           mMixer[SND_PCM_STREAM_LAST+1];
+
+    // Resolved route controls, indexed by device bit.
+    mixer_info_t *          mDeviceInfo[SND_PCM_STREAM_LAST+1][32];
+
+    // Held for every element access. refresh() runs on a stream thread
+    // while the others set volumes from binder threads.
+    Mutex                   mLock;
 };
 
+struct ctl_elem_t;
+
 class ALSAControl
 {
 public:
@@ -126,8 +212,89 @@ public:
 
     status_t                set(const char *name, const char *);
 
+    // Forget the cached elements the driver removed or changed since the
+    // last call. Call on route changes and hot-plug.
+    void                    refresh();
+
 private:
+    ctl_elem_t *            lookup(const char *name);
+    void                    forget(const char *name);
+    void                    handleEvents();
+
     snd_ctl_t *             mHandle;
+
+    // Resolved elements by name, built on first use.
+    Mutex                   mCacheLock;
+    KeyedVector<String8, ctl_elem_t *> mElems;
+};
+
+/**
+ * Single-producer/single-consumer byte ring. One thread may write and one
+ * other thread may read concurrently without locking. The size must be a
+ * power of 2.
+ */
+class ALSARingBuffer
+{
+public:
+    ALSARingBuffer(size_t size);
+    virtual                ~ALSARingBuffer();
+
+    bool                    isValid() const { return mData != NULL; }
+    size_t                  size() const { return mSize; }
+
+    // Producer side: copy up to bytes into the ring, return bytes copied.
+    size_t                  write(const void *buffer, size_t bytes);
+    size_t                  availableToWrite() const;
+
+    // Consumer side: copy up to bytes out of the ring, return bytes copied.
+    size_t                  read(void *buffer, size_t bytes);
+    size_t                  availableToRead() const;
+
+private:
+    char *                  mData;
+    size_t                  mSize;
+    volatile int32_t        mFront;     // free-running read index
+    volatile int32_t        mRear;      // free-running write index
+};
+
+/**
+ * Always-on per-stream counters. Updated with atomics from the audio thread
+ * and read without locking by dump() and getParameters(); the 64-bit frame
+ * total has no atomic on this platform and takes a short lock instead.
+ */
+class ALSAStreamStats
+{
+public:
+    // Upper bounds of the transfer duration histogram buckets, in usec. The
+    // last bucket collects everything slower.
+    enum { HISTOGRAM_BUCKETS = 8 };
+    static const uint32_t   kBucketLimitUs[HISTOGRAM_BUCKETS - 1];
+
+    ALSAStreamStats();
+
+    void                    reset();
+
+    void                    xrun()      { android_atomic_inc(&mXruns); }
+    void                    recover()   { android_atomic_inc(&mRecovers); }
+    void                    reopen()    { android_atomic_inc(&mReopens); }
+    void                    transfer(nsecs_t duration, size_t frames);
+    int64_t                 frames() const;
+
+    // Human readable block for dump().
+    void                    dump(String8 &result) const;
+    // Compact single value for getParameters("perf_stats").
+    String8                 toString() const;
+
+private:
+    volatile int32_t        mXruns;         // -EPIPE from the driver
+    volatile int32_t        mRecovers;      // snd_pcm_recover() calls
+    volatile int32_t        mReopens;       // -EBADFD re-opens
+    volatile int32_t        mTransfers;
+    int64_t                 mFrames;        // guarded by mFramesLock, an int32
+                                            // wraps after ~13h at 44.1kHz
+    mutable Mutex           mFramesLock;
+    volatile int32_t        mMaxDurationUs;
+    volatile int32_t        mHistogram[HISTOGRAM_BUCKETS];
 };
 
 class ALSAStreamOps
@@ -158,6 +325,8 @@ protected:
     AudioHardwareALSA *     mParent;
     alsa_handle_t *         mHandle;
 
+    ALSAStreamStats         mStats;
+
     Mutex                   mLock;
     bool                    mPowerLock;
 };
@@ -200,19 +369,73 @@ public:
         return ALSAStreamOps::setParameters(keyValuePairs);
     }
 
-    virtual String8     getParameters(const String8& keys) {
-        return ALSAStreamOps::getParameters(keys);
-    }
+    virtual String8     getParameters(const String8& keys);
 
     // return the number of audio frames written by the audio dsp to DAC since
     // the output has exited standby
     virtual status_t    getRenderPosition(uint32_t *dspFrames);
 
+    // return the number of frames played out since the output has exited
+    // standby, and the CLOCK_MONOTONIC time at which that count was valid.
+    // Readings are cached for one period.
+    status_t            getPresentationPosition(uint64_t *frames,
+                                                struct timespec *timestamp) const;
+
     status_t            open(int mode);
     status_t            close();
 
 private:
-    uint32_t            mFrameCount;
+    // Drains the ring to ALSA when the stream runs decoupled from the
+    // mixer thread.
+    class WriterThread : public Thread
+    {
+    public:
+        WriterThread(AudioStreamOutALSA *stream) :
+            Thread(false), mStream(stream) {}
+
+        virtual status_t    readyToRun();
+        virtual bool        threadLoop();
+
+    private:
+        AudioStreamOutALSA *mStream;
+    };
+
+    friend class WriterThread;
+
+    ssize_t             writeToDevice(const void *buffer, size_t bytes);
+    ssize_t             writeToRing(const void *buffer, size_t bytes);
+    bool                drainRing();
+    status_t            startWriter();
+    void                stopWriter();
+    void                waitForRingDrain();
+
+    status_t            updatePosition() const;
+    void                resetPosition();
+
+    bool                mDecoupled;
+    ALSARingBuffer *    mRing;              // set and freed under mRingLock
+    size_t              mRingBytes;         // guarded by mRingLock, ring size
+                                            // fixed at open, 0 if not decoupled
+    sp<WriterThread>    mWriter;
+    char *              mWriterBuffer;
+    size_t              mWriterBufferSize;
+    bool                mWriterExit;        // guarded by mRingLock
+    bool                mWriterBusy;        // guarded by mRingLock, a chunk is
+                                            // off the ring but not written yet
+    mutable Mutex       mRingLock;
+    Condition           mDataCond;          // ring became non-empty
+    Condition           mSpaceCond;         // ring has room / drained
+
+    volatile int32_t    mStreaming;         // between first write and standby
+    volatile int32_t    mRingUnderruns;     // writer found the ring empty
+    volatile int32_t    mRingFullWaits;     // mixer blocked on a full ring
+
+    uint64_t            mFrameCount;        // frames written since standby
+
+    mutable Mutex       mPositionLock;
+    mutable bool        mPositionValid;
+    mutable uint64_t    mPositionFrames;    // frames played at mPositionTime
+    mutable struct timespec mPositionTime;
 };
 
 class AudioStreamInALSA : public AudioStreamIn, public ALSAStreamOps
@@ -81,6 +81,7 @@ ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
 
     snd_pcm_sframes_t n = 0, frames = 0;
     status_t          err;
+    nsecs_t           start = systemTime(SYSTEM_TIME_MONOTONIC);
 
     if (mHandle->handle) {
         frames = snd_pcm_bytes_to_frames(mHandle->handle, bytes);
@@ -97,7 +98,9 @@ ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
         if (n < frames) {
             if (mHandle->handle) {
                 if (n < 0) {
+                    if (n == -EPIPE) mStats.xrun();
                     n = snd_pcm_recover(mHandle->handle, n, 0);
+                    mStats.recover();
 		    
 				    if(ALSARecoveryFrames == -1)
 				    {
@@ -115,6 +118,8 @@ ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
 
 	//lastreadtime = systemTime()/1000;
 
+    mStats.transfer(systemTime(SYSTEM_TIME_MONOTONIC) - start, n);
+
     if (mHandle->handle)
         return static_cast<ssize_t>(snd_pcm_frames_to_bytes(mHandle->handle, n));
 
@@ -123,6 +128,17 @@ ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
 
 status_t AudioStreamInALSA::dump(int fd, const Vector<String16>& args)
 {
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    snprintf(buffer, SIZE, "AudioStreamInALSA::dump\n");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tdevice: 0x%08x frames lost: %u\n", mHandle->curDev, mFramesLost);
+    result.append(buffer);
+    mStats.dump(result);
+    ::write(fd, result.string(), result.size());
+
     return NO_ERROR;
 }
 
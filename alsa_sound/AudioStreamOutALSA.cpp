@@ -22,6 +22,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <time.h>
+#include <sched.h>
 
 //#define LOG_NDEBUG 0
 #define LOG_TAG "AudioHardwareALSA"
@@ -31,6 +33,7 @@
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
+#include <cutils/atomic.h>
 
 #include "AudioHardwareALSA.h"
 
@@ -47,10 +50,93 @@ static const int DEFAULT_SAMPLE_RATE = ALSA_DEFAULT_SAMPLE_RATE;
 
 // ----------------------------------------------------------------------------
 
+// Write interleaved frames straight into the mmap'ed DMA area. Follows the
+// snd_pcm_writei() contract: returns the number of frames written or a
+// negative error code suitable for snd_pcm_recover().
+static snd_pcm_sframes_t mmapWritei(snd_pcm_t *pcm, const void *buffer,
+                                    snd_pcm_uframes_t size)
+{
+    const char *src = (const char *)buffer;
+    snd_pcm_uframes_t written = 0;
+    snd_pcm_uframes_t bufferSize, periodSize;
+
+    if (snd_pcm_get_params(pcm, &bufferSize, &periodSize) < 0 || !periodSize)
+        periodSize = 1;
+
+    while (written < size) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) return written ? (snd_pcm_sframes_t)written : avail;
+
+        snd_pcm_uframes_t wanted = size - written;
+        if (wanted > periodSize) wanted = periodSize;
+
+        if ((snd_pcm_uframes_t)avail < wanted) {
+            // The ring is full. Start a prepared stream now, as writei would
+            // once the start threshold is reached, then wait for room.
+            if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+                int err = snd_pcm_start(pcm);
+                if (err < 0) return written ? (snd_pcm_sframes_t)written : err;
+            }
+            int err = snd_pcm_wait(pcm, 1000);
+            if (err < 0) return written ? (snd_pcm_sframes_t)written : err;
+            if (err == 0) return written ? (snd_pcm_sframes_t)written : -EIO;
+            continue;
+        }
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = size - written;
+
+        int err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+        if (err < 0) return written ? (snd_pcm_sframes_t)written : err;
+
+        // Interleaved access: every channel shares one area, so the frames
+        // are laid out exactly as in the mixer buffer.
+        char *dst = (char *)areas[0].addr +
+                (areas[0].first + offset * areas[0].step) / 8;
+        size_t bytes = snd_pcm_frames_to_bytes(pcm, frames);
+        memcpy(dst, src, bytes);
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, frames);
+        if (committed < 0) return written ? (snd_pcm_sframes_t)written : committed;
+
+        src += snd_pcm_frames_to_bytes(pcm, committed);
+        written += committed;
+        if ((snd_pcm_uframes_t)committed != frames) break;
+    }
+
+    return written;
+}
+
+// ----------------------------------------------------------------------------
+
 AudioStreamOutALSA::AudioStreamOutALSA(AudioHardwareALSA *parent, alsa_handle_t *handle) :
     ALSAStreamOps(parent, handle),
-    mFrameCount(0)
+    mFrameCount(0),
+    mPositionValid(false),
+    mPositionFrames(0),
+    mDecoupled(false),
+    mRing(0),
+    mRingBytes(0),
+    mWriterBuffer(0),
+    mWriterBufferSize(0),
+    mWriterExit(false),
+    mWriterBusy(false),
+    mStreaming(0),
+    mRingUnderruns(0),
+    mRingFullWaits(0)
 {
+    mPositionTime.tv_sec = 0;
+    mPositionTime.tv_nsec = 0;
+
+    // "alsa.playback.decoupled=1" moves the ALSA writes off the mixer thread.
+    char prop[PROPERTY_VALUE_MAX];
+    property_get("alsa.playback.decoupled", prop, "0");
+    mDecoupled = strcmp(prop, "1") == 0;
+
+    // Twice the ALSA buffer keeps a full hardware buffer queued behind the
+    // one being played. Sized now so latency() is stable from the start.
+    if (mDecoupled) mRingBytes = bufferSize() * 2;
 }
 
 AudioStreamOutALSA::~AudioStreamOutALSA()
@@ -70,6 +156,14 @@ status_t AudioStreamOutALSA::setVolume(float left, float right)
 }
 
 ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
+{
+    if (mDecoupled && (mWriter != 0 || startWriter() == NO_ERROR))
+        return writeToRing(buffer, bytes);
+
+    return writeToDevice(buffer, bytes);
+}
+
+ssize_t AudioStreamOutALSA::writeToDevice(const void *buffer, size_t bytes)
 {
     AutoMutex lock(mLock);
 
@@ -88,23 +182,33 @@ ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
     snd_pcm_sframes_t n;
     size_t            sent = 0;
     status_t          err;
+    nsecs_t           start = systemTime(SYSTEM_TIME_MONOTONIC);
 
     while (mHandle->handle && sent < bytes) {
-        n = snd_pcm_writei(mHandle->handle,
+        if (mHandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+            n = mmapWritei(mHandle->handle,
                            (char *)buffer + sent,
                            snd_pcm_bytes_to_frames(mHandle->handle, bytes - sent));
+        else
+            n = snd_pcm_writei(mHandle->handle,
+                               (char *)buffer + sent,
+                               snd_pcm_bytes_to_frames(mHandle->handle, bytes - sent));
         if (n == -EBADFD) {
             // Somehow the stream is in a bad state. The driver probably
             // has a bug and snd_pcm_recover() doesn't seem to handle this.
             mHandle->module->open(mHandle, mHandle->curDev, mHandle->curMode);
+            mStats.reopen();
 
             if (aDev && aDev->recover) aDev->recover(aDev, n);
         }
         else if (n < 0) {
+            if (n == -EPIPE) mStats.xrun();
+
             if (mHandle->handle) {
                 // snd_pcm_recover() will return 0 if successful in recovering from
                 // an error, or -errno if the error was unrecoverable.
                 n = snd_pcm_recover(mHandle->handle, n, 1);
+                mStats.recover();
 
                 if (aDev && aDev->recover) aDev->recover(aDev, n);
 
@@ -113,18 +217,218 @@ ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
         }
         else {
             if (mHandle->handle) {
-                mFrameCount += n;
+                {
+                    AutoMutex positionLock(mPositionLock);
+                    mFrameCount += n;
+                }
                 sent += static_cast<ssize_t>(snd_pcm_frames_to_bytes(mHandle->handle, n));
             }
         }
 
     } 
 
+    if (mHandle->handle)
+        mStats.transfer(systemTime(SYSTEM_TIME_MONOTONIC) - start,
+                        snd_pcm_bytes_to_frames(mHandle->handle, sent));
+
     return sent;
 }
 
+// ----------------------------------------------------------------------------
+
+status_t AudioStreamOutALSA::WriterThread::readyToRun()
+{
+    struct sched_param param;
+    param.sched_priority = 2;
+
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+        LOGW("ALSA writer could not get SCHED_FIFO: %s", strerror(errno));
+
+    return NO_ERROR;
+}
+
+bool AudioStreamOutALSA::WriterThread::threadLoop()
+{
+    return mStream->drainRing();
+}
+
+status_t AudioStreamOutALSA::startWriter()
+{
+    size_t frameBytes = mHandle->channels *
+            snd_pcm_format_physical_width(mHandle->format) / 8;
+
+    ALSARingBuffer *ring = new ALSARingBuffer(mRingBytes);
+    mWriterBufferSize = mHandle->periodSize ? mHandle->periodSize * frameBytes : mRingBytes / 8;
+    mWriterBuffer = (char *)malloc(mWriterBufferSize);
+
+    if (!ring->isValid() || !mWriterBuffer) {
+        LOGE("Unable to allocate the ALSA writer ring, writing directly");
+        delete ring;
+        free(mWriterBuffer);
+        mWriterBuffer = 0;
+        mDecoupled = false;
+        AutoMutex lock(mRingLock);
+        mRingBytes = 0;
+        return NO_MEMORY;
+    }
+
+    {
+        AutoMutex lock(mRingLock);
+        mRing = ring;
+    }
+
+    mWriterExit = false;
+    mWriter = new WriterThread(this);
+    status_t err = mWriter->run("ALSAWriter", ANDROID_PRIORITY_URGENT_AUDIO);
+    if (err != NO_ERROR) {
+        LOGE("Unable to start the ALSA writer thread, writing directly");
+        mWriter.clear();
+        mDecoupled = false;
+        free(mWriterBuffer);
+        mWriterBuffer = 0;
+        AutoMutex lock(mRingLock);
+        delete mRing;
+        mRing = 0;
+        mRingBytes = 0;
+    }
+
+    return err;
+}
+
+void AudioStreamOutALSA::stopWriter()
+{
+    if (mWriter == 0) return;
+
+    {
+        AutoMutex lock(mRingLock);
+        mWriterExit = true;
+        mDataCond.signal();
+    }
+    mWriter->requestExitAndWait();
+    mWriter.clear();
+
+    {
+        AutoMutex lock(mRingLock);
+        delete mRing;
+        mRing = 0;
+    }
+    free(mWriterBuffer);
+    mWriterBuffer = 0;
+}
+
+// Producer side, runs on the mixer thread. Only blocks when the ring is full,
+// which paces the mixer at the hardware rate just as a blocking write would.
+ssize_t AudioStreamOutALSA::writeToRing(const void *buffer, size_t bytes)
+{
+    const char *src = (const char *)buffer;
+    size_t left = bytes;
+
+    android_atomic_release_store(1, &mStreaming);
+
+    while (left) {
+        size_t n = mRing->write(src, left);
+        src += n;
+        left -= n;
+
+        AutoMutex lock(mRingLock);
+        if (n) mDataCond.signal();
+
+        if (left && !mRing->availableToWrite()) {
+            android_atomic_inc(&mRingFullWaits);
+            if (mSpaceCond.waitRelative(mRingLock, seconds(1)) == TIMED_OUT &&
+                !mRing->availableToWrite()) {
+                LOGW("ALSA writer stalled, dropping %d bytes", (int)left);
+                break;
+            }
+        }
+    }
+
+    return bytes - left;
+}
+
+// Consumer side, runs on the writer thread.
+bool AudioStreamOutALSA::drainRing()
+{
+    size_t n;
+
+    {
+        AutoMutex lock(mRingLock);
+
+        // Taking the chunk and marking it busy is one step for standby(),
+        // which must not see an empty ring while the chunk is still unwritten.
+        n = mRing->read(mWriterBuffer, mWriterBufferSize);
+        if (!n) {
+            if (android_atomic_acquire_load(&mStreaming))
+                android_atomic_inc(&mRingUnderruns);
+
+            mSpaceCond.broadcast();
+            while (!mWriterExit && !mRing->availableToRead())
+                mDataCond.wait(mRingLock);
+
+            return !mWriterExit;
+        }
+
+        mWriterBusy = true;
+        mSpaceCond.broadcast();
+    }
+
+    ssize_t err = writeToDevice(mWriterBuffer, n);
+    if (err < 0)
+        LOGW("ALSA writer dropped %d bytes: %s", (int)n, snd_strerror(err));
+
+    {
+        AutoMutex lock(mRingLock);
+        mWriterBusy = false;
+        mSpaceCond.broadcast();
+    }
+
+    return true;
+}
+
+// Let the writer thread empty the ring and finish its last write before the
+// device is drained, bounded by the time the ring takes to play out.
+void AudioStreamOutALSA::waitForRingDrain()
+{
+    if (mWriter == 0) return;
+
+    android_atomic_release_store(0, &mStreaming);
+
+    AutoMutex lock(mRingLock);
+    while (mRing->availableToRead() || mWriterBusy)
+        if (mSpaceCond.waitRelative(mRingLock, milliseconds(mHandle->latency / 500 + 100))
+                == TIMED_OUT)
+            break;
+}
+
 status_t AudioStreamOutALSA::dump(int fd, const Vector<String16>& args)
 {
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    snprintf(buffer, SIZE, "AudioStreamOutALSA::dump\n");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tdevice: 0x%08x profile: %s access: %s\n", mHandle->curDev,
+             alsaProfileName(mHandle->curProfile),
+             mHandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED ? "mmap" : "rw");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tdecoupled: %s\n", mWriter != 0 ? "true" : "false");
+    result.append(buffer);
+    {
+        AutoMutex lock(mRingLock);
+        if (mRing) {
+            snprintf(buffer, SIZE, "\tring: %d/%d bytes\n",
+                     (int)mRing->availableToRead(), (int)mRing->size());
+            result.append(buffer);
+        }
+    }
+    snprintf(buffer, SIZE, "\tring underruns: %d\n", android_atomic_acquire_load(&mRingUnderruns));
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tring full waits: %d\n", android_atomic_acquire_load(&mRingFullWaits));
+    result.append(buffer);
+    mStats.dump(result);
+    ::write(fd, result.string(), result.size());
+
     return NO_ERROR;
 }
 
@@ -137,11 +441,16 @@ status_t AudioStreamOutALSA::open(int mode)
 
 status_t AudioStreamOutALSA::close()
 {
+    // The writer thread takes mLock, stop it first.
+    stopWriter();
+
     AutoMutex lock(mLock);
 
     snd_pcm_drain (mHandle->handle);
     ALSAStreamOps::close();
 
+    resetPosition();
+
     if (mPowerLock) {
         release_wake_lock ("AudioOutLock");
         mPowerLock = false;
@@ -152,6 +461,8 @@ status_t AudioStreamOutALSA::close()
 
 status_t AudioStreamOutALSA::standby()
 {
+    waitForRingDrain();
+
     AutoMutex lock(mLock);
 
     if (mHandle->module->standby)
@@ -166,45 +477,140 @@ status_t AudioStreamOutALSA::standby()
         mPowerLock = false;
     }
 
-    mFrameCount = 0;
+    resetPosition();
 
     return NO_ERROR;
 }
 
 #define USEC_TO_MSEC(x) ((x + 999) / 1000)
 
-uint32_t AudioStreamOutALSA::latency() const
+void AudioStreamOutALSA::resetPosition()
+{
+    AutoMutex lock(mPositionLock);
+
+    mFrameCount = 0;
+    mPositionValid = false;
+    mPositionFrames = 0;
+}
+
+static inline int64_t timespecToNs(const struct timespec &ts)
+{
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Refresh the cached (frames played, timestamp) pair. A reading younger than
+// one period is reused as is; it is still a consistent pair, so callers can
+// extrapolate from it without another trip into the driver.
+// Called with mPositionLock held. The PCM is only touched under the handle
+// lock, which the module holds while it closes or re-opens mHandle->handle
+// (close, route and mode changes, the -EBADFD recovery).
+status_t AudioStreamOutALSA::updatePosition() const
 {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (mPositionValid) {
+        int64_t periodNs = (int64_t)mHandle->periodSize * 1000000000LL / sampleRate();
+        if (timespecToNs(now) - timespecToNs(mPositionTime) < periodNs)
+            return NO_ERROR;
+    }
+
+    snd_pcm_uframes_t bufferSize;
+    snd_pcm_uframes_t avail;
+    struct timespec tstamp;
     int err;
-    int t;
-    snd_pcm_status_t *status;
 
-	snd_pcm_status_alloca(&status);
+    pthread_mutex_lock(&mHandle->mLock);
+    if (mHandle->handle == NULL) {
+        pthread_mutex_unlock(&mHandle->mLock);
+        return NO_INIT;
+    }
+    bufferSize = mHandle->bufferSize;
+    err = snd_pcm_htimestamp(mHandle->handle, &avail, &tstamp);
+    pthread_mutex_unlock(&mHandle->mLock);
+
+    if (err < 0)
+        return mPositionValid ? (status_t)NO_ERROR : (status_t)INVALID_OPERATION;
+
+    // A stream that has not started yet carries no hardware timestamp.
+    if (tstamp.tv_sec == 0 && tstamp.tv_nsec == 0)
+        tstamp = now;
+
+    snd_pcm_uframes_t delay = avail < bufferSize ? bufferSize - avail : 0;
+
+    mPositionFrames = mFrameCount > delay ? mFrameCount - delay : 0;
+    mPositionTime = tstamp;
+    mPositionValid = true;
+
+    return NO_ERROR;
+}
+
+// Latency is the negotiated buffer time; getPresentationPosition() gives the
+// instantaneous delay.
+uint32_t AudioStreamOutALSA::latency() const
+{
+    uint32_t ms = USEC_TO_MSEC (mHandle->latency);
 
-    if(mHandle->handle == NULL) {
-        LOGV("handle is null, error !");
-        return 0;
+    // Audio queued in the writer ring plays after the ALSA buffer.
+    size_t ringBytes;
+    {
+        AutoMutex lock(mRingLock);
+        ringBytes = mRingBytes;
+    }
+    if (ringBytes) {
+        size_t frameBytes = mHandle->channels *
+                snd_pcm_format_physical_width(mHandle->format) / 8;
+        ms += (ringBytes / frameBytes) * 1000 / sampleRate();
     }
-	
-	if ((err = snd_pcm_status(mHandle->handle, status)) < 0) {
-	 LOGV("stream status error :%s\n", snd_strerror(err));
-        return USEC_TO_MSEC (mHandle->latency);
-	}
 
-    t = snd_pcm_status_get_delay(status);
-    LOGV("snd_pcm_status_get_delay = %d", t);
-    LOGV("AudioStreamOutALSA::latency = %d, sampleRate = %d", 
-        (t * 1000) / sampleRate(),
-        sampleRate());
-    return (t * 1000) / sampleRate();
+    return ms;
 }
 
 // return the number of audio frames written by the audio dsp to DAC since
 // the output has exited standby
 status_t AudioStreamOutALSA::getRenderPosition(uint32_t *dspFrames)
 {
-    *dspFrames = mFrameCount;
+    AutoMutex lock(mPositionLock);
+
+    status_t err = updatePosition();
+    if (err != NO_ERROR) return err;
+
+    *dspFrames = (uint32_t)mPositionFrames;
     return NO_ERROR;
 }
 
+status_t AudioStreamOutALSA::getPresentationPosition(uint64_t *frames,
+                                                     struct timespec *timestamp) const
+{
+    AutoMutex lock(mPositionLock);
+
+    status_t err = updatePosition();
+    if (err != NO_ERROR) return err;
+
+    *frames = mPositionFrames;
+    *timestamp = mPositionTime;
+    return NO_ERROR;
+}
+
+String8 AudioStreamOutALSA::getParameters(const String8& keys)
+{
+    AudioParameter param = AudioParameter(ALSAStreamOps::getParameters(keys));
+    String8 key = String8(ALSA_KEY_PRESENTATION_POSITION);
+    String8 value;
+
+    if (param.get(key, value) == NO_ERROR) {
+        uint64_t frames;
+        struct timespec timestamp;
+
+        if (getPresentationPosition(&frames, &timestamp) == NO_ERROR) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%llu,%lld", (unsigned long long)frames,
+                     (long long)timespecToNs(timestamp));
+            param.add(key, String8(buf));
+        }
+    }
+
+    return param.toString();
+}
+
 }       // namespace android
@@ -111,6 +111,10 @@ static alsa_handle_t _defaultsOut = {
     bufferSize  : DEFAULT_SAMPLE_RATE / 10, // Desired Number of samples
     mLock       : PTHREAD_MUTEX_INITIALIZER,
     modPrivate  : 0,
+    access      : SND_PCM_ACCESS_RW_INTERLEAVED,
+    profile     : ALSA_PROFILE_AUTO,
+    curProfile  : ALSA_PROFILE_DEFAULT,
+    periodSize  : 0,
 };
 static const char* builtinAudio = "builtin-audio";
 
@@ -127,6 +131,10 @@ static alsa_handle_t _defaultsIn = {
     bufferSize  : DEFAULT_SAMPLE_RATE/10, // Desired Number of samples
     mLock       : PTHREAD_MUTEX_INITIALIZER,
     modPrivate  : 0,
+    access      : SND_PCM_ACCESS_RW_INTERLEAVED,
+    profile     : ALSA_PROFILE_AUTO,
+    curProfile  : ALSA_PROFILE_DEFAULT,
+    periodSize  : 0,
 };
 
 static const char* usbAudio = "usb-audio";
@@ -144,6 +152,24 @@ static alsa_handle_t _defaultsUSBIn = {
     bufferSize  : DEFAULT_SAMPLE_RATE/10, // Desired Number of samples
     mLock       : PTHREAD_MUTEX_INITIALIZER,
     modPrivate  : 0,
+    access      : SND_PCM_ACCESS_RW_INTERLEAVED,
+    profile     : ALSA_PROFILE_AUTO,
+    curProfile  : ALSA_PROFILE_DEFAULT,
+    periodSize  : 0,
+};
+
+struct latency_profile_t {
+    unsigned int bufferTime;    // Desired buffer time in usec
+    unsigned int periods;       // Periods per buffer
+};
+
+/* Indexed by ALSA_PROFILE_*. The period count sets the wakeup rate:
+ * avail_min is one period, so the writer sleeps a full period at a time.
+ */
+static const latency_profile_t latencyProfile[ALSA_PROFILE_COUNT] = {
+        /* ALSA_PROFILE_LOW_LATENCY : */{ 40000, 2},
+        /* ALSA_PROFILE_DEFAULT     : */{100000, 4},
+        /* ALSA_PROFILE_DEEP_BUFFER : */{400000, 2},
 };
 
 struct device_suffix_t {
@@ -289,14 +315,49 @@ static int getDeviceNum(snd_pcm_stream_t stream, char* card_name)
 	return amlcard;
 }
 
+// Pick the period/buffer layout for a stream. An explicit request through
+// setParameters() wins; otherwise calls, ringtones and SCO get short periods
+// and normal playback follows "alsa.playback.profile".
+static int selectProfile(alsa_handle_t *handle, uint32_t devices, int mode)
+{
+    if (handle->profile != ALSA_PROFILE_AUTO)
+        return handle->profile;
+
+    if (direction(handle) == SND_PCM_STREAM_CAPTURE)
+        return ALSA_PROFILE_DEFAULT;
+
+    if (mode == AudioSystem::MODE_IN_CALL ||
+        mode == AudioSystem::MODE_RINGTONE ||
+        (devices & AudioSystem::DEVICE_OUT_BLUETOOTH_SCO))
+        return ALSA_PROFILE_LOW_LATENCY;
+
+    char prop[PROPERTY_VALUE_MAX];
+    property_get("alsa.playback.profile", prop, "default");
+
+    int profile = alsaProfileFromName(prop);
+    return profile == ALSA_PROFILE_AUTO ? ALSA_PROFILE_DEFAULT : profile;
+}
+
+// mmap playback can be turned off with "alsa.playback.mmap=0" for drivers
+// that advertise mmap access but do not handle it well.
+static bool useMmapPlayback()
+{
+    char prop[PROPERTY_VALUE_MAX];
+
+    property_get("alsa.playback.mmap", prop, "1");
+    return strcmp(prop, "0") != 0;
+}
+
 status_t setHardwareParams(alsa_handle_t *handle)
 {
     snd_pcm_hw_params_t *hardwareParams;
     status_t err;
 
-    snd_pcm_uframes_t bufferSize = handle->bufferSize;
+    const latency_profile_t *profile = &latencyProfile[handle->curProfile];
+    snd_pcm_uframes_t bufferSize;
+    snd_pcm_uframes_t periodSize;
     unsigned int requestedRate = handle->sampleRate;
-    unsigned int latency = handle->latency;
+    unsigned int latency = profile->bufferTime;
 
     // snd_pcm_format_description() and snd_pcm_format_name() do not perform
     // proper bounds checking.
@@ -319,15 +380,34 @@ status_t setHardwareParams(alsa_handle_t *handle)
         goto done;
     }
 
+    // Playback prefers mmap access so the HAL can write straight into the
+    // DMA area. Fall back to the interleaved read/write format when the
+    // driver does not support it.
+    handle->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+    if (direction(handle) == SND_PCM_STREAM_PLAYBACK && useMmapPlayback()) {
+        err = snd_pcm_hw_params_set_access(handle->handle, hardwareParams,
+                SND_PCM_ACCESS_MMAP_INTERLEAVED);
+        if (err < 0)
+            LOGW("PCM mmap access unavailable, using read/write: %s",
+                    snd_strerror(err));
+        else
+            handle->access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+    }
+
     // Set the interleaved read and write format.
-    err = snd_pcm_hw_params_set_access(handle->handle, hardwareParams,
-            SND_PCM_ACCESS_RW_INTERLEAVED);
-    if (err < 0) {
-        LOGE("Unable to configure PCM read/write format: %s",
-                snd_strerror(err));
-        goto done;
+    if (handle->access == SND_PCM_ACCESS_RW_INTERLEAVED) {
+        err = snd_pcm_hw_params_set_access(handle->handle, hardwareParams,
+                SND_PCM_ACCESS_RW_INTERLEAVED);
+        if (err < 0) {
+            LOGE("Unable to configure PCM read/write format: %s",
+                    snd_strerror(err));
+            goto done;
+        }
     }
 
+    LOGI("Using %s access for %s", handle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED ?
+            "mmap" : "read/write", streamName(handle));
+
     err = snd_pcm_hw_params_set_format(handle->handle, hardwareParams,
             handle->format);
     if (err < 0) {
@@ -378,6 +458,12 @@ status_t setHardwareParams(alsa_handle_t *handle)
     }
 #endif
 
+    // Start from the profile's buffer time, rounded down to a power of 2
+    // frames like the defaults in s_init().
+    bufferSize = (snd_pcm_uframes_t)((uint64_t)requestedRate * latency / 1000000);
+    for (size_t i = 1; (bufferSize & ~i) != 0; i <<= 1)
+        bufferSize &= ~i;
+
     // Make sure we have at least the size we originally wanted
     err = snd_pcm_hw_params_set_buffer_size_near(handle->handle, hardwareParams,
             &bufferSize);
@@ -393,22 +479,22 @@ status_t setHardwareParams(alsa_handle_t *handle)
             hardwareParams, &latency, NULL);
     if (err < 0) {
         /* That didn't work, set the period instead */
-        unsigned int periodTime = latency / 4;
+        unsigned int periodTime = latency / profile->periods;
         err = snd_pcm_hw_params_set_period_time_near(handle->handle,
                 hardwareParams, &periodTime, NULL);
         if (err < 0) {
             LOGE("Unable to set the period time for latency: %s", snd_strerror(err));
             goto done;
         }
-        snd_pcm_uframes_t periodSize;
         err = snd_pcm_hw_params_get_period_size(hardwareParams, &periodSize,
                 NULL);
         if (err < 0) {
             LOGE("Unable to get the period size for latency: %s", snd_strerror(err));
             goto done;
         }
-        bufferSize = periodSize * 4;
-        if (bufferSize < handle->bufferSize) bufferSize = handle->bufferSize;
+        snd_pcm_uframes_t minBufferSize = bufferSize;
+        bufferSize = periodSize * profile->periods;
+        if (bufferSize < minBufferSize) bufferSize = minBufferSize;
         err = snd_pcm_hw_params_set_buffer_size_near(handle->handle,
                 hardwareParams, &bufferSize);
         if (err < 0) {
@@ -428,7 +514,7 @@ status_t setHardwareParams(alsa_handle_t *handle)
             LOGE("Unable to get the buffer time for latency: %s", snd_strerror(err));
             goto done;
         }
-        unsigned int periodTime = latency / 4;
+        unsigned int periodTime = latency / profile->periods;
         err = snd_pcm_hw_params_set_period_time_near(handle->handle,
                 hardwareParams, &periodTime, NULL);
         if (err < 0) {
@@ -437,16 +523,28 @@ status_t setHardwareParams(alsa_handle_t *handle)
         }
     }
 
+    // Commit the hardware parameters back to the device.
+    err = snd_pcm_hw_params(handle->handle, hardwareParams);
+    if (err < 0) {
+        LOGE("Unable to set hardware parameters: %s", snd_strerror(err));
+        goto done;
+    }
+
+    // Report what the driver actually settled on.
+    snd_pcm_hw_params_get_buffer_size(hardwareParams, &bufferSize);
+    snd_pcm_hw_params_get_buffer_time(hardwareParams, &latency, NULL);
+    if (snd_pcm_hw_params_get_period_size(hardwareParams, &periodSize, NULL) < 0)
+        periodSize = bufferSize / profile->periods;
+
+    LOGI("Profile: %s", alsaProfileName(handle->curProfile));
     LOGI("Buffer size: %d", (int)bufferSize);
+    LOGI("Period size: %d", (int)periodSize);
     LOGI("Latency: %d", (int)latency);
 
     handle->bufferSize = bufferSize;
+    handle->periodSize = periodSize;
     handle->latency = latency;
 
-    // Commit the hardware parameters back to the device.
-    err = snd_pcm_hw_params(handle->handle, hardwareParams);
-    if (err < 0) LOGE("Unable to set hardware parameters: %s", snd_strerror(err));
-
     done:
     snd_pcm_hw_params_free(hardwareParams);
 
@@ -515,6 +613,13 @@ status_t setSoftwareParams(alsa_handle_t *handle)
         goto done;
     }
 
+    // Have the driver timestamp status reads so the HAL can report a
+    // presentation position without sampling the clock itself.
+    err = snd_pcm_sw_params_set_tstamp_mode(handle->handle, softwareParams,
+            SND_PCM_TSTAMP_ENABLE);
+    if (err < 0)
+        LOGW("Unable to enable PCM timestamps: %s", snd_strerror(err));
+
     // Commit the software parameters back to the device.
     err = snd_pcm_sw_params(handle->handle, softwareParams);
     if (err < 0) LOGE("Unable to configure software parameters: %s",
@@ -579,6 +684,11 @@ static status_t s_open(alsa_handle_t *handle, uint32_t devices, int mode)
     if( devices == 0 ){
     	return BAD_VALUE;
 	}
+
+    // Re-opening a live stream (re-route, mode change, -EBADFD recovery)
+    // keeps its period layout; the buffer size AudioFlinger was given at
+    // open has to stay valid.
+    bool reopen = handle->handle != 0;
     s_close(handle);
 
     pthread_mutex_lock(&handle->mLock);
@@ -656,6 +766,9 @@ static status_t s_open(alsa_handle_t *handle, uint32_t devices, int mode)
         return NO_INIT;
     }
 
+    if (!reopen)
+        handle->curProfile = selectProfile(handle, devices, mode);
+
     err = setHardwareParams(handle);
 
     if (err == NO_ERROR) err = setSoftwareParams(handle);
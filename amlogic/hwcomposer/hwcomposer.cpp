@@ -36,6 +36,8 @@
 
 /*****************************************************************************/
 
+#define HWC_MAX_TRACKED_LAYERS 32
+
 struct hwc_context_t {
     hwc_composer_device_t device;
     /* our private state goes below here */
@@ -45,6 +47,17 @@ struct hwc_context_t {
     int saved_top;
     int saved_right;
     int saved_bottom;
+
+    /* layer handles of the last frame composed with GL and swapped to the framebuffer,
+     * video overlay layers are recorded as NULL since their content does not reach it */
+    buffer_handle_t composed[HWC_MAX_TRACKED_LAYERS];
+    size_t composed_count;
+    bool composed_valid;
+    /* set by prepare when the framebuffer already shows the non-video layers */
+    bool reuse_fb;
+
+    unsigned composed_frames;
+    unsigned reused_frames;
 };
 
 static int hwc_device_open(const struct hw_module_t* module, const char* name,
@@ -79,7 +92,7 @@ static void hwc_overlay_compose(hwc_composer_device_t *dev, hwc_layer_t const* l
         (ctx->saved_left == l->displayFrame.left) &&
         (ctx->saved_top == l->displayFrame.top) &&
         (ctx->saved_right == l->displayFrame.right) &&
-        (ctx->saved_bottom = l->displayFrame.bottom)) {
+        (ctx->saved_bottom == l->displayFrame.bottom)) {
         return;
     }
 
@@ -127,24 +140,81 @@ static void dump_layer(hwc_layer_t const* l) {
             l->displayFrame.bottom);
 }
 
+static bool is_video_overlay(hwc_layer_t const* l) {
+    if (!l->handle || (l->flags & HWC_SKIP_LAYER)) {
+        return false;
+    }
+
+    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(l->handle);
+    if (!(hnd->flags & private_handle_t::PRIV_FLAGS_VIDEO_OVERLAY)) {
+        return false;
+    }
+
+    // the video layer can only rotate, flipped video still goes through GL
+    switch (l->transform) {
+        case 0:
+        case HAL_TRANSFORM_ROT_90:
+        case HAL_TRANSFORM_ROT_180:
+        case HAL_TRANSFORM_ROT_270:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * The framebuffer can be left as it is when nothing but video layers changed
+ * since the last GL composition: same layer list, same buffers for every
+ * other layer. The video itself is shown by the video layer underneath.
+ */
+static bool can_reuse_fb(struct hwc_context_t* ctx, hwc_layer_list_t* list, bool has_video) {
+    if (!has_video || !ctx->composed_valid || (list->flags & HWC_GEOMETRY_CHANGED) ||
+        list->numHwLayers != ctx->composed_count) {
+        return false;
+    }
+
+    for (size_t i=0 ; i<list->numHwLayers ; i++) {
+        hwc_layer_t const* l = &list->hwLayers[i];
+        if (l->flags & HWC_SKIP_LAYER) {
+            return false;
+        }
+        if (l->compositionType == HWC_FRAMEBUFFER && l->handle != ctx->composed[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static int hwc_prepare(hwc_composer_device_t *dev, hwc_layer_list_t* list) {
-    if (list && (list->flags & HWC_GEOMETRY_CHANGED)) {
-        for (size_t i=0 ; i<list->numHwLayers ; i++) {
-            hwc_layer_t* l = &list->hwLayers[i];
-#if 0
-            //dump_layer(l);
-            if (l->handle) {
-                private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(l->handle);
-                if (hnd->flags & private_handle_t::PRIV_FLAGS_VIDEO_OVERLAY) {
-                    l->hints = HWC_HINT_CLEAR_FB;
-                    l->compositionType = HWC_OVERLAY;
-                    continue;
-                }
-            }
-#endif
+    struct hwc_context_t* ctx = (struct hwc_context_t*)dev;
+    bool has_video = false;
+
+    ctx->reuse_fb = false;
+    if (!list) {
+        return 0;
+    }
+
+    // classify every frame, a previous frame may have claimed all layers to skip GL
+    for (size_t i=0 ; i<list->numHwLayers ; i++) {
+        hwc_layer_t* l = &list->hwLayers[i];
+        //dump_layer(l);
+        if (is_video_overlay(l)) {
+            l->hints = HWC_HINT_CLEAR_FB;
+            l->compositionType = HWC_OVERLAY;
+            has_video = true;
+        } else {
+            l->hints = 0;
             l->compositionType = HWC_FRAMEBUFFER;
         }
     }
+
+    if (can_reuse_fb(ctx, list, has_video)) {
+        // with no framebuffer layers left SurfaceFlinger skips GL composition entirely
+        for (size_t i=0 ; i<list->numHwLayers ; i++) {
+            list->hwLayers[i].compositionType = HWC_OVERLAY;
+        }
+        ctx->reuse_fb = true;
+    }
     return 0;
 }
 
@@ -153,34 +223,52 @@ static int hwc_set(hwc_composer_device_t *dev,
         hwc_surface_t sur,
         hwc_layer_list_t* list)
 {
+    struct hwc_context_t* ctx = (struct hwc_context_t*)dev;
+
     if (list == NULL) {
+        ctx->composed_valid = false;
         return 0;
     }
 
     for (size_t i=0 ; i<list->numHwLayers ; i++) {
         hwc_layer_t* l = &list->hwLayers[i];
-#if 0
-        if (l->compositionType == HWC_OVERLAY) {
+        if (l->compositionType == HWC_OVERLAY && is_video_overlay(l)) {
             //dump_layer(l);
             hwc_overlay_compose(dev, l);
         }
-#else
-        if (l->handle) {
-            private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(l->handle);
-            if (hnd->flags & private_handle_t::PRIV_FLAGS_VIDEO_OVERLAY) {
-                hwc_overlay_compose(dev, l);
-            }
-        }
-#endif
+    }
+
+    if (ctx->reuse_fb) {
+        ctx->reused_frames++;
+        return 0;
     }
 
     EGLBoolean sucess = eglSwapBuffers((EGLDisplay)dpy, (EGLSurface)sur);
     if (!sucess) {
+        ctx->composed_valid = false;
         return HWC_EGL_ERROR;
     }
+
+    ctx->composed_frames++;
+    ctx->composed_valid = list->numHwLayers <= HWC_MAX_TRACKED_LAYERS;
+    if (ctx->composed_valid) {
+        ctx->composed_count = list->numHwLayers;
+        for (size_t i=0 ; i<list->numHwLayers ; i++) {
+            hwc_layer_t const* l = &list->hwLayers[i];
+            ctx->composed[i] = (l->compositionType == HWC_FRAMEBUFFER) ? l->handle : NULL;
+        }
+    }
     return 0;
 }
 
+static void hwc_dump(hwc_composer_device_t *dev, char *buff, int buff_len)
+{
+    struct hwc_context_t* ctx = (struct hwc_context_t*)dev;
+
+    snprintf(buff, buff_len, "hwcomposer: %u frames composed with GL, %u video-only frames kept the framebuffer\n",
+            ctx->composed_frames, ctx->reused_frames);
+}
+
 static int hwc_device_close(struct hw_device_t *dev)
 {
     struct hwc_context_t* ctx = (struct hwc_context_t*)dev;
@@ -211,6 +299,7 @@ static int hwc_device_open(const struct hw_module_t* module, const char* name,
 
         dev->device.prepare = hwc_prepare;
         dev->device.set = hwc_set;
+        dev->device.dump = hwc_dump;
 
         *device = &dev->device.common;
         status = 0;
@@ -30,8 +30,11 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_CFLAGS := -DLOG_TAG=\"Sensors\"
 LOCAL_SRC_FILES := 						\
 				sensors.cpp 			\
+				../mma7660/InputEventReader.cpp	\
 				
-LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../mma7660 $(LOCAL_PATH)/../fusion
+LOCAL_STATIC_LIBRARIES := libsensors_fusion
+LOCAL_SHARED_LIBRARIES := liblog libcutils libm
 LOCAL_PRELINK_MODULE := false
 
 include $(BUILD_SHARED_LIBRARY)
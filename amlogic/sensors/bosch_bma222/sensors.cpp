@@ -26,6 +26,11 @@
 #include <linux/input.h>
 #include <cutils/atomic.h>
 #include <cutils/log.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "InputEventReader.h"
+#include "sensor_fusion.h"
 
 //#define DEBUG_SENSOR		1
 
@@ -36,13 +41,72 @@
 #define SENSOR_NAME		"bma222"
 #define INPUT_DIR               "/dev/input"
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+// input events fetched per read(), enough for several samples
+#define INPUT_EVENTS_PER_READ	32
+
+/*
+ * Gravity and linear acceleration come from the software fusion stage,
+ * fed by the accelerometer. There is no magnetic field source on these
+ * boards, so no orientation sensor is registered.
+ */
+#define SENSORS_ACCELERATION_HANDLE	0
+#define SENSORS_GRAVITY_HANDLE		6
+#define SENSORS_LINEAR_ACCEL_HANDLE	7
+
+enum {
+	Accelerometer = 0,
+	Gravity,
+	LinearAccel,
+	numSensors
+};
+
+#define SENSORS_FUSION_MASK	((1<<Gravity) | (1<<LinearAccel))
 
 struct sensors_poll_context_t {
 	struct sensors_poll_device_t device; 
 	int fd;
 	char class_path[256];
+	InputEventCircularReader reader;
+	int raw[3];			/* last ABS_X, ABS_Y, ABS_Z */
+	float axis[3][3];		/* raw axes to m/s^2 in device axes */
+
+	/* activate()/setDelay() are serialized by the sensor service */
+	volatile uint32_t enabled;	/* 1<<Accelerometer, ... */
+	int64_t delay[numSensors];	/* ns, -1 until set */
+	int delay_ms;			/* last written, -1 for the driver default */
+
+	/* only touched by the polling thread, restarted through fusion_reset */
+	struct sensor_fusion_t fusion;
+	volatile int fusion_reset;
+
+	sensors_poll_context_t() : fd(-1), reader(INPUT_EVENTS_PER_READ),
+			enabled(0), delay_ms(-1), fusion_reset(1) {
+		memset(raw, 0, sizeof(raw));
+		memset(axis, 0, sizeof(axis));
+		for (int i = 0; i < numSensors; i++)
+			delay[i] = -1;
+		sensor_fusion_init(&fusion, SENSOR_FUSION_DEFAULT_TIME_CONSTANT);
+	}
 };
 
+static int handle_to_sensor(int handle)
+{
+	switch (handle) {
+	case SENSORS_ACCELERATION_HANDLE:	return Accelerometer;
+	case SENSORS_GRAVITY_HANDLE:		return Gravity;
+	case SENSORS_LINEAR_ACCEL_HANDLE:	return LinearAccel;
+	}
+	return -EINVAL;
+}
+
+static void build_axis_matrix(sensors_poll_context_t *dev)
+{
+	memset(dev->axis, 0, sizeof(dev->axis));
+	dev->axis[0][1] = CONVERT_X;
+	dev->axis[1][0] = -(CONVERT_Y);
+	dev->axis[2][2] = CONVERT_Z;
+}
+
 static int set_sysfs_input_attr(char *class_path,
 				const char *attr, char *value, int len)
 {
@@ -78,17 +142,51 @@ static int poll__close(struct hw_device_t *dev)
 	return 0;
 }
 
-static int poll__activate(struct sensors_poll_device_t *device,
-        int handle, int enabled) {
+/* the hardware runs at the fastest rate any enabled sensor asked for */
+static int apply_delay(sensors_poll_context_t *dev)
+{
+	int64_t ns = -1;
+	for (int i = 0; i < numSensors; i++) {
+		if ((dev->enabled & (1<<i)) && dev->delay[i] >= 0 &&
+		    (ns < 0 || dev->delay[i] < ns))
+			ns = dev->delay[i];
+	}
+	int ms = ns / 1000000;
+	if (ns < 0 || ms == dev->delay_ms)
+		return 0;
 
-	sensors_poll_context_t *dev = (sensors_poll_context_t *)device;
 	char buffer[20];
+	int bytes = sprintf(buffer, "%d\n", ms);
+	int err = set_sysfs_input_attr(dev->class_path,"delay",buffer,bytes);
+	if (!err)
+		dev->delay_ms = ms;
+	return err;
+}
 
-	int bytes = sprintf(buffer, "%d\n", enabled);
+static int poll__activate(struct sensors_poll_device_t *device,
+        int handle, int enabled) {
 
-	set_sysfs_input_attr(dev->class_path,"enable",buffer,bytes);
+	sensors_poll_context_t *dev = (sensors_poll_context_t *)device;
+	int what = handle_to_sensor(handle);
+	if (what < 0)
+		return what;
+
+	uint32_t mask = enabled ? dev->enabled | (1<<what) : dev->enabled & ~(1<<what);
+	int err = 0;
+
+	/* the chip runs as long as the accelerometer or a fusion output is wanted */
+	if (!mask != !dev->enabled) {
+		char buffer[20];
+		int bytes = sprintf(buffer, "%d\n", mask ? 1 : 0);
+		err = set_sysfs_input_attr(dev->class_path,"enable",buffer,bytes);
+		if (err)
+			return err;
+	}
+	if ((mask & SENSORS_FUSION_MASK) && !(dev->enabled & SENSORS_FUSION_MASK))
+		dev->fusion_reset = 1;		/* start the filters over */
+	dev->enabled = mask;
 
-	return 0;
+	return apply_delay(dev);
 }
 
 
@@ -97,70 +195,120 @@ static int poll__setDelay(struct sensors_poll_device_t *device,
         int handle, int64_t ns) {
 
 	sensors_poll_context_t *dev = (sensors_poll_context_t *)device;
-	char buffer[20];
-	int ms=ns/1000000;
-	int bytes = sprintf(buffer, "%d\n", ms);
-
-	set_sysfs_input_attr(dev->class_path,"delay",buffer,bytes);
+	int what = handle_to_sensor(handle);
+	if (what < 0 || ns < 0)
+		return -EINVAL;
 
-	return 0;
+	dev->delay[what] = ns;
+	return apply_delay(dev);
+}
 
+static void init_event(sensors_event_t *data, int handle, int type, int64_t timestamp)
+{
+	memset(data, 0, sizeof(*data));
+	data->version = sizeof(sensors_event_t);
+	data->sensor = handle;
+	data->type = type;
+	data->timestamp = timestamp;
+	data->acceleration.status = SENSOR_STATUS_ACCURACY_HIGH;
 }
 
 static int poll__poll(struct sensors_poll_device_t *device,
         sensors_event_t* data, int count) {
 	
-	struct input_event event;
-	int ret;
+	input_event const* event;
+	int numEventReceived = 0;
 	sensors_poll_context_t *dev = (sensors_poll_context_t *)device;
 
 	if (dev->fd < 0)
 	return 0;
 
+	if (dev->fusion_reset) {
+		dev->fusion_reset = 0;
+		sensor_fusion_init(&dev->fusion, SENSOR_FUSION_DEFAULT_TIME_CONSTANT);
+	}
+
+	/*
+	 * One read() fetches every event the driver has queued, turn as many
+	 * of them into samples as the caller has room for. Only block in
+	 * read() when nothing is left over from the last call.
+	 */
 	while (1) {
-	
-		ret = read(dev->fd, &event, sizeof(event));
-
-		if (event.type == EV_ABS) {
-
-			switch (event.code) {
-			case ABS_X:
-				data->acceleration.y =
-						-event.value * CONVERT_Y;
-				break;
-			case ABS_Y:
-				data->acceleration.x =
-						event.value * CONVERT_X;				
-				break;
-			case ABS_Z:
-				data->acceleration.z =
-						event.value * CONVERT_Z;
-				break;
-			}
-		} else if (event.type == EV_SYN) {
-
-			data->timestamp =
-			(int64_t)((int64_t)event.time.tv_sec*1000000000
-					+ (int64_t)event.time.tv_usec*1000);
-			data->sensor = 0;
-			data->type = SENSOR_TYPE_ACCELEROMETER;
-			data->acceleration.status = SENSOR_STATUS_ACCURACY_HIGH;
-			
-		
+		while (count && dev->reader.readEvent(&event)) {
+
+			if (event->type == EV_ABS) {
+				if (event->code <= ABS_Z)
+					dev->raw[event->code] = event->value;
+			} else if (event->type == EV_SYN) {
+				const float (*m)[3] = dev->axis;
+				float x = dev->raw[0], y = dev->raw[1], z = dev->raw[2];
+				uint32_t enabled = dev->enabled;
+				int wanted = ((enabled >> Accelerometer) & 1) +
+						((enabled >> Gravity) & 1) + ((enabled >> LinearAccel) & 1);
+				float accel[3];
+				int64_t timestamp =
+				(int64_t)((int64_t)event->time.tv_sec*1000000000
+						+ (int64_t)event->time.tv_usec*1000);
+
+				/* keep the sample for the next call rather than split it */
+				if (wanted > count && numEventReceived)
+					break;
+
+				accel[0] = m[0][0] * x + m[0][1] * y + m[0][2] * z;
+				accel[1] = m[1][0] * x + m[1][1] * y + m[1][2] * z;
+				accel[2] = m[2][0] * x + m[2][1] * y + m[2][2] * z;
+
+				if (enabled & SENSORS_FUSION_MASK) {
+					struct sensor_fusion_output_t out;
+					sensor_fusion_add_accel(&dev->fusion, accel, timestamp, &out);
+					if (count && (enabled & (1<<Gravity))) {
+						init_event(data, SENSORS_GRAVITY_HANDLE,
+								SENSOR_TYPE_GRAVITY, timestamp);
+						memcpy(data->acceleration.v, out.gravity, sizeof(out.gravity));
+						data++;
+						count--;
+						numEventReceived++;
+					}
+					if (count && (enabled & (1<<LinearAccel))) {
+						init_event(data, SENSORS_LINEAR_ACCEL_HANDLE,
+								SENSOR_TYPE_LINEAR_ACCELERATION, timestamp);
+						memcpy(data->acceleration.v, out.linear_accel,
+								sizeof(out.linear_accel));
+						data++;
+						count--;
+						numEventReceived++;
+					}
+				}
+				if (!count || !(enabled & (1<<Accelerometer))) {
+					dev->reader.next();
+					continue;
+				}
+
+				init_event(data, SENSORS_ACCELERATION_HANDLE,
+						SENSOR_TYPE_ACCELEROMETER, timestamp);
+				memcpy(data->acceleration.v, accel, sizeof(accel));
+
 #ifdef DEBUG_SENSOR
-			LOGD("Sensor data: t x,y,x: %f %f, %f, %f\n",
-					data->timestamp / 1000000000.0,
-							data->acceleration.x,
-							data->acceleration.y,
-							data->acceleration.z);
+				LOGD("Sensor data: t x,y,x: %f %f, %f, %f\n",
+						data->timestamp / 1000000000.0,
+								data->acceleration.x,
+								data->acceleration.y,
+								data->acceleration.z);
 #endif
-			
-		return 1;	
-
+				data++;
+				count--;
+				numEventReceived++;
+			}
+			dev->reader.next();
 		}
+
+		if (numEventReceived || !count)
+			return numEventReceived;
+
+		ssize_t n = dev->reader.fill(dev->fd);
+		if (n < 0)
+			return n;
 	}
-	
-	return 0;
 }
 
 
@@ -269,7 +417,7 @@ static const struct sensor_t sSensorList[] = {
 
         { 	"BMA222 3-axis Accelerometer",
                 "Bosch",
-                1, 0,
+                1, SENSORS_ACCELERATION_HANDLE,
                 SENSOR_TYPE_ACCELEROMETER, 
 		4.0f*9.81f, 
 		(4.0f*9.81f)/256.0f, 
@@ -277,6 +425,14 @@ static const struct sensor_t sSensorList[] = {
 		0, 
 		{ } 
 	},
+	{ "Gravity sensor (software fusion)",
+	  "Amlogic",
+	  1, SENSORS_GRAVITY_HANDLE,
+	  SENSOR_TYPE_GRAVITY, 4.0f*9.81f, (4.0f*9.81f)/256.0f, 0.2f, 0, { } },
+	{ "Linear Acceleration sensor (software fusion)",
+	  "Amlogic",
+	  1, SENSORS_LINEAR_ACCEL_HANDLE,
+	  SENSOR_TYPE_LINEAR_ACCELERATION, 4.0f*9.81f, (4.0f*9.81f)/256.0f, 0.2f, 0, { } },
 	#ifdef ENABLE_LIGHT_SENSOR
       { "Light sensor",
           "(none)",
@@ -339,6 +495,7 @@ static int open_sensors(const struct hw_module_t* module, const char* name,
 		return -1;
 	}
 
+	build_axis_matrix(dev);
 	dev->fd = open_input_device();
 	*device = &dev->device.common;
 	status = 0;
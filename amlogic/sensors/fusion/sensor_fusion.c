@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "sensor_fusion.h"
+
+/*****************************************************************************/
+
+#define RAD2DEG         (57.29577951308232f)
+
+/* restart the filters after a gap longer than this (sensor disabled) */
+#define MAX_GAP_NS      (1000000000LL)
+
+/* below this |gravity x field| the heading is undefined (free fall, pole) */
+#define MIN_HEADING_NORM (0.1f)
+
+/*
+ * state += alpha * (in - state), and diff = in - state with the new state.
+ * The NEON and C versions do the same operations in the same order; the
+ * C one is always built so tests/ can compare them.
+ */
+static inline void lowpass_c(float state[4], const float in[4], float alpha, float diff[4])
+{
+    int i;
+    for (i = 0; i < 4; i++) {
+        state[i] = state[i] + (in[i] - state[i]) * alpha;
+        diff[i] = in[i] - state[i];
+    }
+}
+
+static inline void lowpass(float state[4], const float in[4], float alpha, float diff[4])
+{
+#if defined(__ARM_NEON__)
+    float32x4_t s = vld1q_f32(state);
+    float32x4_t x = vld1q_f32(in);
+    s = vmlaq_n_f32(s, vsubq_f32(x, s), alpha);
+    vst1q_f32(state, s);
+    vst1q_f32(diff, vsubq_f32(x, s));
+#else
+    lowpass_c(state, in, alpha, diff);
+#endif
+}
+
+static inline float filter_alpha(float time_constant, int64_t dt_ns)
+{
+    float dt = dt_ns * 1e-9f;
+    return dt / (time_constant + dt);
+}
+
+/* true if the filter has to (re)start from this sample */
+static inline int filter_restart(int64_t last, int64_t now)
+{
+    return last == 0 || now <= last || now - last > MAX_GAP_NS;
+}
+
+static void cross(float out[3], const float a[3], const float b[3])
+{
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+/*****************************************************************************/
+
+void sensor_fusion_init(struct sensor_fusion_t* fusion, float time_constant)
+{
+    memset(fusion, 0, sizeof(*fusion));
+    fusion->time_constant = time_constant > 0 ? time_constant
+            : SENSOR_FUSION_DEFAULT_TIME_CONSTANT;
+}
+
+void sensor_fusion_add_field(struct sensor_fusion_t* fusion,
+        const float field[3], int64_t timestamp)
+{
+    float in[4] = { field[0], field[1], field[2], 0 };
+    float diff[4];
+
+    if (filter_restart(fusion->field_time, timestamp)) {
+        memcpy(fusion->field, in, sizeof(in));
+    } else {
+        lowpass(fusion->field, in,
+                filter_alpha(fusion->time_constant, timestamp - fusion->field_time),
+                diff);
+    }
+    fusion->field_time = timestamp;
+}
+
+void sensor_fusion_add_accel(struct sensor_fusion_t* fusion,
+        const float accel[3], int64_t timestamp,
+        struct sensor_fusion_output_t* out)
+{
+    float in[4] = { accel[0], accel[1], accel[2], 0 };
+    float linear[4];
+    float a[3], h[3], m[3];
+    float norm;
+    int i;
+
+    if (filter_restart(fusion->accel_time, timestamp)) {
+        memcpy(fusion->gravity, in, sizeof(in));
+        memset(linear, 0, sizeof(linear));
+    } else {
+        lowpass(fusion->gravity, in,
+                filter_alpha(fusion->time_constant, timestamp - fusion->accel_time),
+                linear);
+    }
+    fusion->accel_time = timestamp;
+
+    for (i = 0; i < 3; i++) {
+        out->gravity[i] = fusion->gravity[i];
+        out->linear_accel[i] = linear[i];
+    }
+
+    norm = sqrtf(fusion->gravity[0] * fusion->gravity[0] +
+                 fusion->gravity[1] * fusion->gravity[1] +
+                 fusion->gravity[2] * fusion->gravity[2]);
+    if (norm == 0) {
+        memset(out->orientation, 0, sizeof(out->orientation));
+        memset(out->rotation_vector, 0, sizeof(out->rotation_vector));
+        out->has_heading = 0;
+        return;
+    }
+    for (i = 0; i < 3; i++)
+        a[i] = fusion->gravity[i] / norm;
+
+    /*
+     * legacy orientation: pitch turns the z axis toward the y axis and
+     * covers -180..180, roll turns the x axis toward the z axis, -90..90
+     */
+    out->orientation[1] = atan2f(-a[1], a[2]) * RAD2DEG;
+    out->orientation[2] = asinf(a[0]) * RAD2DEG;
+    out->orientation[0] = 0;
+    out->has_heading = 0;
+
+    /* rows h (east), m (north), a (up) rotate device into world axes */
+    cross(h, fusion->field, a);
+    norm = sqrtf(h[0] * h[0] + h[1] * h[1] + h[2] * h[2]);
+    if (fusion->field_time == 0 || norm < MIN_HEADING_NORM) {
+        memset(out->rotation_vector, 0, sizeof(out->rotation_vector));
+        return;
+    }
+    for (i = 0; i < 3; i++)
+        h[i] /= norm;
+    cross(m, a, h);
+
+    out->orientation[0] = atan2f(h[1], m[1]) * RAD2DEG;
+    if (out->orientation[0] < 0)
+        out->orientation[0] += 360.0f;
+
+    /* quaternion of that matrix, w >= 0 as getRotationMatrixFromVector() expects */
+    out->rotation_vector[0] = 0.5f * sqrtf(fmaxf(0, 1 + h[0] - m[1] - a[2]));
+    out->rotation_vector[1] = 0.5f * sqrtf(fmaxf(0, 1 - h[0] + m[1] - a[2]));
+    out->rotation_vector[2] = 0.5f * sqrtf(fmaxf(0, 1 - h[0] - m[1] + a[2]));
+    out->rotation_vector[3] = 0.5f * sqrtf(fmaxf(0, 1 + h[0] + m[1] + a[2]));
+    out->rotation_vector[0] = copysignf(out->rotation_vector[0], a[1] - m[2]);
+    out->rotation_vector[1] = copysignf(out->rotation_vector[1], h[2] - a[0]);
+    out->rotation_vector[2] = copysignf(out->rotation_vector[2], m[0] - h[1]);
+    out->has_heading = 1;
+}
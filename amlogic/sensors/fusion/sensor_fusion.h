@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SENSOR_FUSION_H
+#define ANDROID_SENSOR_FUSION_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*****************************************************************************/
+
+/*
+ * Software fusion of accelerometer and, when there is one, magnetometer
+ * samples into gravity, linear acceleration, orientation and rotation
+ * vector outputs, for boards without a motion processor.
+ *
+ * Gravity is the accelerometer signal through a first order low-pass
+ * filter with the given time constant, linear acceleration is what the
+ * filter removed. The field is filtered the same way and, with gravity,
+ * gives the rotation matrix of SensorManager.getRotationMatrix().
+ *
+ * The cost per sample is fixed: a couple of 4-lane vector operations
+ * (NEON when available), a few dozen multiplies and at most six sqrtf,
+ * two atan2f and one asinf.
+ * The filters only depend on the sample values and timestamps, so a
+ * recorded stream always produces the same outputs.
+ */
+
+#define SENSOR_FUSION_DEFAULT_TIME_CONSTANT     (0.2f)  // seconds
+
+struct sensor_fusion_t {
+    float gravity[4];           // m/s^2, last lane unused
+    float field[4];             // uT, last lane unused
+    int64_t accel_time;         // ns, 0 until the first sample
+    int64_t field_time;
+    float time_constant;
+};
+
+struct sensor_fusion_output_t {
+    float gravity[3];
+    float linear_accel[3];
+    float orientation[3];       // azimuth, pitch, roll in degrees
+    float rotation_vector[4];   // x, y, z, w
+    int has_heading;            // azimuth and rotation vector are valid
+};
+
+void sensor_fusion_init(struct sensor_fusion_t* fusion, float time_constant);
+
+/* remember a magnetic field sample, used by the next accelerometer sample */
+void sensor_fusion_add_field(struct sensor_fusion_t* fusion,
+        const float field[3], int64_t timestamp);
+
+/* run the filters for an accelerometer sample and fill in out */
+void sensor_fusion_add_accel(struct sensor_fusion_t* fusion,
+        const float accel[3], int64_t timestamp,
+        struct sensor_fusion_output_t* out);
+
+/*****************************************************************************/
+
+__END_DECLS
+
+#endif  // ANDROID_SENSOR_FUSION_H
@@ -0,0 +1,21 @@
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+# builds sensor_fusion.c itself, to reach the static lowpass() helpers
+LOCAL_SRC_FILES:= \
+	sensor_fusion_test.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+
+LOCAL_SHARED_LIBRARIES := \
+	libm
+
+ifeq ($(ARCH_ARM_HAVE_NEON),true)
+LOCAL_CFLAGS += -mfpu=neon
+endif
+
+LOCAL_MODULE:= test-sensorfusion
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
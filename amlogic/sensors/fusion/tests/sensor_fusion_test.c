@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Feeds synthetic accelerometer and magnetometer streams through the
+ * software sensor fusion and checks gravity, linear acceleration,
+ * orientation and rotation vector, that a stream always gives the same
+ * outputs, and that the NEON lowpass() matches the C one.
+ *
+ *   test-sensorfusion
+ *      prints the failed checks and exits with 1 if there were any
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* the filter helpers are static */
+#include "sensor_fusion.c"
+
+/*****************************************************************************/
+
+#define GRAVITY         (9.80665f)
+#define DEG2RAD         (0.017453292519943295f)
+#define RATE_HZ         (100)
+#define PERIOD_NS       (1000000000LL / RATE_HZ)
+#define START_NS        (1000000000LL)
+
+static int failures;
+static int checks;
+
+static void check_near(const char* what, float got, float want, float tolerance)
+{
+    checks++;
+    if (!(fabsf(got - want) <= tolerance)) {
+        printf("FAIL %s: %f, expected %f (+/- %f)\n", what, got, want, tolerance);
+        failures++;
+    }
+}
+
+static void check_angle(const char* what, float got, float want, float tolerance)
+{
+    float diff = fmodf(got - want + 540.0f, 360.0f) - 180.0f;
+    check_near(what, diff, 0, tolerance);
+}
+
+static void check_true(const char* what, int value)
+{
+    checks++;
+    if (!value) {
+        printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+/* same numbers on every run and every target */
+static uint32_t sRandom = 12345;
+
+static float random_float(float min, float max)
+{
+    sRandom = sRandom * 1103515245 + 12345;
+    return min + (max - min) * ((sRandom >> 8) & 0xffff) / 65535.0f;
+}
+
+/*****************************************************************************/
+
+static void test_lowpass_parity()
+{
+    float state[4], stateC[4], in[4], diff[4], diffC[4];
+    int i, j;
+
+#if defined(__ARM_NEON__)
+    printf("lowpass: NEON against C\n");
+#else
+    printf("lowpass: C only, nothing to compare\n");
+#endif
+    for (j = 0; j < 4; j++)
+        state[j] = stateC[j] = random_float(-20, 20);
+    for (i = 0; i < 10000; i++) {
+        float alpha = random_float(0.001f, 1);
+        for (j = 0; j < 4; j++)
+            in[j] = random_float(-20, 20);
+        lowpass(state, in, alpha, diff);
+        lowpass_c(stateC, in, alpha, diffC);
+        if (memcmp(state, stateC, sizeof(state)) || memcmp(diff, diffC, sizeof(diff))) {
+            check_true("lowpass() matches lowpass_c()", 0);
+            return;
+        }
+    }
+    check_true("lowpass() matches lowpass_c()", 1);
+}
+
+/* hold the device still at the given attitude, return the last output */
+static void hold(struct sensor_fusion_t* fusion, const float accel[3],
+        int64_t* t, int seconds, struct sensor_fusion_output_t* out)
+{
+    int i;
+    for (i = 0; i < seconds * RATE_HZ; i++) {
+        sensor_fusion_add_accel(fusion, accel, *t, out);
+        *t += PERIOD_NS;
+    }
+}
+
+static void test_tilt()
+{
+    struct sensor_fusion_t fusion;
+    struct sensor_fusion_output_t out;
+    const float flat[3] = { 0, 0, GRAVITY };
+    float rolled[3], pitched[3];
+    int64_t t = START_NS;
+    int i;
+
+    rolled[0] = GRAVITY * sinf(30 * DEG2RAD);
+    rolled[1] = 0;
+    rolled[2] = GRAVITY * cosf(30 * DEG2RAD);
+    pitched[0] = 0;
+    pitched[1] = -GRAVITY * sinf(45 * DEG2RAD);
+    pitched[2] = GRAVITY * cosf(45 * DEG2RAD);
+
+    sensor_fusion_init(&fusion, 0);
+    hold(&fusion, flat, &t, 1, &out);
+    check_near("flat gravity z", out.gravity[2], GRAVITY, 1e-4f);
+    check_angle("flat pitch", out.orientation[1], 0, 0.01f);
+    check_angle("flat roll", out.orientation[2], 0, 0.01f);
+
+    /* the step shows up as linear acceleration first */
+    sensor_fusion_add_accel(&fusion, rolled, t, &out);
+    t += PERIOD_NS;
+    check_true("step seen as linear acceleration", out.linear_accel[0] > 4.0f);
+    for (i = 0; i < 3; i++)
+        check_near("gravity + linear == accel", out.gravity[i] + out.linear_accel[i],
+                rolled[i], 1e-4f);
+
+    /* 10 time constants later it has moved to gravity */
+    hold(&fusion, rolled, &t, 2, &out);
+    for (i = 0; i < 3; i++) {
+        check_near("rolled gravity", out.gravity[i], rolled[i], 1e-3f);
+        check_near("rolled linear", out.linear_accel[i], 0, 1e-3f);
+    }
+    check_angle("rolled pitch", out.orientation[1], 0, 0.05f);
+    check_angle("rolled roll", out.orientation[2], 30, 0.05f);
+
+    hold(&fusion, pitched, &t, 2, &out);
+    check_angle("pitched pitch", out.orientation[1], 45, 0.05f);
+    check_angle("pitched roll", out.orientation[2], 0, 0.05f);
+
+    check_true("no heading without a field", !out.has_heading);
+    check_near("azimuth without a field", out.orientation[0], 0, 0);
+}
+
+static void test_shake()
+{
+    struct sensor_fusion_t fusion;
+    struct sensor_fusion_output_t out;
+    int64_t t = START_NS;
+    float accel[3];
+    float maxGravityX = 0;
+    int i, j;
+
+    /* flat, shaken along x at 5Hz with 2m/s^2 */
+    sensor_fusion_init(&fusion, 0);
+    for (i = 0; i < 4 * RATE_HZ; i++) {
+        float shake = 2.0f * sinf(2 * M_PI * 5 * i / RATE_HZ);
+        accel[0] = shake;
+        accel[1] = 0;
+        accel[2] = GRAVITY;
+        sensor_fusion_add_accel(&fusion, accel, t, &out);
+        t += PERIOD_NS;
+
+        for (j = 0; j < 3; j++)
+            check_near("gravity + linear == accel", out.gravity[j] + out.linear_accel[j],
+                    accel[j], 1e-4f);
+        if (i >= RATE_HZ) {
+            if (fabsf(out.gravity[0]) > maxGravityX)
+                maxGravityX = fabsf(out.gravity[0]);
+            check_near("shaken gravity z", out.gravity[2], GRAVITY, 1e-4f);
+        }
+    }
+    /* a first order filter at 5Hz with tau 0.2s passes ~16% */
+    check_near("shake left in gravity", maxGravityX, 0.31f, 0.05f);
+}
+
+static void test_heading()
+{
+    struct sensor_fusion_t fusion;
+    struct sensor_fusion_output_t out;
+    const float flat[3] = { 0, 0, GRAVITY };
+    const float north[3] = { 0, 22, -40 };     // y toward magnetic north
+    const float west[3] = { 22, 0, -40 };      // x toward magnetic north
+    int64_t t = START_NS;
+    float norm;
+    int i;
+
+    sensor_fusion_init(&fusion, 0);
+    for (i = 0; i < 2 * RATE_HZ; i++) {
+        sensor_fusion_add_field(&fusion, north, t);
+        sensor_fusion_add_accel(&fusion, flat, t, &out);
+        t += PERIOD_NS;
+    }
+    check_true("heading with a field", out.has_heading);
+    check_angle("north azimuth", out.orientation[0], 0, 0.05f);
+    check_near("north rotation x", out.rotation_vector[0], 0, 1e-3f);
+    check_near("north rotation y", out.rotation_vector[1], 0, 1e-3f);
+    check_near("north rotation z", out.rotation_vector[2], 0, 1e-3f);
+    check_near("north rotation w", out.rotation_vector[3], 1, 1e-3f);
+
+    for (i = 0; i < 3 * RATE_HZ; i++) {
+        sensor_fusion_add_field(&fusion, west, t);
+        sensor_fusion_add_accel(&fusion, flat, t, &out);
+        t += PERIOD_NS;
+    }
+    check_angle("west azimuth", out.orientation[0], 270, 0.05f);
+    /* a quarter turn about z */
+    norm = sqrtf(out.rotation_vector[0] * out.rotation_vector[0] +
+                 out.rotation_vector[1] * out.rotation_vector[1] +
+                 out.rotation_vector[2] * out.rotation_vector[2] +
+                 out.rotation_vector[3] * out.rotation_vector[3]);
+    check_near("rotation vector norm", norm, 1, 1e-3f);
+    check_near("west rotation z", fabsf(out.rotation_vector[2]), sqrtf(0.5f), 1e-3f);
+    check_near("west rotation w", out.rotation_vector[3], sqrtf(0.5f), 1e-3f);
+}
+
+static void test_restart()
+{
+    struct sensor_fusion_t fusion;
+    struct sensor_fusion_output_t out;
+    const float flat[3] = { 0, 0, GRAVITY };
+    const float side[3] = { GRAVITY, 0, 0 };
+    int64_t t = START_NS;
+    int i;
+
+    sensor_fusion_init(&fusion, 0);
+    hold(&fusion, flat, &t, 1, &out);
+
+    /* a gap of more than a second starts over from the next sample */
+    t += 2 * 1000000000LL;
+    sensor_fusion_add_accel(&fusion, side, t, &out);
+    for (i = 0; i < 3; i++) {
+        check_near("restarted gravity", out.gravity[i], side[i], 0);
+        check_near("restarted linear", out.linear_accel[i], 0, 0);
+    }
+}
+
+static void test_determinism()
+{
+    struct sensor_fusion_t fusion[2];
+    struct sensor_fusion_output_t out[2];
+    int64_t t = START_NS;
+    float accel[3], field[3];
+    int i, j, same = 1;
+
+    sensor_fusion_init(&fusion[0], 0);
+    sensor_fusion_init(&fusion[1], 0);
+    for (i = 0; i < 5 * RATE_HZ; i++) {
+        for (j = 0; j < 3; j++) {
+            accel[j] = random_float(-12, 12);
+            field[j] = random_float(-50, 50);
+        }
+        /* jittered timestamps, like a real driver */
+        t += PERIOD_NS + (int64_t)random_float(-2000000, 2000000);
+        for (j = 0; j < 2; j++) {
+            if (i % 2)
+                sensor_fusion_add_field(&fusion[j], field, t);
+            sensor_fusion_add_accel(&fusion[j], accel, t, &out[j]);
+        }
+        if (memcmp(&out[0], &out[1], sizeof(out[0])))
+            same = 0;
+    }
+    check_true("a stream always gives the same outputs", same);
+}
+
+/*****************************************************************************/
+
+int main(int argc, char** argv)
+{
+    test_lowpass_parity();
+    test_tilt();
+    test_shake();
+    test_heading();
+    test_restart();
+    test_determinism();
+
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
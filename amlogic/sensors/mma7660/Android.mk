@@ -32,9 +32,12 @@ LOCAL_SRC_FILES := 						\
 				SensorBase.cpp			\
 				LightSensor.cpp			\
 				AccelSensor.cpp               \
+				FusionSensor.cpp		\
                         InputEventReader.cpp
 
-LOCAL_SHARED_LIBRARIES := liblog libcutils libdl
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../fusion
+LOCAL_STATIC_LIBRARIES := libsensors_fusion
+LOCAL_SHARED_LIBRARIES := liblog libcutils libdl libm
 
 include $(BUILD_SHARED_LIBRARY)
 
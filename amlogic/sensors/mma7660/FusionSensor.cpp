@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <cutils/log.h>
+
+#include "FusionSensor.h"
+
+/*****************************************************************************/
+
+FusionSensor::FusionSensor()
+    : SensorBase(NULL, NULL),
+      mEnabled(0),
+      mQueueHead(0),
+      mQueueCount(0),
+      mDropped(0)
+{
+    sensor_fusion_init(&mFusion, SENSOR_FUSION_DEFAULT_TIME_CONSTANT);
+
+    memset(mPendingEvents, 0, sizeof(mPendingEvents));
+
+    mPendingEvents[Orientation].version = sizeof(sensors_event_t);
+    mPendingEvents[Orientation].sensor = ID_O;
+    mPendingEvents[Orientation].type = SENSOR_TYPE_ORIENTATION;
+    mPendingEvents[Orientation].orientation.status = SENSOR_STATUS_UNRELIABLE;
+
+    mPendingEvents[Gravity].version = sizeof(sensors_event_t);
+    mPendingEvents[Gravity].sensor = ID_GR;
+    mPendingEvents[Gravity].type = SENSOR_TYPE_GRAVITY;
+    mPendingEvents[Gravity].acceleration.status = SENSOR_STATUS_ACCURACY_HIGH;
+
+    mPendingEvents[LinearAccel].version = sizeof(sensors_event_t);
+    mPendingEvents[LinearAccel].sensor = ID_LA;
+    mPendingEvents[LinearAccel].type = SENSOR_TYPE_LINEAR_ACCELERATION;
+    mPendingEvents[LinearAccel].acceleration.status = SENSOR_STATUS_ACCURACY_HIGH;
+}
+
+FusionSensor::~FusionSensor()
+{
+}
+
+int FusionSensor::enable(int32_t handle, int en)
+{
+    int what = -1;
+
+    switch (handle) {
+        case ID_O:  what = Orientation; break;
+        case ID_GR: what = Gravity;     break;
+        case ID_LA: what = LinearAccel; break;
+    }
+
+    if (uint32_t(what) >= numSensors)
+        return -EINVAL;
+
+    if (en) {
+        // start the filters over from the next sample
+        if (!mEnabled)
+            sensor_fusion_init(&mFusion, SENSOR_FUSION_DEFAULT_TIME_CONSTANT);
+        mEnabled |= 1<<what;
+    } else {
+        mEnabled &= ~(1<<what);
+    }
+    return 0;
+}
+
+bool FusionSensor::hasPendingEvents() const
+{
+    return mQueueCount != 0;
+}
+
+void FusionSensor::queueEvent(int what, int64_t timestamp)
+{
+    if (mQueueCount == queueSize) {
+        // the caller's buffer is not keeping up, drop the oldest
+        mQueueHead = (mQueueHead + 1) % queueSize;
+        mQueueCount--;
+        mDropped++;
+    }
+    sensors_event_t* ev = &mQueue[(mQueueHead + mQueueCount) % queueSize];
+    *ev = mPendingEvents[what];
+    ev->timestamp = timestamp;
+    mQueueCount++;
+}
+
+void FusionSensor::process(sensors_event_t const* events, int count)
+{
+    struct sensor_fusion_output_t out;
+
+    if (!mEnabled)
+        return;
+
+    for (int i=0 ; i<count ; i++) {
+        const sensors_event_t& ev = events[i];
+        if (ev.type == SENSOR_TYPE_MAGNETIC_FIELD) {
+            sensor_fusion_add_field(&mFusion, ev.magnetic.v, ev.timestamp);
+            continue;
+        }
+        if (ev.type != SENSOR_TYPE_ACCELEROMETER)
+            continue;
+
+        sensor_fusion_add_accel(&mFusion, ev.acceleration.v, ev.timestamp, &out);
+
+        if (mEnabled & (1<<Orientation)) {
+            memcpy(mPendingEvents[Orientation].orientation.v, out.orientation,
+                    sizeof(out.orientation));
+            // without a field source the azimuth is a constant 0
+            mPendingEvents[Orientation].orientation.status = out.has_heading ?
+                    SENSOR_STATUS_ACCURACY_MEDIUM : SENSOR_STATUS_UNRELIABLE;
+            queueEvent(Orientation, ev.timestamp);
+        }
+        if (mEnabled & (1<<Gravity)) {
+            memcpy(mPendingEvents[Gravity].acceleration.v, out.gravity,
+                    sizeof(out.gravity));
+            queueEvent(Gravity, ev.timestamp);
+        }
+        if (mEnabled & (1<<LinearAccel)) {
+            memcpy(mPendingEvents[LinearAccel].acceleration.v, out.linear_accel,
+                    sizeof(out.linear_accel));
+            queueEvent(LinearAccel, ev.timestamp);
+        }
+    }
+    LOGW_IF(mDropped && !(mDropped & 0xff), "FusionSensor: %u events dropped", mDropped);
+}
+
+int FusionSensor::readEvents(sensors_event_t* data, int count)
+{
+    if (count < 1)
+        return -EINVAL;
+
+    int numEventReceived = 0;
+    while (count && mQueueCount) {
+        *data++ = mQueue[mQueueHead];
+        mQueueHead = (mQueueHead + 1) % queueSize;
+        mQueueCount--;
+        count--;
+        numEventReceived++;
+    }
+    return numEventReceived;
+}
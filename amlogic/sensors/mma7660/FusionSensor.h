@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_FUSION_SENSOR_H
+#define ANDROID_FUSION_SENSOR_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include "sensors.h"
+#include "SensorBase.h"
+#include "sensor_fusion.h"
+
+/*****************************************************************************/
+
+/*
+ * Virtual orientation, gravity and linear acceleration sensors computed
+ * from the accelerometer events by the software fusion stage. It has no
+ * fd of its own, the poll loop feeds it through process(). Orientation needs
+ * a magnetic field source, HALs without one do not list it.
+ */
+class FusionSensor : public SensorBase {
+public:
+            FusionSensor();
+    virtual ~FusionSensor();
+
+    enum {
+        Orientation     = 0,
+        Gravity,
+        LinearAccel,
+        numSensors
+    };
+
+    virtual int enable(int32_t handle, int enabled);
+    virtual int readEvents(sensors_event_t* data, int count);
+    virtual bool hasPendingEvents() const;
+    void process(sensors_event_t const* events, int count);
+
+private:
+    enum {
+        queueSize = 64
+    };
+
+    uint32_t mEnabled;
+    struct sensor_fusion_t mFusion;
+    sensors_event_t mPendingEvents[numSensors];
+    sensors_event_t mQueue[queueSize];
+    int mQueueHead;
+    int mQueueCount;
+    uint32_t mDropped;
+
+    void queueEvent(int what, int64_t timestamp);
+};
+
+/*****************************************************************************/
+
+#endif  // ANDROID_FUSION_SENSOR_H
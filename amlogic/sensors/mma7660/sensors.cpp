@@ -25,6 +25,10 @@
 #include <poll.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <linux/input.h>
 
@@ -35,6 +39,7 @@
 
 #include "LightSensor.h"
 #include "AccelSensor.h"
+#include "FusionSensor.h"
 
 /*****************************************************************************/
 
@@ -48,6 +53,12 @@
 #define SENSORS_LIGHT            (1<<ID_L)
 #define SENSORS_PROXIMITY        (1<<ID_P)
 #define SENSORS_GYROSCOPE        (1<<ID_GY)
+#define SENSORS_GRAVITY          (1<<ID_GR)
+#define SENSORS_LINEAR_ACCEL     (1<<ID_LA)
+
+// handles that need the accelerometer running
+#define SENSORS_ACCEL_USERS      (SENSORS_ACCELERATION | SENSORS_ORIENTATION | \
+                                  SENSORS_GRAVITY | SENSORS_LINEAR_ACCEL)
 
 #define SENSORS_ACCELERATION_HANDLE     0
 #define SENSORS_MAGNETIC_FIELD_HANDLE   1
@@ -55,16 +66,30 @@
 #define SENSORS_LIGHT_HANDLE            3
 #define SENSORS_PROXIMITY_HANDLE        4
 #define SENSORS_GYROSCOPE_HANDLE        5
+#define SENSORS_GRAVITY_HANDLE          6
+#define SENSORS_LINEAR_ACCEL_HANDLE     7
 
 
 /*****************************************************************************/
 
-/* The SENSORS Module */
+/*
+ * The SENSORS Module. Gravity and linear acceleration come from the software
+ * fusion stage; without a magnetic field source the azimuth is unknown, so
+ * no orientation sensor is registered.
+ */
 static const struct sensor_t sSensorList[] = {
         { "MMA 3-axis Accelerometer",
           "Freescale Semiconductor Inc.",
           1, SENSORS_ACCELERATION_HANDLE,
           SENSOR_TYPE_ACCELEROMETER, RANGE_A, CONVERT_A, 0.30f, 20000, { } },
+        { "Gravity sensor (software fusion)",
+          "Amlogic",
+          1, SENSORS_GRAVITY_HANDLE,
+          SENSOR_TYPE_GRAVITY, RANGE_A, CONVERT_A, 0.30f, 20000, { } },
+        { "Linear Acceleration sensor (software fusion)",
+          "Amlogic",
+          1, SENSORS_LINEAR_ACCEL_HANDLE,
+          SENSOR_TYPE_LINEAR_ACCELERATION, RANGE_A, CONVERT_A, 0.30f, 20000, { } },
         { "ISL29023 Light sensor",
           "Intersil",
           1, SENSORS_LIGHT_HANDLE,
@@ -75,6 +100,15 @@ static const struct sensor_t sSensorList[] = {
 static int open_sensors(const struct hw_module_t* module, const char* id,
                         struct hw_device_t** device);
 
+static bool isListed(int handle)
+{
+        for (size_t i=0 ; i<ARRAY_SIZE(sSensorList) ; i++) {
+                if (sSensorList[i].handle == handle)
+                        return true;
+        }
+        return false;
+}
+
 
 static int sensors__get_sensors_list(struct sensors_module_t* module,
                                      struct sensor_t const** list)
@@ -108,27 +142,58 @@ struct sensors_poll_context_t {
     int activate(int handle, int enabled);
     int setDelay(int handle, int64_t ns);
     int pollEvents(sensors_event_t* data, int count);
+    int dump(char* buff, int buff_len);
 
 private:
     enum {
         light           = 0,
         accel             = 1,
+        fusion          = 2,            // fed by accel, must come after it
         numSensorDrivers,
+        wake = numSensorDrivers,
         numFds,
     };
 
-    static const size_t wake = numFds - 1;
-    static const char WAKE_MESSAGE = 'W';
-    struct pollfd mPollFds[numFds];
-    int mWritePipeFd;
+    enum {
+        numHandles = ID_LA + 1,
+    };
+
+    int mEpollFd;
+    int mWakeFd;
     SensorBase* mSensors[numSensorDrivers];
+    uint32_t mReady;                // drivers epoll reported and not drained yet
+    uint32_t mActive;               // handles enabled, as last applied
+
+    // activate()/setDelay() requests. The accelerometer is switched and
+    // timed by the caller so its errors can be returned, the light and
+    // fusion state is applied by the polling thread.
+    pthread_mutex_t mLock;
+    uint32_t mPendingEnable;
+    uint32_t mRequestedEnable;
+    bool mAccelOn;
+    int64_t mRequestedDelay[numHandles];    // -1 until set, for the driver default
+
+    // statistics, only updated by the polling thread
+    uint32_t mWakeups;
+    uint32_t mStateUpdates;
+    uint32_t mReadyCount[numSensorDrivers];
+    uint32_t mEventCount[numSensorDrivers];
+    uint32_t mOverruns[numSensorDrivers];
+
+    void addDriver(int index);
+    int64_t accelDelay(uint32_t requested) const;
+    void postStateChange(uint32_t handleBit);
+    void applyStateChanges();
 
     int handleToDriver(int handle) const {
         switch (handle) {
             case ID_A:
             case ID_M:
-            case ID_O:
                 return accel;
+            case ID_O:
+            case ID_GR:
+            case ID_LA:
+                return fusion;
             case ID_L:
                 return light;
         }
@@ -136,57 +201,172 @@ private:
     }
 };
 
+static const char* const sDriverNames[] = { "light", "accel", "fusion" };
+
 /*****************************************************************************/
 
 sensors_poll_context_t::sensors_poll_context_t()
+    : mReady(0),
+      mActive(0),
+      mPendingEnable(0),
+      mRequestedEnable(0),
+      mAccelOn(false),
+      mWakeups(0),
+      mStateUpdates(0)
 {
+    for (int handle=0 ; handle<numHandles ; handle++)
+        mRequestedDelay[handle] = -1;
+    memset(mReadyCount, 0, sizeof(mReadyCount));
+    memset(mEventCount, 0, sizeof(mEventCount));
+    memset(mOverruns, 0, sizeof(mOverruns));
+    pthread_mutex_init(&mLock, NULL);
+
+    mEpollFd = epoll_create(numFds);
+    LOGE_IF(mEpollFd<0, "error creating epoll fd (%s)", strerror(errno));
+
     mSensors[light] = new LightSensor();
-    mPollFds[light].fd = mSensors[light]->getFd();
-    mPollFds[light].events = POLLIN;
-    mPollFds[light].revents = 0;
+    addDriver(light);
 
     mSensors[accel] = new AccelSensor();
-    mPollFds[accel].fd = mSensors[accel]->getFd();
-    mPollFds[accel].events = POLLIN;
-    mPollFds[accel].revents = 0;
-
-    int wakeFds[2];
-    int result = pipe(wakeFds);
-    LOGE_IF(result<0, "error creating wake pipe (%s)", strerror(errno));
-    fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
-    fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
-    mWritePipeFd = wakeFds[1];
-
-    mPollFds[wake].fd = wakeFds[0];
-    mPollFds[wake].events = POLLIN;
-    mPollFds[wake].revents = 0;
+    addDriver(accel);
+
+    mSensors[fusion] = new FusionSensor();
+
+    mWakeFd = eventfd(0, 0);
+    LOGE_IF(mWakeFd<0, "error creating wake eventfd (%s)", strerror(errno));
+    fcntl(mWakeFd, F_SETFL, O_NONBLOCK);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = wake;
+    epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeFd, &ev);
 }
 
 sensors_poll_context_t::~sensors_poll_context_t() {
     for (int i=0 ; i<numSensorDrivers ; i++) {
         delete mSensors[i];
     }
-    close(mPollFds[wake].fd);
-    close(mWritePipeFd);
+    close(mEpollFd);
+    close(mWakeFd);
+    pthread_mutex_destroy(&mLock);
+}
+
+/* drivers are registered once, epoll then only reports the ready ones */
+void sensors_poll_context_t::addDriver(int index) {
+    int fd = mSensors[index]->getFd();
+    if (fd < 0) {
+        LOGE("no input device for the %s sensor", sDriverNames[index]);
+        return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = index;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        LOGE("error adding the %s sensor to epoll (%s)",
+                sDriverNames[index], strerror(errno));
+    }
+}
+
+/*
+ * The fastest rate any of the requested accelerometer users asked for, or -1
+ * if none of them set one and the driver default applies.
+ */
+int64_t sensors_poll_context_t::accelDelay(uint32_t requested) const {
+    int64_t ns = -1;
+    for (int handle=0 ; handle<numHandles ; handle++) {
+        if ((requested & SENSORS_ACCEL_USERS & (1<<handle)) &&
+                mRequestedDelay[handle] >= 0 &&
+                (ns < 0 || mRequestedDelay[handle] < ns))
+            ns = mRequestedDelay[handle];
+    }
+    return ns;
+}
+
+/*
+ * Record a request for the polling thread. Requests made before it gets
+ * to them are merged, only the first one signals the eventfd.
+ */
+void sensors_poll_context_t::postStateChange(uint32_t handleBit) {
+    bool idle = !mPendingEnable;
+    mPendingEnable |= handleBit;
+    if (idle) {
+        uint64_t one = 1;
+        int result = write(mWakeFd, &one, sizeof(one));
+        LOGE_IF(result<0, "error sending wake message (%s)", strerror(errno));
+    }
+}
+
+void sensors_poll_context_t::applyStateChanges() {
+    uint32_t enable, requested;
+
+    pthread_mutex_lock(&mLock);
+    enable = mPendingEnable;
+    requested = mRequestedEnable;
+    mPendingEnable = 0;
+    pthread_mutex_unlock(&mLock);
+
+    // the accelerometer itself was switched by activate()
+    enable &= ~SENSORS_ACCELERATION;
+    mActive = requested;
+
+    for (int handle=0 ; handle<numHandles ; handle++) {
+        if (!(enable & (1<<handle)))
+            continue;
+        int index = handleToDriver(handle);
+        int err = mSensors[index]->enable(handle, (requested >> handle) & 1);
+        LOGE_IF(err, "could not %s the %s sensor (%s)",
+                (requested & (1<<handle)) ? "enable" : "disable",
+                sDriverNames[index], strerror(-err));
+    }
+    mStateUpdates++;
 }
 
 int sensors_poll_context_t::activate(int handle, int enabled) {
     int index = handleToDriver(handle);
-    if (index < 0) return index;
-    int err =  mSensors[index]->enable(handle, enabled);
-    if (enabled && !err) {
-        const char wakeMessage(WAKE_MESSAGE);
-        int result = write(mWritePipeFd, &wakeMessage, 1);
-        LOGE_IF(result<0, "error sending wake message (%s)", strerror(errno));
+    if (index < 0 || !isListed(handle)) return -EINVAL;
+    pthread_mutex_lock(&mLock);
+    uint32_t requested = mRequestedEnable;
+    if (enabled)
+        requested |= 1<<handle;
+    else
+        requested &= ~(1<<handle);
+
+    // the accelerometer runs as long as it or a fusion sensor is wanted,
+    // at the fastest rate any of them asked for
+    bool accelWanted = (requested & SENSORS_ACCEL_USERS) != 0;
+    int err = 0;
+    if (accelWanted != mAccelOn) {
+        err = mSensors[accel]->enable(ID_A, accelWanted);
+        if (!err)
+            mAccelOn = accelWanted;
+    }
+    if (!err) {
+        int64_t ns = accelDelay(requested);
+        if (mAccelOn && ns >= 0 && (SENSORS_ACCEL_USERS & (1<<handle)))
+            mSensors[accel]->setDelay(ID_A, ns);
+        mRequestedEnable = requested;
+        postStateChange(1<<handle);
     }
+    pthread_mutex_unlock(&mLock);
     return err;
 }
 
 int sensors_poll_context_t::setDelay(int handle, int64_t ns) {
 
     int index = handleToDriver(handle);
-    if (index < 0) return index;
-    return mSensors[index]->setDelay(handle, ns);
+    if (index < 0 || !isListed(handle) || ns < 0) return -EINVAL;
+    pthread_mutex_lock(&mLock);
+    mRequestedDelay[handle] = ns;
+    int err = 0;
+    if (index == light) {
+        err = mSensors[light]->setDelay(handle, ns);
+    } else if (mAccelOn && (mRequestedEnable & (1<<handle))) {
+        err = mSensors[accel]->setDelay(ID_A, accelDelay(mRequestedEnable));
+    }
+    pthread_mutex_unlock(&mLock);
+    return err;
 }
 
 int sensors_poll_context_t::pollEvents(sensors_event_t* data, int count)
@@ -195,19 +375,32 @@ int sensors_poll_context_t::pollEvents(sensors_event_t* data, int count)
     int n = 0;
 
     do {
-        // see if we have some leftover from the last poll()
+        // drain the drivers epoll reported, or that have some leftover
         for (int i=0 ; count && i<numSensorDrivers ; i++) {
             SensorBase* const sensor(mSensors[i]);
 
-	   if ((mPollFds[i].revents & POLLIN) || (sensor->hasPendingEvents())) {
+            if ((mReady & (1<<i)) || sensor->hasPendingEvents()) {
                 int nb = sensor->readEvents(data, count);
                 if (nb < count) {
                     // no more data for this sensor
-                    mPollFds[i].revents = 0;
+                    mReady &= ~(1<<i);
+                } else {
+                    // out of room, it may have more
+                    mOverruns[i]++;
+                }
+                if (i == accel && nb > 0) {
+                    // fusion runs at the accelerometer rate, its events
+                    // are picked up when the loop gets to it
+                    static_cast<FusionSensor*>(mSensors[fusion])->process(data, nb);
+                    if (!(mActive & SENSORS_ACCELERATION))
+                        nb = 0;
+                }
+                if (nb > 0) {
+                    count -= nb;
+                    nbEvents += nb;
+                    data += nb;
+                    mEventCount[i] += nb;
                 }
-                count -= nb;
-                nbEvents += nb;
-                data += nb;
             }
         }
 
@@ -215,17 +408,29 @@ int sensors_poll_context_t::pollEvents(sensors_event_t* data, int count)
             // we still have some room, so try to see if we can get
             // some events immediately or just wait if we don't have
             // anything to return
-            n = poll(mPollFds, numFds, nbEvents ? 0 : -1);
+            struct epoll_event events[numFds];
+            n = epoll_wait(mEpollFd, events, numFds, nbEvents ? 0 : -1);
             if (n<0) {
-                LOGE("poll() failed (%s)", strerror(errno));
+                if (errno == EINTR) {
+                    n = 1;
+                    continue;
+                }
+                LOGE("epoll_wait() failed (%s)", strerror(errno));
                 return -errno;
             }
-            if (mPollFds[wake].revents & POLLIN) {
-                char msg;
-                int result = read(mPollFds[wake].fd, &msg, 1);
-                LOGE_IF(result<0, "error reading from wake pipe (%s)", strerror(errno));
-                LOGE_IF(msg != WAKE_MESSAGE, "unknown message on wake queue (0x%02x)", int(msg));
-                mPollFds[wake].revents = 0;
+            if (n)
+                mWakeups++;
+            for (int k=0 ; k<n ; k++) {
+                uint32_t index = events[k].data.u32;
+                if (index == wake) {
+                    uint64_t value;
+                    int result = read(mWakeFd, &value, sizeof(value));
+                    LOGE_IF(result<0, "error reading from wake eventfd (%s)", strerror(errno));
+                    applyStateChanges();
+                } else {
+                    mReady |= 1<<index;
+                    mReadyCount[index]++;
+                }
             }
         }
         // if we have events and space, go read them
@@ -234,12 +439,27 @@ int sensors_poll_context_t::pollEvents(sensors_event_t* data, int count)
     return nbEvents;
 }
 
+int sensors_poll_context_t::dump(char* buff, int buff_len)
+{
+    int len = snprintf(buff, buff_len,
+            "sensors: %u wakeups, %u state updates\n", mWakeups, mStateUpdates);
+    for (int i=0 ; i<numSensorDrivers && len<buff_len ; i++) {
+        len += snprintf(buff + len, buff_len - len,
+                "  %s: ready %u, events %u, overruns %u\n",
+                sDriverNames[i], mReadyCount[i], mEventCount[i], mOverruns[i]);
+    }
+    return len;
+}
+
 /*****************************************************************************/
 
 static int poll__close(struct hw_device_t *dev)
 {
     sensors_poll_context_t *ctx = (sensors_poll_context_t *)dev;
     if (ctx) {
+        char buff[512];
+        ctx->dump(buff, sizeof(buff));
+        LOGD("%s", buff);
         delete ctx;
     }
     return 0;
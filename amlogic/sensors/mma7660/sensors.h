@@ -40,6 +40,8 @@ __BEGIN_DECLS
 #define ID_L  (3)
 #define ID_P  (4)
 #define ID_GY (5)
+#define ID_GR (6)
+#define ID_LA (7)
 
 /*****************************************************************************/
 
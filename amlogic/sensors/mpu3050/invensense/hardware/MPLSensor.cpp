@@ -23,6 +23,7 @@
 #include <dirent.h>
 #include <stdlib.h>
 #include <sys/select.h>
+#include <sys/time.h>
 #include <dlfcn.h>
 #include <pthread.h>
 
@@ -84,6 +85,8 @@ static long local_sensor_mask = ALL_MPL_SENSORS_NP;
 
 uint32_t* s_enabledMask;
 uint32_t* s_pendingMask;
+static sensors_event_t* s_sensorEvents;  //per sensor event templates (MPLSensor::mPendingEvents)
+static hfunc_t* s_handlers;              //per sensor handlers (MPLSensor::mHandlers)
 static int s_poll_time = -1;
 static int s_cur_fifo_rate = -1;          //current fifo rate
 static bool s_have_good_mpu_cal = false;  //flag indicating that the cal file can be written
@@ -101,6 +104,18 @@ static bool s_use_timerirq_compass = true;
 static bool s_use_timerirq = false;
 static struct pollfd s_poll_fds[4];
 
+//events produced per fifo packet by cb_procData, waiting to be returned by readEvents
+#define FIFO_EVENT_QUEUE_SIZE (256)
+static sensors_event_t s_fifo_events[FIFO_EVENT_QUEUE_SIZE];
+static int s_fifo_packet[FIFO_EVENT_QUEUE_SIZE];  //packet number within its MLUpdateData call
+static int s_fifo_head = 0;
+static int s_fifo_count = 0;
+static int s_fifo_new = 0;                //events queued by the current MLUpdateData call
+static int s_fifo_packets = 0;            //packets processed by the current MLUpdateData call
+static int s_fifo_dropped = 0;
+static int64_t s_irq_time = 0;            //time of the last mpu irq (monotonic ns), 0 if unknown
+static int64_t s_last_fifo_time = 0;      //timestamp of the last queued packet
+
 enum PED_STATE {
     PED_NONE,
     PED_STANDALONE,
@@ -154,6 +169,34 @@ extern "C" {
     tMLError MLDisableGlyph(void);
 }
 
+/* return the current time in nanoseconds */
+static int64_t now_ns(void)
+{
+    //FUNC_LOG;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    //LOGV("Time %lld", (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the mpuirq and timerirq drivers stamp interrupts with do_gettimeofday(),
+ * packed as (tv_sec << 32) + tv_usec.  convert that to the monotonic clock
+ * used for the event timestamps */
+static int64_t irq_time_ns(unsigned long long irqtime)
+{
+    struct timeval tv;
+    int64_t sec = (int64_t)(irqtime >> 32);
+    int64_t usec = (int64_t)(irqtime & 0xffffffffULL);
+    int64_t age;
+
+    gettimeofday(&tv, NULL);
+    age = (((int64_t)tv.tv_sec - sec) * 1000000 + tv.tv_usec - usec) * 1000;
+    if (age < 0 || age > 1000000000LL) //clock was changed, or a stale irq
+        return 0;
+    return now_ns() - age;
+}
+
 void clearIrqData( bool* irq_set)
 {
     unsigned int i;
@@ -169,6 +212,9 @@ void clearIrqData( bool* irq_set)
             nread = read(cur_fd, &irqdata, sizeof(irqdata));
             if(nread>0) {
                 irq_set[i] = true;
+                //only the irq that clocks the fifo tells when its data was sampled
+                if ((int)i == (s_use_timerirq ? TIMERIRQ_FD : MPUIRQ_FD))
+                    s_irq_time = irq_time_ns(irqdata.irqtime);
                 //LOGV_IF(EXTRA_VERBOSE, "irq: %d %d (%d)", i, irqdata.interruptcount, j++);
             }
         }
@@ -561,15 +607,6 @@ void cb_onMotion(uint16_t val)
 
 } //end of extern "C"
 
-static int sampleCount = 0;
-
-void cb_procData()
-{
-    new_data = 1;
-    sampleCount++;
-    //LOGV_IF(EXTRA_VERBOSE, "new data (%d)", sampleCount);
-}
-
 //these handlers transform mpl data into one of the Android sensor types
 //  scaling and coordinate transforms should be done in the handlers
 
@@ -772,6 +809,82 @@ void noop_handler(sensors_event_t* s, uint32_t* pending_mask, int index) {
     return;
 }
 
+static int sampleCount = 0;
+
+/* queue one event, dropping the oldest one when the queue is full.
+   must be called with the mpld_mutex held. */
+static void queue_fifo_event(const sensors_event_t* ev, int packet)
+{
+    int tail;
+
+    if (s_fifo_count == FIFO_EVENT_QUEUE_SIZE) {
+        if (s_fifo_new == s_fifo_count)
+            s_fifo_new--;
+        s_fifo_head = (s_fifo_head + 1) % FIFO_EVENT_QUEUE_SIZE;
+        s_fifo_count--;
+        s_fifo_dropped++;
+    }
+    tail = (s_fifo_head + s_fifo_count) % FIFO_EVENT_QUEUE_SIZE;
+    s_fifo_events[tail] = *ev;
+    s_fifo_packet[tail] = packet;
+    s_fifo_count++;
+    s_fifo_new++;
+}
+
+/* timestamp the events queued by the last MLUpdateData call. The newest packet
+   is stamped with the irq time and the ones before it one fifo period apart.
+   must be called with the mpld_mutex held. */
+static void stamp_fifo_events()
+{
+    int64_t now = now_ns();
+    int64_t period = (int64_t)GetSampleStepSizeMs() * 1000000LL;
+    int64_t last = s_irq_time ? s_irq_time : now;
+    int64_t first = last - (s_fifo_packets - 1) * period;
+    int i, idx;
+
+    //never go back in time, the irq time is missing or late after a rate change
+    if (first <= s_last_fifo_time) {
+        first = s_last_fifo_time + period;
+        if (first + (s_fifo_packets - 1) * period > now)
+            first = now - (s_fifo_packets - 1) * period;
+        if (first <= s_last_fifo_time)
+            first = s_last_fifo_time + 1;
+    }
+
+    idx = (s_fifo_head + s_fifo_count - s_fifo_new) % FIFO_EVENT_QUEUE_SIZE;
+    for (i = 0; i < s_fifo_new; i++) {
+        s_fifo_events[idx].timestamp = first + s_fifo_packet[idx] * period;
+        idx = (idx + 1) % FIFO_EVENT_QUEUE_SIZE;
+    }
+    if (s_fifo_packets)
+        s_last_fifo_time = first + (s_fifo_packets - 1) * period;
+    s_fifo_new = 0;
+    s_fifo_packets = 0;
+}
+
+/* called by the MPL once for every fifo packet processed. Turns the packet into
+   events for the enabled sensors, while the MPL outputs still reflect it. */
+void cb_procData()
+{
+    sensors_event_t ev;
+    uint32_t mask;
+
+    new_data = 1;
+    sampleCount++;
+    //LOGV_IF(EXTRA_VERBOSE, "new data (%d)", sampleCount);
+
+    for (int i = 0; i < MPLSensor::numSensors; i++) {
+        if (!(*s_enabledMask & (1 << i)) || s_handlers[i] == noop_handler)
+            continue;
+        ev = s_sensorEvents[i];
+        mask = 0;
+        s_handlers[i](&ev, &mask, i);
+        if (mask & (1 << i))
+            queue_fifo_event(&ev, s_fifo_packets);
+    }
+    s_fifo_packets++;
+}
+
 /*****************************************************************************/
 /* sensor class implementation
  */
@@ -954,6 +1067,8 @@ MPLSensor::MPLSensor() :
 
     s_enabledMask = &mEnabled;
     s_pendingMask = &mPendingMask;
+    s_sensorEvents = mPendingEvents;
+    s_handlers = mHandlers;
 
     if (MLSerialOpen(port) != ML_SUCCESS) {
         LOGE("Fatal Error : could not open MPL serial interface");
@@ -1160,19 +1275,6 @@ int MPLSensor::update_delay()
     return rv;
 }
 
-/* return the current time in nanoseconds */
-static int64_t now_ns(void)
-{
-    //FUNC_LOG;
-    struct timespec ts;
-
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    //LOGV("Time %lld", (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
-    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
-}
-
-
-
 int MPLSensor::readEvents(sensors_event_t* data, int count)
 {
     //VFUNC_LOG;
@@ -1183,13 +1285,18 @@ int MPLSensor::readEvents(sensors_event_t* data, int count)
         return -EINVAL;
     int numEventReceived = 0;
 
+    pthread_mutex_lock(&mpld_mutex);
+    s_irq_time = 0;
     clearIrqData(irq_set);
 
-    pthread_mutex_lock(&mpld_mutex);
     if(dmp_started) {
         //LOGV_IF(EXTRA_VERBOSE, "Update Data");
+        int dropped = s_fifo_dropped;
         rv = MLUpdateData();
         LOGE_IF(rv != ML_SUCCESS, "MLUpdateData error (code %d)", (int)rv);
+        stamp_fifo_events();
+        LOGW_IF(s_fifo_dropped != dropped, "fifo event queue full, dropped %d events",
+                s_fifo_dropped - dropped);
     } else if(s_ped_state == PED_SLEEP || s_ped_state == PED_STANDALONE){
         LOGV_IF(EXTRA_VERBOSE, "Possible Ped event");
         int idx = irq_fds.indexOfKey(ACCELIRQ_FD);
@@ -1217,33 +1324,29 @@ int MPLSensor::readEvents(sensors_event_t* data, int count)
         LOGV_IF(EXTRA_VERBOSE, "MPLSensor::readEvents called, but there's nothing to do.");
     }
 
-    pthread_mutex_unlock(&mpld_mutex);
-
-    if (!new_data) {
-        LOGV_IF(EXTRA_VERBOSE, "no new data");
-        return 0;
-    }
-    new_data = 0;
+    //gestures, reported through their callbacks
     int64_t tt = now_ns();
-    pthread_mutex_lock(&mpld_mutex);
-    for(int i = 0;i < numSensors;i++){
-        if(mEnabled & (1 << i)){
-            mHandlers[i](mPendingEvents + i, &mPendingMask, i);
-            mPendingEvents[i].timestamp = tt;
-        }
-    }
-
     for(int j = 0;count && mPendingMask && j < numSensors;j++){
         if(mPendingMask & (1 << j)){
             mPendingMask &= ~(1 << j);
             if(mEnabled & (1 << j)){
+                mPendingEvents[j].timestamp = tt;
                 *data++ = mPendingEvents[j];
                 count--;
                 numEventReceived++;
             }
         }
+    }
 
+    //one event per sensor and fifo packet, oldest first
+    while(count && s_fifo_count){
+        *data++ = s_fifo_events[s_fifo_head];
+        s_fifo_head = (s_fifo_head + 1) % FIFO_EVENT_QUEUE_SIZE;
+        s_fifo_count--;
+        count--;
+        numEventReceived++;
     }
+    new_data = 0;
 
     pthread_mutex_unlock(&mpld_mutex);
     return numEventReceived;
@@ -1281,7 +1384,8 @@ int MPLSensor::getPollTime()
 
 bool MPLSensor::hasPendingEvents() const {
     //if we are using the polling workaround, force the main loop to check for data every time
-    return (s_poll_time != -1);
+    //also come back for fifo packets that did not fit in the last readEvents call
+    return (s_poll_time != -1) || (s_fifo_count != 0);
 }
 
 void MPLSensor::handlePowerEvent() {
@@ -101,6 +101,12 @@ static int gralloc_alloc_buffer(alloc_device_t* dev, size_t size, int usage, buf
 		constraints = UMP_REF_DRV_CONSTRAINT_NONE;
 	}
 
+	int flags = private_handle_t::PRIV_FLAGS_USES_UMP;
+	if (UMP_REF_DRV_CONSTRAINT_USE_CACHE == constraints)
+	{
+		flags |= private_handle_t::PRIV_FLAGS_UMP_CACHED;
+	}
+
 #ifdef GRALLOC_SIMULATE_FAILURES
 	/* if the failure condition matches, fail this iteration */
 	if (__ump_alloc_should_fail())
@@ -118,7 +124,7 @@ static int gralloc_alloc_buffer(alloc_device_t* dev, size_t size, int usage, buf
 			ump_id = ump_secure_id_get(ump_mem_handle);
 			if (UMP_INVALID_SECURE_ID != ump_id)
 			{
-				private_handle_t* hnd = new private_handle_t(private_handle_t::PRIV_FLAGS_USES_UMP, size, (int)cpu_ptr,
+				private_handle_t* hnd = new private_handle_t(flags, size, (int)cpu_ptr,
 				                                             private_handle_t::LOCK_STATE_MAPPED, ump_id, ump_mem_handle);
 				if (NULL != hnd)
 				{
@@ -224,6 +230,7 @@ static int alloc_device_alloc(alloc_device_t* dev, int w, int h, int format, int
 
 	size_t size;
 	size_t stride;
+	size_t byte_stride = 0;
 	if (format == HAL_PIXEL_FORMAT_YCrCb_420_SP || format == HAL_PIXEL_FORMAT_YV12 ) 
 	{
 		switch (format)
@@ -262,6 +269,7 @@ static int alloc_device_alloc(alloc_device_t* dev, int w, int h, int format, int
 		size_t bpr = (w*bpp + (align-1)) & ~(align-1);
 		size = bpr * h;
 		stride = bpr / bpp;
+		byte_stride = bpr;
 	}
 
 	int err;
@@ -272,10 +280,14 @@ static int alloc_device_alloc(alloc_device_t* dev, int w, int h, int format, int
 	else
 	{
 		err = gralloc_alloc_buffer(dev, size, usage, pHandle);
-		if (usage & GRALLOC_USAGE_AML_VIDEO_OVERLAY)
+		if (err >= 0)
 		{
 			private_handle_t* hnd = (private_handle_t*)(*pHandle);
-			hnd->flags |= private_handle_t::PRIV_FLAGS_VIDEO_OVERLAY;
+			hnd->byte_stride = byte_stride;
+			if (usage & GRALLOC_USAGE_AML_VIDEO_OVERLAY)
+			{
+				hnd->flags |= private_handle_t::PRIV_FLAGS_VIDEO_OVERLAY;
+			}
 		}
 	}
 
@@ -307,6 +319,7 @@ static int alloc_device_free(alloc_device_t* dev, buffer_handle_t handle)
 	}
 	else if (hnd->flags & private_handle_t::PRIV_FLAGS_USES_UMP)
 	{
+		// never recycled: other processes may still hold the secure ID
 		ump_mapped_pointer_release((ump_handle)hnd->ump_mem_handle);
 		ump_reference_release((ump_handle)hnd->ump_mem_handle);
 	}
@@ -316,6 +329,23 @@ static int alloc_device_free(alloc_device_t* dev, buffer_handle_t handle)
 	return 0;
 }
 
+static void alloc_device_dump(alloc_device_t* dev, char* buff, int buff_len)
+{
+	private_module_t* m = reinterpret_cast<private_module_t*>(dev->common.module);
+	uint64_t synced;
+	uint64_t saved;
+	uint32_t ops;
+
+	pthread_mutex_lock(&m->syncStatsLock);
+	synced = m->syncedBytes;
+	saved = m->syncSavedBytes;
+	ops = m->syncOps;
+	pthread_mutex_unlock(&m->syncStatsLock);
+
+	snprintf(buff, buff_len, "CPU cache sync: %u ops, %llu KiB synced, %llu KiB saved by region syncs\n",
+	         ops, (unsigned long long)(synced / 1024), (unsigned long long)(saved / 1024));
+}
+
 static int alloc_device_close(struct hw_device_t *device)
 {
 	alloc_device_t* dev = reinterpret_cast<alloc_device_t*>(device);
@@ -355,6 +385,7 @@ int alloc_device_open(hw_module_t const* module, const char* name, hw_device_t**
 	dev->common.close = alloc_device_close;
 	dev->alloc = alloc_device_alloc;
 	dev->free = alloc_device_free;
+	dev->dump = alloc_device_dump;
 
 	*device = &dev->common;
 
@@ -31,6 +31,10 @@
 
 #include <GLES/gl.h>
 
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 #ifdef MALI_VSYNC_EVENT_REPORT_ENABLE
 #include "gralloc_vsync_report.h"
 #endif
@@ -41,6 +45,10 @@
 // numbers of buffers for page flipping
 #define NUM_BUFFERS 2
 
+// without page flipping, copy every row of the update rectangle this often in
+// case a row hash collided
+#define FULL_COPY_INTERVAL 120
+
 enum
 {
 	PAGE_FLIP = 0x00000001,
@@ -57,6 +65,144 @@ static int fb_set_swap_interval(struct framebuffer_device_t* dev, int interval)
     return 0;
 }
 
+static int fb_set_update_rect(struct framebuffer_device_t* dev, int l, int t, int w, int h)
+{
+	if (l < 0 || t < 0 || w <= 0 || h <= 0)
+	{
+		return -EINVAL;
+	}
+
+	private_module_t* m = reinterpret_cast<private_module_t*>(dev->common.module);
+	int bottom = t + h;
+
+	if (bottom > (int)m->info.yres)
+	{
+		bottom = m->info.yres;
+	}
+
+	if (t >= bottom)
+	{
+		return 0;
+	}
+
+	// several rectangles may be set before a post, keep the rows covering all of them
+	if (m->updateBottom > m->updateTop)
+	{
+		if (t < m->updateTop)
+		{
+			m->updateTop = t;
+		}
+		if (bottom > m->updateBottom)
+		{
+			m->updateBottom = bottom;
+		}
+	}
+	else
+	{
+		m->updateTop = t;
+		m->updateBottom = bottom;
+	}
+	return 0;
+}
+
+static uint32_t fb_row_hash(const uint8_t* row, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i = 0;
+
+#if defined(__ARM_NEON__)
+	uint32x4_t acc = vdupq_n_u32(hash);
+	for (; i + 16 <= len; i += 16)
+	{
+		acc = vmlaq_n_u32(vreinterpretq_u32_u8(vld1q_u8(row + i)), acc, 16777619u);
+	}
+	hash = vgetq_lane_u32(acc, 0) ^ (vgetq_lane_u32(acc, 1) * 3) ^ (vgetq_lane_u32(acc, 2) * 5) ^ (vgetq_lane_u32(acc, 3) * 7);
+#else
+	for (; i + 4 <= len; i += 4)
+	{
+		uint32_t word;
+		memcpy(&word, row + i, sizeof(word));
+		hash = (hash ^ word) * 16777619u;
+	}
+#endif
+
+	for (; i < len; i++)
+	{
+		hash = (hash ^ row[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static void fb_copy_rows(uint8_t* dst, const uint8_t* src, size_t len)
+{
+#if defined(__ARM_NEON__)
+	// the framebuffer is write-combined, so stream it out in 64 byte bursts
+	while (len >= 64)
+	{
+		uint8x16_t q0 = vld1q_u8(src);
+		uint8x16_t q1 = vld1q_u8(src + 16);
+		uint8x16_t q2 = vld1q_u8(src + 32);
+		uint8x16_t q3 = vld1q_u8(src + 48);
+		vst1q_u8(dst, q0);
+		vst1q_u8(dst + 16, q1);
+		vst1q_u8(dst + 32, q2);
+		vst1q_u8(dst + 48, q3);
+		src += 64;
+		dst += 64;
+		len -= 64;
+	}
+#endif
+	memcpy(dst, src, len);
+}
+
+/*
+ * Copy the rows top..bottom-1 of a single buffer to the screen, skipping rows
+ * whose content hash matches what was posted last time. Rows outside that
+ * range are known to be unchanged. Returns the number of bytes copied.
+ */
+static size_t fb_post_rows(private_module_t* m, uint8_t* fb, const uint8_t* src, int top, int bottom, bool full)
+{
+	const size_t line_length = m->finfo.line_length;
+	size_t copied = 0;
+	int run_start = -1;
+
+	if (NULL == m->rowHashes)
+	{
+		m->rowHashes = (uint32_t*)calloc(m->info.yres, sizeof(uint32_t));
+		if (NULL == m->rowHashes)
+		{
+			fb_copy_rows(fb + top * line_length, src + top * line_length, (bottom - top) * line_length);
+			return (bottom - top) * line_length;
+		}
+	}
+
+	// contiguous changed rows are copied in one go
+	for (int y = top; y <= bottom; y++)
+	{
+		bool changed = false;
+
+		if (y < bottom)
+		{
+			uint32_t hash = fb_row_hash(src + y * line_length, line_length);
+			changed = full || hash != m->rowHashes[y];
+			m->rowHashes[y] = hash;
+		}
+
+		if (changed && run_start < 0)
+		{
+			run_start = y;
+		}
+		else if (!changed && run_start >= 0)
+		{
+			fb_copy_rows(fb + run_start * line_length, src + run_start * line_length, (y - run_start) * line_length);
+			copied += (y - run_start) * line_length;
+			run_start = -1;
+		}
+	}
+
+	return copied;
+}
+
 static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
 {
 	if (private_handle_t::validate(buffer) < 0)
@@ -147,14 +293,31 @@ static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
 	{
 		void* fb_vaddr;
 		void* buffer_vaddr;
+		const size_t screen_size = m->finfo.line_length * m->info.yres;
+		bool full = (0 == m->postsSinceFullCopy);
+		int top = 0;
+		int bottom = m->info.yres;
+
+		// with partial updates only the rectangle is current in the back
+		// buffer, rows outside it may hold an older frame and are never copied
+		if (m->updateBottom > m->updateTop)
+		{
+			top = m->updateTop;
+			bottom = m->updateBottom;
+		}
+		m->updateTop = 0;
+		m->updateBottom = 0;
+		m->postsSinceFullCopy = (m->postsSinceFullCopy + 1) % FULL_COPY_INTERVAL;
 
 		m->base.lock(&m->base, m->framebuffer, GRALLOC_USAGE_SW_WRITE_RARELY, 
-				0, 0, m->info.xres, m->info.yres, &fb_vaddr);
+				0, top, m->info.xres, bottom - top, &fb_vaddr);
 
 		m->base.lock(&m->base, buffer, GRALLOC_USAGE_SW_READ_RARELY, 
-				0, 0, m->info.xres, m->info.yres, &buffer_vaddr);
+				0, top, m->info.xres, bottom - top, &buffer_vaddr);
 
-		memcpy(fb_vaddr, buffer_vaddr, m->finfo.line_length * m->info.yres);
+		size_t copied = fb_post_rows(m, (uint8_t*)fb_vaddr, (const uint8_t*)buffer_vaddr, top, bottom, full);
+		m->postCopiedBytes += copied;
+		m->postSavedBytes += screen_size - copied;
 
 		m->base.unlock(&m->base, buffer); 
 		m->base.unlock(&m->base, m->framebuffer); 
@@ -396,6 +559,21 @@ static int fb_close(struct hw_device_t *device)
 	return 0;
 }
 
+static void fb_dump(struct framebuffer_device_t* dev, char* buff, int buff_len)
+{
+	private_module_t* m = reinterpret_cast<private_module_t*>(dev->common.module);
+
+	if (m->numBuffers == 1)
+	{
+		snprintf(buff, buff_len, "Single buffer posts: %llu KiB copied, %llu KiB skipped as unchanged\n",
+		         (unsigned long long)(m->postCopiedBytes / 1024), (unsigned long long)(m->postSavedBytes / 1024));
+	}
+	else if (buff_len > 0)
+	{
+		buff[0] = '\0';
+	}
+}
+
 int compositionComplete(struct framebuffer_device_t* dev)
 {
 	unsigned char pixels[4];
@@ -448,7 +626,9 @@ int framebuffer_device_open(hw_module_t const* module, const char* name, hw_devi
 	dev->common.close = fb_close;
 	dev->setSwapInterval = fb_set_swap_interval;
 	dev->post = fb_post;
-	dev->setUpdateRect = 0;
+	// partial updates only help when posts are copied rather than flipped
+	dev->setUpdateRect = (m->numBuffers == 1) ? fb_set_update_rect : 0;
+	dev->dump = fb_dump;
 	dev->compositionComplete = &compositionComplete;
 
 	int stride = m->finfo.line_length / (m->info.bits_per_pixel >> 3);
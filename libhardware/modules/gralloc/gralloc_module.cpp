@@ -154,6 +154,49 @@ static int gralloc_unregister_buffer(gralloc_module_t const* module, buffer_hand
 	return 0;
 }
 
+/*
+ * Work out the byte range of a lock rectangle. Only whole rows can be
+ * addressed, so the range spans rows t..t+h-1, widened to cache lines.
+ * Anything that can't be narrowed down covers the whole buffer.
+ */
+static void gralloc_lock_region(private_handle_t* hnd, int l, int t, int w, int h, int* offset, int* size)
+{
+	const int cache_line = 64;
+
+	if (hnd->byte_stride > 0 && w > 0 && h > 0 && t >= 0)
+	{
+		int start = (t * hnd->byte_stride) & ~(cache_line - 1);
+		int end = ((t + h) * hnd->byte_stride + cache_line - 1) & ~(cache_line - 1);
+
+		if (end > hnd->size)
+		{
+			end = hnd->size;
+		}
+
+		if (start < end)
+		{
+			*offset = start;
+			*size = end - start;
+			return;
+		}
+	}
+
+	*offset = 0;
+	*size = hnd->size;
+}
+
+static void gralloc_sync_region(private_module_t* m, private_handle_t* hnd)
+{
+	ump_cpu_msync_now((ump_handle)hnd->ump_mem_handle, UMP_MSYNC_CLEAN_AND_INVALIDATE,
+	                  (void*)(hnd->base + hnd->lock_offset), hnd->lock_size);
+
+	pthread_mutex_lock(&m->syncStatsLock);
+	m->syncedBytes += hnd->lock_size;
+	m->syncSavedBytes += hnd->size - hnd->lock_size;
+	m->syncOps++;
+	pthread_mutex_unlock(&m->syncStatsLock);
+}
+
 static int gralloc_lock(gralloc_module_t const* module, buffer_handle_t handle, int usage, int l, int t, int w, int h, void** vaddr)
 {
 	if (private_handle_t::validate(handle) < 0)
@@ -162,11 +205,19 @@ static int gralloc_lock(gralloc_module_t const* module, buffer_handle_t handle,
 		return -EINVAL;
 	}
 
+	private_module_t* m = reinterpret_cast<private_module_t*>(const_cast<gralloc_module_t*>(module));
 	private_handle_t* hnd = (private_handle_t*)handle;
 
 	if (hnd->flags & private_handle_t::PRIV_FLAGS_USES_UMP)
 	{
 		hnd->writeOwner = usage & GRALLOC_USAGE_SW_WRITE_MASK;
+		gralloc_lock_region(hnd, l, t, w, h, &hnd->lock_offset, &hnd->lock_size);
+
+		// the GPU may have written the buffer since the CPU last looked at it
+		if ((usage & GRALLOC_USAGE_SW_READ_MASK) && (hnd->flags & private_handle_t::PRIV_FLAGS_UMP_CACHED))
+		{
+			gralloc_sync_region(m, hnd);
+		}
 	}
 
 	if (usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK))
@@ -184,14 +235,12 @@ static int gralloc_unlock(gralloc_module_t const* module, buffer_handle_t handle
 		return -EINVAL;
 	}
 
+	private_module_t* m = reinterpret_cast<private_module_t*>(const_cast<gralloc_module_t*>(module));
 	private_handle_t* hnd = (private_handle_t*)handle;
-	int32_t current_value;
-	int32_t new_value;
-	int retry;
 
 	if (hnd->flags & private_handle_t::PRIV_FLAGS_USES_UMP && hnd->writeOwner)
 	{
-		ump_cpu_msync_now((ump_handle)hnd->ump_mem_handle, UMP_MSYNC_CLEAN_AND_INVALIDATE, (void*)hnd->base, hnd->size);
+		gralloc_sync_region(m, hnd);
 	}
 	return 0;
 }
@@ -235,6 +284,16 @@ private_module_t::private_module_t()
 	xdpi = 0.0f; 
 	ydpi = 0.0f; 
 	fps = 0.0f; 
+	pthread_mutex_init(&(syncStatsLock), NULL);
+	syncedBytes = 0;
+	syncSavedBytes = 0;
+	syncOps = 0;
+	updateTop = 0;
+	updateBottom = 0;
+	rowHashes = NULL;
+	postsSinceFullCopy = 0;
+	postCopiedBytes = 0;
+	postSavedBytes = 0;
 
 #undef INIT_ZERO
 };
@@ -52,6 +52,20 @@ struct private_module_t
 	float ydpi;
 	float fps;
 
+	// CPU cache maintenance done by lock/unlock, and what the full-buffer sync would have cost on top
+	pthread_mutex_t syncStatsLock;
+	uint64_t syncedBytes;
+	uint64_t syncSavedBytes;
+	uint32_t syncOps;
+
+	// Single buffer fallback: rows to post next, per-row content hashes and copy accounting
+	int updateTop;
+	int updateBottom;
+	uint32_t* rowHashes;
+	uint32_t postsSinceFullCopy;
+	uint64_t postCopiedBytes;
+	uint64_t postSavedBytes;
+
 	enum
 	{
 		// flag to indicate we'll post this buffer
@@ -76,6 +90,7 @@ struct private_handle_t
 		PRIV_FLAGS_FRAMEBUFFER   = 0x00000001,
 		PRIV_FLAGS_USES_UMP      = 0x00000002,
 		PRIV_FLAGS_VIDEO_OVERLAY = 0x00000004,
+		PRIV_FLAGS_UMP_CACHED    = 0x00000008,
 	};
 
 	enum
@@ -102,9 +117,15 @@ struct private_handle_t
 	int     fd;
 	int     offset;
 
+	// Bytes per row for single plane formats, 0 if rows can't be addressed on their own
+	int     byte_stride;
+
+	// Byte range covered by the current lock, used for cache maintenance
+	int     lock_offset;
+	int     lock_size;
 
 #ifdef __cplusplus
-	static const int sNumInts = 11;
+	static const int sNumInts = 14;
 	static const int sNumFds = 0;
 	static const int sMagic = 0x3141592;
 
@@ -119,7 +140,10 @@ struct private_handle_t
 		ump_id((int)secure_id),
 		ump_mem_handle((int)handle),
 		fd(0),
-		offset(0)
+		offset(0),
+		byte_stride(0),
+		lock_offset(0),
+		lock_size(size)
 	{
 		version = sizeof(native_handle);
 		numFds = sNumFds;
@@ -137,7 +161,10 @@ struct private_handle_t
 		ump_id((int)UMP_INVALID_SECURE_ID),
 		ump_mem_handle((int)UMP_INVALID_MEMORY_HANDLE),
 		fd(fb_file),
-		offset(fb_offset)
+		offset(fb_offset),
+		byte_stride(0),
+		lock_offset(0),
+		lock_size(size)
 	{
 		version = sizeof(native_handle);
 		numFds = sNumFds;
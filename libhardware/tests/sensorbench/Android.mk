@@ -0,0 +1,22 @@
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	sensorbench.cpp
+
+LOCAL_SHARED_LIBRARIES := \
+	libcutils libutils libhardware
+
+# <vector> and <algorithm> come from stlport, bionic has no STL
+LOCAL_SHARED_LIBRARIES += libstlport
+LOCAL_C_INCLUDES += external/stlport/stlport bionic
+
+# the read()/write() counters in sensorbench.cpp have to take precedence
+# over libc for the HAL module loaded by hw_get_module()
+LOCAL_LDFLAGS := -Wl,--export-dynamic
+
+LOCAL_MODULE:= test-sensorbench
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,683 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Record and replay of the input_event streams behind the sensor HALs,
+ * and a benchmark of the HAL poll path on top of it.
+ *
+ *   test-sensorbench record <trace> <seconds> <input name>...
+ *      capture the events of the named evdev devices into <trace>
+ *
+ *   test-sensorbench replay <trace> [rate [repeat]]
+ *      recreate the devices with uinput, open the sensors HAL, which finds
+ *      them by name as usual, and play the trace into them. rate is in
+ *      frames (SYN_REPORTs) per second, 0 (default) keeps the recorded
+ *      timing and -1 writes as fast as possible.
+ *
+ *   test-sensorbench bench <seconds>
+ *      benchmark the HAL on the real devices, without latency figures.
+ *
+ * The benchmark reports events/sec, the read() and write() calls the HAL
+ * made from the polling thread per event, and the latency from writing a
+ * frame to the poll() return that delivered it. Events are matched to
+ * frames by their timestamp, frames no event could be matched to are
+ * counted separately.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/cdefs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <cutils/log.h>
+
+#include <hardware/sensors.h>
+#include <utils/Timers.h>
+
+/*****************************************************************************/
+
+/*
+ * read() and write() are overridden (the executable is linked with
+ * --export-dynamic) so the calls the HAL makes from the polling thread
+ * can be counted. Calls from other threads are not counted.
+ */
+static pthread_t sCountedThread;
+static volatile int sCounting = 0;
+static int sReads = 0;
+static int sWrites = 0;
+
+extern "C" ssize_t read(int fd, void* buf, size_t count)
+{
+    if (sCounting && pthread_equal(pthread_self(), sCountedThread))
+        sReads++;
+    return syscall(__NR_read, fd, buf, count);
+}
+
+extern "C" ssize_t write(int fd, const void* buf, size_t count)
+{
+    if (sCounting && pthread_equal(pthread_self(), sCountedThread))
+        sWrites++;
+    return syscall(__NR_write, fd, buf, count);
+}
+
+/*****************************************************************************/
+
+/*
+ * A trace is a trace_header followed by trace_events, in native byte
+ * order. delta_us is the kernel time between an event and the one before
+ * it, on any device.
+ */
+#define TRACE_MAGIC         0x524e5353  // "SSNR"
+#define TRACE_VERSION       1
+#define TRACE_MAX_DEVICES   8
+#define TRACE_NAME_SIZE     80
+
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numDevices;
+    char names[TRACE_MAX_DEVICES][TRACE_NAME_SIZE];
+};
+
+struct trace_event {
+    uint16_t device;
+    uint16_t type;
+    uint16_t code;
+    uint16_t reserved;
+    int32_t value;
+    uint32_t delta_us;
+};
+
+static int64_t now_ns()
+{
+    return systemTime(SYSTEM_TIME_MONOTONIC);
+}
+
+static void sleep_until(int64_t deadline)
+{
+    int64_t delay = deadline - now_ns();
+    if (delay > 0) {
+        struct timespec ts;
+        ts.tv_sec = delay / 1000000000LL;
+        ts.tv_nsec = delay % 1000000000LL;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+static int64_t realtime_ns()
+{
+    return systemTime(SYSTEM_TIME_REALTIME);
+}
+
+static int percentile(const std::vector<int>& sorted, int percent)
+{
+    if (sorted.size() == 0)
+        return 0;
+    size_t i = (sorted.size() * percent) / 100;
+    return sorted[i < sorted.size() ? i : sorted.size() - 1];
+}
+
+/* open the evdev device called name, like the HALs do */
+static int open_input(const char* name)
+{
+    const char* dirname = "/dev/input";
+    char devname[PATH_MAX];
+    DIR* dir;
+    struct dirent* de;
+    int fd = -1;
+
+    dir = opendir(dirname);
+    if (dir == NULL)
+        return -1;
+    while ((de = readdir(dir))) {
+        char devName[TRACE_NAME_SIZE];
+        if (strncmp(de->d_name, "event", 5))
+            continue;
+        snprintf(devname, sizeof(devname), "%s/%s", dirname, de->d_name);
+        fd = open(devname, O_RDONLY);
+        if (fd < 0)
+            continue;
+        memset(devName, 0, sizeof(devName));
+        if (ioctl(fd, EVIOCGNAME(sizeof(devName) - 1), devName) > 0 &&
+                !strcmp(devName, name)) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    closedir(dir);
+    return fd;
+}
+
+/*****************************************************************************/
+
+static int record(const char* path, int seconds, int numDevices, char** names)
+{
+    struct trace_header header;
+    struct pollfd fds[TRACE_MAX_DEVICES];
+    int64_t last_us = -1;
+    int count = 0;
+
+    if (numDevices > TRACE_MAX_DEVICES) {
+        printf("at most %d devices can be recorded\n", TRACE_MAX_DEVICES);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.numDevices = numDevices;
+    for (int i=0 ; i<numDevices ; i++) {
+        strncpy(header.names[i], names[i], TRACE_NAME_SIZE - 1);
+        fds[i].fd = open_input(names[i]);
+        fds[i].events = POLLIN;
+        if (fds[i].fd < 0) {
+            printf("couldn't find input device '%s'\n", names[i]);
+            return -1;
+        }
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        printf("couldn't create %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+
+    int64_t end = now_ns() + seconds_to_nanoseconds(seconds);
+    while (now_ns() < end) {
+        if (poll(fds, numDevices, 100) <= 0)
+            continue;
+        for (int i=0 ; i<numDevices ; i++) {
+            struct input_event events[64];
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            ssize_t n = read(fds[i].fd, events, sizeof(events));
+            if (n <= 0)
+                continue;
+            for (int j=0 ; j<int(n / sizeof(events[0])) ; j++) {
+                const struct input_event& ev = events[j];
+                int64_t t = int64_t(ev.time.tv_sec) * 1000000 + ev.time.tv_usec;
+                struct trace_event te;
+                te.device = i;
+                te.type = ev.type;
+                te.code = ev.code;
+                te.reserved = 0;
+                te.value = ev.value;
+                te.delta_us = (last_us < 0 || t < last_us) ? 0 : uint32_t(t - last_us);
+                last_us = t;
+                fwrite(&te, sizeof(te), 1, file);
+                count++;
+            }
+        }
+    }
+
+    fclose(file);
+    for (int i=0 ; i<numDevices ; i++)
+        close(fds[i].fd);
+    printf("recorded %d events from %d device(s) into %s\n", count, numDevices, path);
+    return 0;
+}
+
+/*****************************************************************************/
+
+struct written_frame {
+    int64_t mono;   // now_ns() when the SYN_REPORT was written
+    int64_t real;   // the same instant on the evdev clock
+};
+
+struct replay_t {
+    struct trace_header header;
+    std::vector<trace_event> events;
+    int fds[TRACE_MAX_DEVICES];
+    int rate;
+    int repeat;
+
+    pthread_mutex_t lock;
+    std::vector<written_frame> written; // frames written but not delivered yet
+    volatile int done;
+    volatile int stop;
+    int frames;
+    int64_t start;
+    int64_t end;
+};
+
+static int load_trace(const char* path, replay_t* replay)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("couldn't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    if (fread(&replay->header, sizeof(replay->header), 1, file) != 1 ||
+            replay->header.magic != TRACE_MAGIC ||
+            replay->header.version != TRACE_VERSION ||
+            replay->header.numDevices > TRACE_MAX_DEVICES) {
+        printf("%s is not a version %d trace\n", path, TRACE_VERSION);
+        fclose(file);
+        return -1;
+    }
+    struct trace_event te;
+    while (fread(&te, sizeof(te), 1, file) == 1) {
+        if (te.device < replay->header.numDevices)
+            replay->events.push_back(te);
+    }
+    fclose(file);
+    return 0;
+}
+
+/* create a uinput device that accepts every event of 'device' in the trace */
+static int create_device(const replay_t* replay, int device)
+{
+    struct uinput_user_dev dev;
+    bool types[EV_MAX + 1];
+    int fd;
+
+    fd = open("/dev/uinput", O_WRONLY);
+    if (fd < 0)
+        fd = open("/dev/input/uinput", O_WRONLY);
+    if (fd < 0) {
+        printf("couldn't open uinput (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&dev, 0, sizeof(dev));
+    memset(types, 0, sizeof(types));
+    strncpy(dev.name, replay->header.names[device], UINPUT_MAX_NAME_SIZE - 1);
+    dev.id.bustype = BUS_VIRTUAL;
+    for (int i=0 ; i<=ABS_MAX ; i++) {
+        dev.absmin[i] = INT32_MAX;
+        dev.absmax[i] = INT32_MIN;
+    }
+
+    for (size_t i=0 ; i<replay->events.size() ; i++) {
+        const trace_event& te = replay->events[i];
+        if (te.device != device || te.type > EV_MAX)
+            continue;
+        if (!types[te.type]) {
+            ioctl(fd, UI_SET_EVBIT, te.type);
+            types[te.type] = true;
+        }
+        switch (te.type) {
+            case EV_ABS:
+                if (te.code > ABS_MAX)
+                    break;
+                ioctl(fd, UI_SET_ABSBIT, te.code);
+                dev.absmin[te.code] = std::min(dev.absmin[te.code], te.value);
+                dev.absmax[te.code] = std::max(dev.absmax[te.code], te.value);
+                break;
+            case EV_REL:
+                ioctl(fd, UI_SET_RELBIT, te.code);
+                break;
+            case EV_KEY:
+                ioctl(fd, UI_SET_KEYBIT, te.code);
+                break;
+            case EV_MSC:
+                ioctl(fd, UI_SET_MSCBIT, te.code);
+                break;
+        }
+    }
+
+    // leave room on both sides for the keep-alive frames
+    for (int i=0 ; i<=ABS_MAX ; i++) {
+        if (dev.absmin[i] > dev.absmax[i]) {
+            dev.absmin[i] = dev.absmax[i] = 0;
+        } else {
+            dev.absmin[i] -= 1;
+            dev.absmax[i] += 1;
+        }
+    }
+
+    if (write(fd, &dev, sizeof(dev)) != sizeof(dev) ||
+            ioctl(fd, UI_DEV_CREATE) < 0) {
+        printf("couldn't create input device '%s' (%s)\n", dev.name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void write_event(int fd, int type, int code, int value)
+{
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    write(fd, &ev, sizeof(ev));
+}
+
+static void on_alarm(int)
+{
+    static const char msg[] = "the HAL stopped returning events\n";
+    syscall(__NR_write, 2, msg, sizeof(msg) - 1);
+    _exit(1);
+}
+
+static void* replay_thread(void* arg)
+{
+    replay_t* replay = (replay_t*)arg;
+    int64_t interval = replay->rate > 0 ? 1000000000LL / replay->rate : 0;
+    int last[TRACE_MAX_DEVICES];
+
+    for (int i=0 ; i<TRACE_MAX_DEVICES ; i++)
+        last[i] = -1;
+
+    replay->start = now_ns();
+    int64_t next = replay->start;
+    for (int pass=0 ; pass<replay->repeat ; pass++) {
+        for (size_t i=0 ; i<replay->events.size() ; i++) {
+            const trace_event& te = replay->events[i];
+            if (replay->rate == 0) {
+                next += int64_t(te.delta_us) * 1000;
+                sleep_until(next);
+            }
+            write_event(replay->fds[te.device], te.type, te.code, te.value);
+            if (te.type != EV_SYN) {
+                last[te.device] = i;
+                continue;
+            }
+            if (te.code != SYN_REPORT)
+                continue;
+            written_frame frame;
+            frame.mono = now_ns();
+            frame.real = realtime_ns();
+            pthread_mutex_lock(&replay->lock);
+            replay->written.push_back(frame);
+            replay->frames++;
+            pthread_mutex_unlock(&replay->lock);
+            if (replay->rate > 0) {
+                next += interval;
+                sleep_until(next);
+            }
+        }
+    }
+    replay->end = now_ns();
+    replay->done = 1;
+
+    /*
+     * the polling thread only sees 'done' once poll() returns, keep the
+     * HAL busy with frames that change the last value of each device by
+     * one. Give up if nothing comes back.
+     */
+    signal(SIGALRM, on_alarm);
+    alarm(5);
+    for (int toggle=1 ; !replay->stop ; toggle^=1) {
+        for (uint32_t d=0 ; d<replay->header.numDevices ; d++) {
+            if (last[d] < 0)
+                continue;
+            const trace_event& te = replay->events[last[d]];
+            write_event(replay->fds[d], te.type, te.code, te.value + toggle);
+            write_event(replay->fds[d], EV_SYN, SYN_REPORT, 0);
+        }
+        usleep(20000);
+    }
+    alarm(0);
+    return NULL;
+}
+
+/*
+ * evdev stamps a frame when it is written and the HALs pass that time on,
+ * some after moving it to the monotonic clock. The frame behind an event is
+ * the written one closest to its timestamp on either clock.
+ */
+static const int64_t MATCH_WINDOW_NS = 1000000;
+static const int64_t STALE_FRAME_NS = 1000000000;
+
+static int match_frame(const std::vector<written_frame>& written, int64_t timestamp)
+{
+    int best = -1;
+    int64_t bestDelta = MATCH_WINDOW_NS;
+    for (size_t i=0 ; i<written.size() ; i++) {
+        int64_t delta = std::min(llabs(timestamp - written[i].mono),
+                llabs(timestamp - written[i].real));
+        if (delta < bestDelta) {
+            best = int(i);
+            bestDelta = delta;
+        }
+    }
+    return best;
+}
+
+/*****************************************************************************/
+
+static int open_sensors(sensors_poll_device_t** device, struct sensor_t const** list, int delay_ms)
+{
+    int err;
+    struct sensors_module_t* module;
+
+    err = hw_get_module(SENSORS_HARDWARE_MODULE_ID, (hw_module_t const**)&module);
+    if (err != 0) {
+        printf("hw_get_module() failed (%s)\n", strerror(-err));
+        return -1;
+    }
+
+    err = sensors_open(&module->common, device);
+    if (err != 0) {
+        printf("sensors_open() failed (%s)\n", strerror(-err));
+        return -1;
+    }
+
+    int count = module->get_sensors_list(module, list);
+    for (int i=0 ; i<count ; i++) {
+        err = (*device)->activate(*device, (*list)[i].handle, 1);
+        if (err != 0) {
+            // uinput devices have no sysfs controls, carry on without them
+            printf("activate() for '%s' failed (%s)\n",
+                    (*list)[i].name, strerror(-err));
+        }
+        (*device)->setDelay(*device, (*list)[i].handle, ms2ns(delay_ms));
+    }
+    return count;
+}
+
+static void close_sensors(sensors_poll_device_t* device, struct sensor_t const* list, int count)
+{
+    for (int i=0 ; i<count ; i++)
+        device->activate(device, list[i].handle, 0);
+    sensors_close(device);
+}
+
+static int bench(replay_t* replay, int seconds)
+{
+    sensors_poll_device_t* device;
+    struct sensor_t const* list;
+    int count;
+
+    count = open_sensors(&device, &list, 10);
+    if (count < 0)
+        return -1;
+
+    static const size_t numEvents = 16;
+    sensors_event_t buffer[numEvents];
+    std::vector<int> latencies;
+    std::vector<int> perSensor(count, 0);
+    pthread_t thread;
+    int events = 0;
+    int polls = 0;
+    int unmatched = 0;
+
+    if (replay) {
+        pthread_mutex_init(&replay->lock, NULL);
+        pthread_create(&thread, NULL, replay_thread, replay);
+    }
+
+    sCountedThread = pthread_self();
+    sReads = sWrites = 0;
+    sCounting = 1;
+
+    int64_t start = now_ns();
+    int64_t end = start + seconds_to_nanoseconds(seconds);
+    int64_t now = start;
+    bool finished = false;
+    while (!finished) {
+        int n = device->poll(device, buffer, numEvents);
+        now = now_ns();
+        if (n < 0) {
+            printf("poll() failed (%s)\n", strerror(-n));
+            break;
+        }
+        polls++;
+        events += n;
+        for (int i=0 ; i<n ; i++) {
+            for (int j=0 ; j<count ; j++) {
+                if (list[j].handle == buffer[i].sensor) {
+                    perSensor[j]++;
+                    break;
+                }
+            }
+        }
+
+        if (replay) {
+            pthread_mutex_lock(&replay->lock);
+            std::vector<written_frame>& written = replay->written;
+            for (int i=0 ; i<n ; i++) {
+                int f = match_frame(written, buffer[i].timestamp);
+                if (f >= 0) {
+                    latencies.push_back(int((now - written[f].mono) / 1000));
+                    written.erase(written.begin() + f);
+                }
+            }
+            // frames the HAL coalesced or dropped
+            while (written.size() && now - written.front().mono > STALE_FRAME_NS) {
+                written.erase(written.begin());
+                unmatched++;
+            }
+            finished = replay->done;
+            pthread_mutex_unlock(&replay->lock);
+        } else {
+            finished = now >= end;
+        }
+    }
+    sCounting = 0;
+
+    if (replay) {
+        replay->stop = 1;
+        pthread_join(thread, NULL);
+        unmatched += replay->written.size();
+        start = replay->start;
+        now = replay->end;
+        printf("replayed %d frames (%d input events, %d pass(es))\n",
+                replay->frames, int(replay->events.size()) * replay->repeat,
+                replay->repeat);
+    }
+
+    int64_t elapsed_ms = (now - start) / 1000000;
+    printf("%d events from %d poll() calls in %lld ms, %lld events/sec\n",
+            events, polls, elapsed_ms,
+            elapsed_ms ? (int64_t(events) * 1000) / elapsed_ms : 0);
+    for (int j=0 ; j<count ; j++) {
+        if (perSensor[j])
+            printf("\t%s: %d\n", list[j].name, perSensor[j]);
+    }
+    if (events) {
+        printf("per event: %.2f read(), %.2f write(), %.2f poll() calls\n",
+                float(sReads) / events, float(sWrites) / events,
+                float(polls) / events);
+    }
+    if (latencies.size()) {
+        std::sort(latencies.begin(), latencies.end());
+        printf("latency p50=%dus p90=%dus p99=%dus max=%dus\n",
+                percentile(latencies, 50), percentile(latencies, 90),
+                percentile(latencies, 99), latencies.back());
+    }
+    if (unmatched)
+        printf("%d frames not matched to an event\n", unmatched);
+
+    close_sensors(device, list, count);
+    return 0;
+}
+
+static int replay(const char* path, int rate, int repeat)
+{
+    replay_t* replay = new replay_t;
+    int result = -1;
+
+    replay->rate = rate;
+    replay->repeat = repeat > 0 ? repeat : 1;
+    replay->done = 0;
+    replay->stop = 0;
+    replay->frames = 0;
+    for (int i=0 ; i<TRACE_MAX_DEVICES ; i++)
+        replay->fds[i] = -1;
+
+    if (load_trace(path, replay) == 0) {
+        uint32_t d;
+        for (d=0 ; d<replay->header.numDevices ; d++) {
+            replay->fds[d] = create_device(replay, d);
+            if (replay->fds[d] < 0)
+                break;
+        }
+        if (d == replay->header.numDevices) {
+            // give ueventd a moment to create the device nodes
+            usleep(200000);
+            result = bench(replay, 0);
+        }
+    }
+
+    for (int i=0 ; i<TRACE_MAX_DEVICES ; i++) {
+        if (replay->fds[i] >= 0) {
+            ioctl(replay->fds[i], UI_DEV_DESTROY);
+            close(replay->fds[i]);
+        }
+    }
+    delete replay;
+    return result;
+}
+
+static void usage()
+{
+    printf("usage: test-sensorbench record <trace> <seconds> <input name>...\n"
+           "       test-sensorbench replay <trace> [rate [repeat]]\n"
+           "       test-sensorbench bench <seconds>\n");
+}
+
+int main(int argc, char** argv)
+{
+    int err = -1;
+
+    if (argc >= 5 && !strcmp(argv[1], "record")) {
+        err = record(argv[2], atoi(argv[3]), argc - 4, argv + 4);
+    } else if (argc >= 3 && !strcmp(argv[1], "replay")) {
+        err = replay(argv[2], argc > 3 ? atoi(argv[3]) : 0,
+                argc > 4 ? atoi(argv[4]) : 1);
+    } else if (argc == 3 && !strcmp(argv[1], "bench")) {
+        err = bench(NULL, atoi(argv[2]));
+    } else {
+        usage();
+    }
+    return err ? 1 : 0;
+}
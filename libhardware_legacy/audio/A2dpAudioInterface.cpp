@@ -30,6 +30,10 @@ namespace android_audio_legacy {
 
 static const char *sA2dpWakeLock = "A2dpOutputStream";
 #define MAX_WRITE_RETRIES  5
+// buffers the sink may run ahead of real time before writes are paced
+#define A2DP_ELASTIC_BUFFERS  2
+// buffers the sink may fall behind before the pacing clock is restarted
+#define A2DP_RESYNC_BUFFERS   4
 
 // ----------------------------------------------------------------------------
 
@@ -225,7 +229,9 @@ A2dpAudioInterface::A2dpAudioStreamOut::A2dpAudioStreamOut() :
     mFd(-1), mStandby(true), mStartCount(0), mRetryCount(0), mData(NULL),
     // assume BT enabled to start, this is safe because its only the
     // enabled->disabled transition we are worried about
-    mBluetoothEnabled(true), mDevice(0), mClosing(false), mSuspended(false)
+    mBluetoothEnabled(true), mDevice(0), mClosing(false), mSuspended(false),
+    mPaceStart(0), mPaceFrames(0), mRenderFrames(0), mWrites(0), mRetries(0),
+    mErrors(0), mThrottles(0), mResyncs(0), mMaxLeadUs(0), mMaxLagUs(0)
 {
     // use any address by default
     strcpy(mA2dpAddress, "00:00:00:00:00:00");
@@ -275,6 +281,8 @@ A2dpAudioInterface::A2dpAudioStreamOut::~A2dpAudioStreamOut()
 ssize_t A2dpAudioInterface::A2dpAudioStreamOut::write(const void* buffer, size_t bytes)
 {
     status_t status = -1;
+    uint32_t frames = bytes / frameSize();
+    int64_t sleepUs;
     {
         Mutex::Autolock lock(mLock);
 
@@ -290,7 +298,8 @@ ssize_t A2dpAudioInterface::A2dpAudioStreamOut::write(const void* buffer, size_t
         if (mStandby) {
             acquire_wake_lock (PARTIAL_WAKE_LOCK, sA2dpWakeLock);
             mStandby = false;
-            mLastWriteTime = systemTime();
+            Mutex::Autolock positionLock(mPositionLock);
+            mRenderFrames = 0;
         }
 
         status = init();
@@ -306,33 +315,82 @@ ssize_t A2dpAudioInterface::A2dpAudioStreamOut::write(const void* buffer, size_t
             }
             if (status == 0) {
                 retries--;
+                mRetries++;
             }
             remaining -= status;
             buffer = (char *)buffer + status;
         }
-
-        // if A2DP sink runs abnormally fast, sleep a little so that audioflinger mixer thread
-        // does no spin and starve other threads.
-        // NOTE: It is likely that the A2DP headset is being disconnected
-        nsecs_t now = systemTime();
-        if ((uint32_t)ns2us(now - mLastWriteTime) < (mBufferDurationUs >> 2)) {
-            LOGV("A2DP sink runs too fast");
-            usleep(mBufferDurationUs - (uint32_t)ns2us(now - mLastWriteTime));
+        mWrites++;
+
+        // If the A2DP sink runs abnormally fast, likely because the headset is
+        // being disconnected, hold the mixer thread back to real time so it
+        // does not spin and starve other threads. Short bursts within the
+        // elastic margin are let through to absorb a2dp_write jitter.
+        sleepUs = pace_l(frames, (int64_t)mBufferDurationUs * A2DP_ELASTIC_BUFFERS);
+        {
+            Mutex::Autolock positionLock(mPositionLock);
+            mRenderFrames += (bytes - remaining) / frameSize();
         }
-        mLastWriteTime = now;
-        return bytes;
-
     }
+    if (sleepUs > 0) {
+        LOGV("A2DP sink runs too fast, sleeping %lld us", sleepUs);
+        usleep(sleepUs);
+    }
+    return bytes;
+
 Error:
 
     standby();
 
     // Simulate audio output timing in case of error
-    usleep(mBufferDurationUs);
+    {
+        Mutex::Autolock lock(mLock);
+        mErrors++;
+        sleepUs = pace_l(frames, 0);
+    }
+    if (sleepUs > 0) {
+        usleep(sleepUs);
+    }
 
     return status;
 }
 
+// Advance the pacing clock by frames and return how long the caller should
+// sleep for the sink to be at most leadUs ahead of real time.
+int64_t A2dpAudioInterface::A2dpAudioStreamOut::pace_l(uint32_t frames, int64_t leadUs)
+{
+    Mutex::Autolock lock(mPositionLock);
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    if (mPaceStart == 0) {
+        mPaceStart = now;
+        mPaceFrames = 0;
+    }
+    mPaceFrames += frames;
+
+    nsecs_t due = mPaceStart + (nsecs_t)(mPaceFrames * 1000000000LL / sampleRate());
+    int64_t skewUs = ns2us(due - now);
+
+    if (skewUs < -(int64_t)mBufferDurationUs * A2DP_RESYNC_BUFFERS) {
+        // After a stall or an idle period start over rather than letting
+        // the sink burst to catch up.
+        LOGV("A2DP pacing resync, %lld us behind", -skewUs);
+        mResyncs++;
+        mPaceStart = now;
+        mPaceFrames = 0;
+        return 0;
+    }
+
+    if (skewUs > mMaxLeadUs) mMaxLeadUs = skewUs;
+    if (-skewUs > mMaxLagUs) mMaxLagUs = -skewUs;
+
+    if (skewUs > leadUs) {
+        mThrottles++;
+        return skewUs - leadUs;
+    }
+    return 0;
+}
+
 status_t A2dpAudioInterface::A2dpAudioStreamOut::init()
 {
     if (!mData) {
@@ -487,13 +545,52 @@ status_t A2dpAudioInterface::A2dpAudioStreamOut::close_l()
 
 status_t A2dpAudioInterface::A2dpAudioStreamOut::dump(int fd, const Vector<String16>& args)
 {
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    Mutex::Autolock lock(mPositionLock);
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    uint32_t sinkRate = 0;
+    if (mPaceStart != 0 && now > mPaceStart) {
+        sinkRate = (uint32_t)(mPaceFrames * 1000000000LL / (now - mPaceStart));
+    }
+
+    snprintf(buffer, SIZE, "A2dpAudioStreamOut::dump\n");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tstandby: %d address: %s\n", mStandby, mA2dpAddress);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tsink rate: %u frames/s (nominal %u)\n", sinkRate, sampleRate());
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\twrites: %u retries: %u errors: %u\n", mWrites, mRetries, mErrors);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tthrottled: %u resyncs: %u\n", mThrottles, mResyncs);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tskew: max lead %lld us, max lag %lld us\n", mMaxLeadUs, mMaxLagUs);
+    result.append(buffer);
+    ::write(fd, result.string(), result.size());
+
     return NO_ERROR;
 }
 
+// Frames written since leaving standby, less those the pacing clock says the
+// sink has not played yet.
 status_t A2dpAudioInterface::A2dpAudioStreamOut::getRenderPosition(uint32_t *driverFrames)
 {
-    //TODO: enable when supported by driver
-    return INVALID_OPERATION;
+    Mutex::Autolock lock(mPositionLock);
+
+    if (mPaceStart == 0) {
+        return INVALID_OPERATION;
+    }
+
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t due = mPaceStart + (nsecs_t)(mPaceFrames * 1000000000LL / sampleRate());
+    uint64_t pending = 0;
+    if (due > now) {
+        pending = (uint64_t)(due - now) * sampleRate() / 1000000000LL;
+    }
+    *driverFrames = (uint32_t)(pending < mRenderFrames ? mRenderFrames - pending : 0);
+    return NO_ERROR;
 }
 
 }; // namespace android
@@ -105,6 +105,7 @@ private:
                 status_t    setBluetoothEnabled(bool enabled);
                 status_t    setSuspended(bool onOff);
                 status_t    standby_l();
+                int64_t     pace_l(uint32_t frames, int64_t leadUs);
 
     private:
                 int         mFd;
@@ -118,8 +119,22 @@ private:
                 uint32_t    mDevice;
                 bool        mClosing;
                 bool        mSuspended;
-                nsecs_t     mLastWriteTime;
                 uint32_t    mBufferDurationUs;
+
+                // Writes are paced against CLOCK_MONOTONIC: frame
+                // mPaceFrames is due at mPaceStart plus its duration.
+                mutable Mutex mPositionLock;
+                nsecs_t     mPaceStart;
+                uint64_t    mPaceFrames;
+                uint64_t    mRenderFrames;      // written since leaving standby
+
+                uint32_t    mWrites;
+                uint32_t    mRetries;           // a2dp_write accepted nothing
+                uint32_t    mErrors;
+                uint32_t    mThrottles;         // slept, the sink ran ahead
+                uint32_t    mResyncs;           // clock restarted, the sink fell behind
+                int64_t     mMaxLeadUs;
+                int64_t     mMaxLagUs;
     };
 
     friend class A2dpAudioStreamOut;
@@ -23,7 +23,10 @@
 #include <utils/Log.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <cutils/atomic.h>
 
 #include "AudioDumpInterface.h"
 
@@ -99,6 +102,7 @@ AudioStreamOut* AudioDumpInterface::openOutputStream(
     AudioStreamOutDump *dumOutput = new AudioStreamOutDump(this, mOutputs.size(), outFinal,
             devices, lFormat, lChannels, lRate);
     mOutputs.add(dumOutput);
+    dumOutput->startWriter();
 
     return dumOutput;
 }
@@ -165,6 +169,7 @@ AudioStreamIn* AudioDumpInterface::openInputStream(uint32_t devices, int *format
     AudioStreamInDump *dumInput = new AudioStreamInDump(this, mInputs.size(), inFinal,
             devices, lFormat, lChannels, lRate);
     mInputs.add(dumInput);
+    dumInput->startWriter();
 
     return dumInput;
 }
@@ -196,6 +201,12 @@ status_t AudioDumpInterface::setParameters(const String8& keyValuePairs)
     if (param.get(String8("test_cmd_file_name"), value) == NO_ERROR) {
         mFileName = value;
         param.remove(String8("test_cmd_file_name"));
+        for (size_t i = 0; i < mOutputs.size(); i++) {
+            mOutputs[i]->startWriter();
+        }
+        for (size_t i = 0; i < mInputs.size(); i++) {
+            mInputs[i]->startWriter();
+        }
     }
     if (param.get(String8("test_cmd_policy"), value) == NO_ERROR) {
         Mutex::Autolock _l(mLock);
@@ -255,6 +266,256 @@ size_t AudioDumpInterface::getInputBufferSize(uint32_t sampleRate, int format, i
 
 // ----------------------------------------------------------------------------
 
+static void putLe16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void putLe32(uint8_t *p, uint32_t v)
+{
+    putLe16(p, v & 0xffff);
+    putLe16(p + 2, v >> 16);
+}
+
+AudioDumpWriter::AudioDumpWriter(const char *name, int format,
+                                 uint32_t channels, uint32_t sampleRate)
+    : Thread(false), mBaseName(name), mFileCount(0),
+      mFormat(format), mChannels(channels), mSampleRate(sampleRate),
+      mWave(false), mChannelCount(0), mBitsPerSample(0), mFileRate(0),
+      mFile(0), mOpened(false), mRing(0), mReadPos(0), mWritePos(0),
+      mSplitPos(0), mSplitPending(0), mDataBytes(0), mQueuedBlocks(0), mDroppedBlocks(0)
+{
+    mSemValid = sem_init(&mWakeSem, 0, 0) == 0;
+    if (mSemValid) {
+        mRing = (uint8_t *)malloc(AUDIO_DUMP_RING_SIZE);
+    }
+}
+
+AudioDumpWriter::~AudioDumpWriter()
+{
+    free(mRing);
+    if (mSemValid) {
+        sem_destroy(&mWakeSem);
+    }
+}
+
+// threadLoop() is not called at all if stop() came first.
+status_t AudioDumpWriter::readyToRun()
+{
+    if (exitPending()) {
+        finish();
+        mSelf.clear();
+    }
+    return NO_ERROR;
+}
+
+bool AudioDumpWriter::threadLoop()
+{
+    while (sem_wait(&mWakeSem) != 0 && errno == EINTR) {
+    }
+    if (exitPending()) {
+        finish();
+        mSelf.clear();
+        return false;
+    }
+    flushAll();
+    return true;
+}
+
+bool AudioDumpWriter::queue(const void* buffer, size_t bytes)
+{
+    uint32_t w = (uint32_t)mWritePos;
+    uint32_t used = w - (uint32_t)android_atomic_acquire_load(&mReadPos);
+
+    mQueuedBlocks++;
+    if (bytes > AUDIO_DUMP_RING_SIZE - used) {
+        android_atomic_inc(&mDroppedBlocks);
+        return false;
+    }
+
+    size_t offset = w & (AUDIO_DUMP_RING_SIZE - 1);
+    size_t first = AUDIO_DUMP_RING_SIZE - offset;
+    if (first > bytes) first = bytes;
+    memcpy(mRing + offset, buffer, first);
+    memcpy(mRing, (const uint8_t *)buffer + first, bytes - first);
+    android_atomic_release_store((int32_t)(w + bytes), &mWritePos);
+
+    // Wake the writer once each time the ring passes a quarter; the rest is
+    // written at the next split() or stop().
+    if (used < AUDIO_DUMP_RING_SIZE / 4 && used + bytes >= AUDIO_DUMP_RING_SIZE / 4) {
+        sem_post(&mWakeSem);
+    }
+    return true;
+}
+
+void AudioDumpWriter::split()
+{
+    android_atomic_release_store(mWritePos, &mSplitPos);
+    android_atomic_release_store(1, &mSplitPending);
+    sem_post(&mWakeSem);
+}
+
+void AudioDumpWriter::setFormat(int format, uint32_t channels, uint32_t sampleRate)
+{
+    android_atomic_release_store(format, &mFormat);
+    android_atomic_release_store((int32_t)channels, &mChannels);
+    android_atomic_release_store((int32_t)sampleRate, &mSampleRate);
+}
+
+void AudioDumpWriter::openFile()
+{
+    int format = android_atomic_acquire_load(&mFormat);
+
+    mWave = format == AudioSystem::PCM_16_BIT || format == AudioSystem::PCM_8_BIT;
+    mChannelCount = AudioSystem::popCount((uint32_t)android_atomic_acquire_load(&mChannels));
+    mBitsPerSample = format == AudioSystem::PCM_8_BIT ? 8 : 16;
+    mFileRate = (uint32_t)android_atomic_acquire_load(&mSampleRate);
+    mDataBytes = 0;
+
+    char name[255];
+    snprintf(name, sizeof(name), "%s_%d%s", mBaseName.string(), ++mFileCount,
+             mWave ? ".wav" : ".pcm");
+    mName = name;
+    mOpened = true;
+    mFile = fopen(mName.string(), "wb");
+    LOGV("Opening dump file %s, fh %p", mName.string(), mFile);
+    if (mFile && mWave) {
+        writeHeader();
+    }
+}
+
+void AudioDumpWriter::closeFile()
+{
+    if (mFile) {
+        if (mWave) {
+            writeHeader();
+        }
+        fclose(mFile);
+        mFile = 0;
+    }
+    mOpened = false;
+}
+
+// Writes the ring up to 'end' to the current file. A split the writer only
+// sees after flushing past it ends the file where it stands.
+void AudioDumpWriter::flush(uint32_t end)
+{
+    uint32_t r = (uint32_t)mReadPos;
+
+    if ((int32_t)(end - r) <= 0) {
+        return;
+    }
+    if (!mOpened) {
+        openFile();
+    }
+
+    while (r != end) {
+        size_t offset = r & (AUDIO_DUMP_RING_SIZE - 1);
+        size_t n = AUDIO_DUMP_RING_SIZE - offset;
+        if (n > end - r) n = end - r;
+        if (mFile) {
+            fwrite(mRing + offset, n, 1, mFile);
+        }
+        mDataBytes += n;
+        r += n;
+        android_atomic_release_store((int32_t)r, &mReadPos);
+    }
+}
+
+void AudioDumpWriter::flushAll()
+{
+    if (android_atomic_acquire_load(&mSplitPending)) {
+        // cleared first so a split() coming in now is seen next time
+        android_atomic_release_store(0, &mSplitPending);
+        flush((uint32_t)android_atomic_acquire_load(&mSplitPos));
+        closeFile();
+    }
+    flush((uint32_t)android_atomic_acquire_load(&mWritePos));
+}
+
+// Called with an empty file to reserve the header and again by closeFile()
+// once the data size is known.
+void AudioDumpWriter::writeHeader()
+{
+    uint8_t hdr[AUDIO_DUMP_WAVE_HDR_SIZE];
+    uint16_t blockAlign = mChannelCount * mBitsPerSample / 8;
+
+    memcpy(hdr, "RIFF", 4);
+    putLe32(hdr + 4, AUDIO_DUMP_WAVE_HDR_SIZE - 8 + mDataBytes);
+    memcpy(hdr + 8, "WAVEfmt ", 8);
+    putLe32(hdr + 16, 16);
+    putLe16(hdr + 20, 1);   // PCM
+    putLe16(hdr + 22, mChannelCount);
+    putLe32(hdr + 24, mFileRate);
+    putLe32(hdr + 28, mFileRate * blockAlign);
+    putLe16(hdr + 32, blockAlign);
+    putLe16(hdr + 34, mBitsPerSample);
+    memcpy(hdr + 36, "data", 4);
+    putLe32(hdr + 40, mDataBytes);
+
+    fseek(mFile, 0, SEEK_SET);
+    fwrite(hdr, sizeof(hdr), 1, mFile);
+    fseek(mFile, 0, SEEK_END);
+}
+
+// Runs on the writer thread once stop() was called, after the last queue().
+void AudioDumpWriter::finish()
+{
+    flushAll();
+    closeFile();
+
+    int32_t dropped = android_atomic_acquire_load(&mDroppedBlocks);
+    if (dropped) {
+        LOGW("Dump files %s_* dropped %d of %u blocks", mBaseName.string(), dropped, mQueuedBlocks);
+    }
+}
+
+void AudioDumpWriter::stop()
+{
+    mSelf = this;
+    requestExit();
+    sem_post(&mWakeSem);
+}
+
+void AudioDumpWriter::dump(String8& result) const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+
+    snprintf(buffer, SIZE, "\tdump file: %s\n", mName.string());
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tdump ring: %u/%d bytes, %u bytes in this file\n",
+             (uint32_t)mWritePos - (uint32_t)mReadPos, AUDIO_DUMP_RING_SIZE, mDataBytes);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tdump blocks: %u queued, %d dropped\n",
+             mQueuedBlocks, android_atomic_acquire_load(&mDroppedBlocks));
+    result.append(buffer);
+}
+
+static sp<AudioDumpWriter> startDumpWriter(const char *name, int format,
+                                            uint32_t channels, uint32_t sampleRate)
+{
+    sp<AudioDumpWriter> writer = new AudioDumpWriter(name, format, channels, sampleRate);
+    if (!writer->isValid() ||
+            writer->run("AudioDumpWriter", ANDROID_PRIORITY_BACKGROUND) != NO_ERROR) {
+        LOGE("Unable to start dump writer for %s", name);
+        writer.clear();
+    }
+    return writer;
+}
+
+static void dumpWriter(int fd, const sp<AudioDumpWriter>& writer)
+{
+    if (writer != 0) {
+        String8 result;
+        writer->dump(result);
+        ::write(fd, result.string(), result.size());
+    }
+}
+
+// ----------------------------------------------------------------------------
+
 AudioStreamOutDump::AudioStreamOutDump(AudioDumpInterface *interface,
                                         int id,
                                         AudioStreamOut* finalStream,
@@ -264,7 +525,7 @@ AudioStreamOutDump::AudioStreamOutDump(AudioDumpInterface *interface,
                                         uint32_t sampleRate)
     : mInterface(interface), mId(id),
       mSampleRate(sampleRate), mFormat(format), mChannels(channels), mLatency(0), mDevice(devices),
-      mBufferSize(1024), mFinalStream(finalStream), mFile(0), mFileCount(0)
+      mBufferSize(1024), mFinalStream(finalStream), mWriterChanged(0), mActive(false)
 {
     LOGV("AudioStreamOutDump Constructor %p, mInterface %p, mFinalStream %p", this, mInterface, mFinalStream);
 }
@@ -274,6 +535,9 @@ AudioStreamOutDump::~AudioStreamOutDump()
 {
     LOGV("AudioStreamOutDump destructor");
     Close();
+    if (mNextWriter != 0) {
+        mNextWriter->stop();
+    }
 }
 
 ssize_t AudioStreamOutDump::write(const void* buffer, size_t bytes)
@@ -286,25 +550,22 @@ ssize_t AudioStreamOutDump::write(const void* buffer, size_t bytes)
         usleep((((bytes * 1000) / frameSize()) / sampleRate()) * 1000);
         ret = bytes;
     }
-    if(!mFile) {
-        if (mInterface->fileName() != "") {
-            char name[255];
-            sprintf(name, "%s_out_%d_%d.pcm", mInterface->fileName().string(), mId, ++mFileCount);
-            mFile = fopen(name, "wb");
-            LOGV("Opening dump file %s, fh %p", name, mFile);
-        }
-    }
-    if (mFile) {
-        fwrite(buffer, bytes, 1, mFile);
+    mActive = true;
+    takeWriter();
+    if (mWriter != 0) {
+        mWriter->queue(buffer, bytes);
     }
     return ret;
 }
 
 status_t AudioStreamOutDump::standby()
 {
-    LOGV("AudioStreamOutDump standby(), mFile %p, mFinalStream %p", mFile, mFinalStream);
+    LOGV("AudioStreamOutDump standby(), mWriter %p, mFinalStream %p", mWriter.get(), mFinalStream);
 
-    Close();
+    mActive = false;
+    if (mWriter != 0) {
+        mWriter->split();
+    }
     if (mFinalStream != 0 ) return mFinalStream->standby();
     return NO_ERROR;
 }
@@ -359,7 +620,7 @@ status_t AudioStreamOutDump::setParameters(const String8& keyValuePairs)
     }
 
     if (param.getInt(String8("format"), valueInt) == NO_ERROR) {
-        if (mFile == 0) {
+        if (!mActive) {
             mFormat = valueInt;
         } else {
             status = INVALID_OPERATION;
@@ -374,7 +635,7 @@ status_t AudioStreamOutDump::setParameters(const String8& keyValuePairs)
     }
     if (param.getInt(String8("sampling_rate"), valueInt) == NO_ERROR) {
         if (valueInt > 0 && valueInt <= 48000) {
-            if (mFile == 0) {
+            if (!mActive) {
                 mSampleRate = valueInt;
             } else {
                 status = INVALID_OPERATION;
@@ -383,6 +644,10 @@ status_t AudioStreamOutDump::setParameters(const String8& keyValuePairs)
             status = BAD_VALUE;
         }
     }
+    // runs on the audio thread: the writer only notes the settings for its next file
+    if (mWriter != 0) {
+        mWriter->setFormat(format(), channels(), sampleRate());
+    }
     return status;
 }
 
@@ -396,15 +661,58 @@ String8 AudioStreamOutDump::getParameters(const String8& keys)
 
 status_t AudioStreamOutDump::dump(int fd, const Vector<String16>& args)
 {
+    dumpWriter(fd, mWriter);
     if (mFinalStream != 0 ) return mFinalStream->dump(fd, args);
     return NO_ERROR;
 }
 
 void AudioStreamOutDump::Close()
 {
-    if(mFile) {
-        fclose(mFile);
-        mFile = 0;
+    if (mWriter != 0) {
+        mWriter->stop();
+        mWriter.clear();
+    }
+}
+
+// Called from AudioDumpInterface when the stream is opened and when the dump
+// file name changes, never from the audio thread: allocating the ring and
+// starting the thread is left to the caller, write() only takes the writer.
+// An empty file name stops dumping.
+void AudioStreamOutDump::startWriter()
+{
+    String8 fileName = mInterface->fileName();
+    sp<AudioDumpWriter> writer;
+
+    if (fileName != "") {
+        char name[255];
+        snprintf(name, sizeof(name), "%s_out_%d", fileName.string(), mId);
+        writer = startDumpWriter(name, format(), channels(), sampleRate());
+    }
+
+    AutoMutex lock(mWriterLock);
+    if (mNextWriter != 0) {
+        mNextWriter->stop();
+    }
+    mNextWriter = writer;
+    android_atomic_release_store(1, &mWriterChanged);
+}
+
+// Swaps in the writer from startWriter(), if the lock can be had right away.
+void AudioStreamOutDump::takeWriter()
+{
+    if (android_atomic_acquire_load(&mWriterChanged) == 0 ||
+            mWriterLock.tryLock() != NO_ERROR) {
+        return;
+    }
+    if (mWriter != 0) {
+        mWriter->stop();
+    }
+    mWriter = mNextWriter;
+    mNextWriter.clear();
+    android_atomic_release_store(0, &mWriterChanged);
+    mWriterLock.unlock();
+    if (mWriter != 0) {
+        mWriter->setFormat(format(), channels(), sampleRate());
     }
 }
 
@@ -425,7 +733,7 @@ AudioStreamInDump::AudioStreamInDump(AudioDumpInterface *interface,
                                         uint32_t sampleRate)
     : mInterface(interface), mId(id),
       mSampleRate(sampleRate), mFormat(format), mChannels(channels), mDevice(devices),
-      mBufferSize(1024), mFinalStream(finalStream), mFile(0), mFileCount(0)
+      mBufferSize(1024), mFinalStream(finalStream), mFile(0), mWriterChanged(0)
 {
     LOGV("AudioStreamInDump Constructor %p, mInterface %p, mFinalStream %p", this, mInterface, mFinalStream);
 }
@@ -434,6 +742,9 @@ AudioStreamInDump::AudioStreamInDump(AudioDumpInterface *interface,
 AudioStreamInDump::~AudioStreamInDump()
 {
     Close();
+    if (mNextWriter != 0) {
+        mNextWriter->stop();
+    }
 }
 
 ssize_t AudioStreamInDump::read(void* buffer, ssize_t bytes)
@@ -442,16 +753,9 @@ ssize_t AudioStreamInDump::read(void* buffer, ssize_t bytes)
 
     if (mFinalStream) {
         ret = mFinalStream->read(buffer, bytes);
-        if(!mFile) {
-            if (mInterface->fileName() != "") {
-                char name[255];
-                sprintf(name, "%s_in_%d_%d.pcm", mInterface->fileName().string(), mId, ++mFileCount);
-                mFile = fopen(name, "wb");
-                LOGV("Opening input dump file %s, fh %p", name, mFile);
-            }
-        }
-        if (mFile) {
-            fwrite(buffer, bytes, 1, mFile);
+        takeWriter();
+        if (mWriter != 0 && ret > 0) {
+            mWriter->queue(buffer, ret);
         }
     } else {
         usleep((((bytes * 1000) / frameSize()) / sampleRate()) * 1000);
@@ -501,7 +805,13 @@ status_t AudioStreamInDump::standby()
 {
     LOGV("AudioStreamInDump standby(), mFile %p, mFinalStream %p", mFile, mFinalStream);
 
-    Close();
+    if (mWriter != 0) {
+        mWriter->split();
+    }
+    if(mFile) {
+        fclose(mFile);
+        mFile = 0;
+    }
     if (mFinalStream != 0 ) return mFinalStream->standby();
     return NO_ERROR;
 }
@@ -559,15 +869,56 @@ unsigned int AudioStreamInDump::getInputFramesLost() const
 
 status_t AudioStreamInDump::dump(int fd, const Vector<String16>& args)
 {
+    dumpWriter(fd, mWriter);
     if (mFinalStream != 0 ) return mFinalStream->dump(fd, args);
     return NO_ERROR;
 }
 
 void AudioStreamInDump::Close()
 {
+    if (mWriter != 0) {
+        mWriter->stop();
+        mWriter.clear();
+    }
     if(mFile) {
         fclose(mFile);
         mFile = 0;
     }
 }
+
+// Only streams with a final stream are dumped, see read(). Never called from
+// the audio thread, see AudioStreamOutDump::startWriter().
+void AudioStreamInDump::startWriter()
+{
+    String8 fileName = mInterface->fileName();
+    sp<AudioDumpWriter> writer;
+
+    if (mFinalStream != 0 && fileName != "") {
+        char name[255];
+        snprintf(name, sizeof(name), "%s_in_%d", fileName.string(), mId);
+        writer = startDumpWriter(name, format(), channels(), sampleRate());
+    }
+
+    AutoMutex lock(mWriterLock);
+    if (mNextWriter != 0) {
+        mNextWriter->stop();
+    }
+    mNextWriter = writer;
+    android_atomic_release_store(1, &mWriterChanged);
+}
+
+void AudioStreamInDump::takeWriter()
+{
+    if (android_atomic_acquire_load(&mWriterChanged) == 0 ||
+            mWriterLock.tryLock() != NO_ERROR) {
+        return;
+    }
+    if (mWriter != 0) {
+        mWriter->stop();
+    }
+    mWriter = mNextWriter;
+    mNextWriter.clear();
+    android_atomic_release_store(0, &mWriterChanged);
+    mWriterLock.unlock();
+}
 }; // namespace android
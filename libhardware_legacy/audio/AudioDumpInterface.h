@@ -20,8 +20,10 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <semaphore.h>
 #include <utils/String8.h>
 #include <utils/SortedVector.h>
+#include <utils/threads.h>
 
 #include <hardware_legacy/AudioHardwareBase.h>
 
@@ -29,8 +31,82 @@ namespace android {
 
 #define AUDIO_DUMP_WAVE_HDR_SIZE 44
 
+// bytes of audio the dump writer can hold before blocks are dropped
+#define AUDIO_DUMP_RING_SIZE (256 * 1024)
+
 class AudioDumpInterface;
 
+// Writes dump files from a low priority thread so the audio thread only
+// copies into a preallocated ring and never touches the file system. A block
+// that does not fit in the ring is dropped and counted rather than waited for.
+// PCM streams are written as WAV files. Writers are only created from
+// AudioDumpInterface::setParameters(), and one writer serves every file of a
+// stream: each file is created with its first data and finished at the next
+// split() or stop(). The thread sleeps on a semaphore until the ring fills up,
+// a file ends or it is stopped; sem_post() never blocks the audio thread and
+// a wakeup cannot be lost.
+class AudioDumpWriter : public Thread {
+public:
+                        AudioDumpWriter(const char *name, int format,
+                                        uint32_t channels, uint32_t sampleRate);
+    virtual             ~AudioDumpWriter();
+
+            bool        isValid() const { return mRing != 0; }
+
+    // Called from the audio thread, never blocks. Returns false if the
+    // block was dropped.
+            bool        queue(const void* buffer, size_t bytes);
+
+    // Called from the audio thread on standby, never blocks. Ends the current
+    // file after what was queued so far; the next data starts a new file.
+    // Back to back splits the thread has not caught up with share a file.
+            void        split();
+
+    // Called from the audio thread, takes effect with the next file.
+            void        setFormat(int format, uint32_t channels, uint32_t sampleRate);
+
+    // Asks the thread to write what is left and close the file, never
+    // blocks. The writer keeps a reference to itself until that is done.
+            void        stop();
+
+            void        dump(String8& result) const;
+
+private:
+    virtual status_t    readyToRun();
+    virtual bool        threadLoop();
+
+            void        flush(uint32_t end);
+            void        flushAll();
+            void        openFile();
+            void        closeFile();
+            void        finish();
+            void        writeHeader();
+
+    String8             mBaseName;
+    String8             mName;              // current or last file
+    int                 mFileCount;
+    volatile int32_t    mFormat;            // for the next file, see setFormat()
+    volatile int32_t    mChannels;
+    volatile int32_t    mSampleRate;
+    bool                mWave;              // current file
+    uint16_t            mChannelCount;
+    uint16_t            mBitsPerSample;
+    uint32_t            mFileRate;
+    FILE                *mFile;
+    bool                mOpened;            // fopen() was tried for this file
+    uint8_t             *mRing;
+    volatile int32_t    mReadPos;           // free running, writer thread only
+    volatile int32_t    mWritePos;          // free running, audio thread only
+    volatile int32_t    mSplitPos;          // where the current file ends
+    volatile int32_t    mSplitPending;
+    uint32_t            mDataBytes;         // written to the current file
+    uint32_t            mQueuedBlocks;
+    volatile int32_t    mDroppedBlocks;
+    sem_t               mWakeSem;
+    bool                mSemValid;
+    sp<AudioDumpWriter> mSelf;              // set by stop(), cleared when done
+};
+
 class AudioStreamOutDump : public AudioStreamOut {
 public:
                         AudioStreamOutDump(AudioDumpInterface *interface,
@@ -54,6 +130,7 @@ public:
     virtual String8     getParameters(const String8& keys);
     virtual status_t    dump(int fd, const Vector<String16>& args);
     void                Close(void);
+    void                startWriter();
     AudioStreamOut*     finalStream() { return mFinalStream; }
     uint32_t            device() { return mDevice; }
     int                 getId()  { return mId; }
@@ -69,8 +146,13 @@ private:
     uint32_t mDevice;                   // current device this output is routed to
     size_t  mBufferSize;
     AudioStreamOut      *mFinalStream;
-    FILE                *mFile;      // output file
-    int                 mFileCount;
+            void        takeWriter();
+
+    sp<AudioDumpWriter> mWriter;     // output file, audio thread only
+    sp<AudioDumpWriter> mNextWriter; // started off the audio thread, taken by write()
+    Mutex               mWriterLock; // guards mNextWriter
+    volatile int32_t    mWriterChanged;
+    bool                mActive;     // written to since the last standby
 };
 
 class AudioStreamInDump : public AudioStreamIn {
@@ -97,6 +179,7 @@ public:
     virtual unsigned int  getInputFramesLost() const;
     virtual status_t    dump(int fd, const Vector<String16>& args);
     void                Close(void);
+    void                startWriter();
     AudioStreamIn*     finalStream() { return mFinalStream; }
     uint32_t            device() { return mDevice; }
 
@@ -109,8 +192,13 @@ private:
     uint32_t mDevice;                   // current device this output is routed to
     size_t  mBufferSize;
     AudioStreamIn      *mFinalStream;
-    FILE                *mFile;      // output file
-    int                 mFileCount;
+    FILE                *mFile;      // input file when there is no final stream
+            void        takeWriter();
+
+    sp<AudioDumpWriter> mWriter;     // output file, audio thread only
+    sp<AudioDumpWriter> mNextWriter; // started off the audio thread, taken by read()
+    Mutex               mWriterLock; // guards mNextWriter
+    volatile int32_t    mWriterChanged;
 };
 
 class AudioDumpInterface : public AudioHardwareBase
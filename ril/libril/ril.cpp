@@ -26,6 +26,7 @@
 #include <cutils/record_stream.h>
 #include <utils/Log.h>
 #include <utils/SystemClock.h>
+#include <utils/Timers.h>
 #include <pthread.h>
 #include <binder/Parcel.h>
 #include <cutils/jstring.h>
@@ -45,6 +46,7 @@
 #include <ctype.h>
 #include <alloca.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <assert.h>
 #include <netinet/in.h>
 #include <cutils/properties.h>
@@ -63,6 +65,9 @@ namespace android {
 
 #define PROPERTY_RIL_IMPL "gsm.version.ril-impl"
 
+// set to 1 to batch unsolicited responses into one socket write per event loop pass
+#define PROPERTY_RIL_COALESCE_UNSOL "ril.coalesce_unsol"
+
 // match with constant in RIL.java
 #define MAX_COMMAND_BYTES (8 * 1024)
 
@@ -75,6 +80,18 @@ namespace android {
 
 #define MIN(a,b) ((a)<(b) ? (a) : (b))
 
+// Response parcels kept per thread are dropped once they grow beyond this
+#define MAX_CACHED_PARCEL_BYTES (2 * MAX_COMMAND_BYTES)
+
+// Room for framed unsolicited responses waiting for the next event loop pass
+#define UNSOL_BATCH_BYTES (4 * MAX_COMMAND_BYTES)
+
+// Number of RequestInfo slots; requests beyond this many in flight are failed
+#define MAX_PENDING_REQUESTS 256
+
+// Upper bounds (ms) of the request latency histogram buckets, plus one overflow bucket
+#define NUM_LATENCY_BUCKETS 15
+
 /* Constants for response types */
 #define RESPONSE_SOLICITED 0
 #define RESPONSE_UNSOLICITED 1
@@ -130,11 +147,20 @@ typedef struct {
 typedef struct RequestInfo {
     int32_t token;      //this is not RIL_Token
     CommandInfo *pCI;
-    struct RequestInfo *p_next;
+    struct RequestInfo *p_next;     // free list link while the slot is unused
     char cancelled;
     char local;         // responses to local commands do not go back to command process
+    char pending;       // slot handed to the vendor RIL and not completed yet
+    nsecs_t startTime;
 } RequestInfo;
 
+typedef struct {
+    uint32_t count;
+    uint32_t buckets[NUM_LATENCY_BUCKETS];
+    nsecs_t total;
+    nsecs_t max;
+} RequestLatencyStats;
+
 typedef struct UserCallbackInfo {
     RIL_TimedCallback p_callback;
     void *userParam;
@@ -176,10 +202,28 @@ static pthread_cond_t s_startupCond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t s_dispatchMutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t s_dispatchCond = PTHREAD_COND_INITIALIZER;
 
-static RequestInfo *s_pendingRequests = NULL;
+/*
+ * RequestInfo slots, guarded by s_pendingRequestsMutex. The RIL_Token handed
+ * to the vendor RIL is a pointer into s_requestSlots, so checking a token on
+ * completion is a range check plus the pending flag.
+ */
+static RequestInfo s_requestSlots[MAX_PENDING_REQUESTS];
+static RequestInfo *s_freeRequests = NULL;
+static int s_requestSlotsUsed = 0;
+
+static const uint32_t s_latencyBucketMs[NUM_LATENCY_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 30000
+};
+static RequestLatencyStats s_requestLatency;
+
+static pthread_key_t s_responseParcelKey;
+static pthread_once_t s_responseParcelOnce = PTHREAD_ONCE_INIT;
 
-static RequestInfo *s_toDispatchHead = NULL;
-static RequestInfo *s_toDispatchTail = NULL;
+/* Framed unsolicited responses not written yet, guarded by s_writeMutex */
+static int s_coalesceUnsol = 0;
+static uint8_t s_unsolBatch[UNSOL_BATCH_BYTES];
+static size_t s_unsolBatchLen = 0;
+static bool s_unsolFlushScheduled = false;
 
 static UserCallbackInfo *s_last_wake_timeout_info = NULL;
 
@@ -208,6 +252,8 @@ static void dispatchCdmaSmsAck(Parcel &p, RequestInfo *pRI);
 static void dispatchGsmBrSmsCnf(Parcel &p, RequestInfo *pRI);
 static void dispatchCdmaBrSmsCnf(Parcel &p, RequestInfo *pRI);
 static void dispatchRilCdmaSmsWriteArgs(Parcel &p, RequestInfo *pRI);
+static int sendResponse (Parcel &p);
+static void formatRequestStats(char *buf, size_t len);
 static int responseInts(Parcel &p, void *response, size_t responselen);
 static int responseStrings(Parcel &p, void *response, size_t responselen);
 static int responseString(Parcel &p, void *response, size_t responselen);
@@ -287,6 +333,38 @@ void   nullParcelReleaseFunction (const uint8_t* data, size_t dataSize,
     // do nothing -- the data reference lives longer than the Parcel object
 }
 
+/**
+ * Take a free RequestInfo slot and mark it pending.
+ * Returns NULL if MAX_PENDING_REQUESTS requests are already in flight.
+ */
+static RequestInfo *
+allocRequestInfo(int request) {
+    RequestInfo *pRI;
+    int ret;
+
+    ret = pthread_mutex_lock(&s_pendingRequestsMutex);
+    assert (ret == 0);
+
+    pRI = s_freeRequests;
+    if (pRI != NULL) {
+        s_freeRequests = pRI->p_next;
+    } else if (s_requestSlotsUsed < MAX_PENDING_REQUESTS) {
+        pRI = &s_requestSlots[s_requestSlotsUsed++];
+    }
+
+    if (pRI != NULL) {
+        memset(pRI, 0, sizeof(RequestInfo));
+        pRI->pCI = &(s_commands[request]);
+        pRI->pending = 1;
+        pRI->startTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    }
+
+    ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
+    assert (ret == 0);
+
+    return pRI;
+}
+
 /**
  * To be called from dispatch thread
  * Issue a single local request, ensuring that the response
@@ -295,22 +373,15 @@ void   nullParcelReleaseFunction (const uint8_t* data, size_t dataSize,
 static void
 issueLocalRequest(int request, void *data, int len) {
     RequestInfo *pRI;
-    int ret;
 
-    pRI = (RequestInfo *)calloc(1, sizeof(RequestInfo));
+    pRI = allocRequestInfo(request);
+    if (pRI == NULL) {
+        LOGE("C[locl]> %s dropped: too many pending requests", requestToString(request));
+        return;
+    }
 
     pRI->local = 1;
     pRI->token = 0xffffffff;        // token is not used in this context
-    pRI->pCI = &(s_commands[request]);
-
-    ret = pthread_mutex_lock(&s_pendingRequestsMutex);
-    assert (ret == 0);
-
-    pRI->p_next = s_pendingRequests;
-    s_pendingRequests = pRI;
-
-    ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
-    assert (ret == 0);
 
     LOGD("C[locl]> %s", requestToString(request));
 
@@ -326,7 +397,6 @@ processCommandBuffer(void *buffer, size_t buflen) {
     int32_t request;
     int32_t token;
     RequestInfo *pRI;
-    int ret;
 
     p.setData((uint8_t *) buffer, buflen);
 
@@ -346,19 +416,20 @@ processCommandBuffer(void *buffer, size_t buflen) {
     }
 
 
-    pRI = (RequestInfo *)calloc(1, sizeof(RequestInfo));
+    pRI = allocRequestInfo(request);
+    if (pRI == NULL) {
+        Parcel err;
+
+        LOGE("too many pending requests, failing %s token %d",
+                requestToString(request), token);
+        err.writeInt32 (RESPONSE_SOLICITED);
+        err.writeInt32 (token);
+        err.writeInt32 (RIL_E_GENERIC_FAILURE);
+        sendResponse(err);
+        return 0;
+    }
 
     pRI->token = token;
-    pRI->pCI = &(s_commands[request]);
-
-    ret = pthread_mutex_lock(&s_pendingRequestsMutex);
-    assert (ret == 0);
-
-    pRI->p_next = s_pendingRequests;
-    s_pendingRequests = pRI;
-
-    ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
-    assert (ret == 0);
 
 /*    sLastDispatchedToken = token; */
 
@@ -1220,36 +1291,75 @@ static void dispatchDataCall(Parcel& p, RequestInfo *pRI) {
 }
 
 static int
-blockingWrite(int fd, const void *buffer, size_t len) {
-    size_t writeOffset = 0;
-    const uint8_t *toWrite;
-
-    toWrite = (const uint8_t *)buffer;
-
-    while (writeOffset < len) {
+blockingWritev(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
         ssize_t written;
         do {
-            written = write (fd, toWrite + writeOffset,
-                                len - writeOffset);
+            written = writev (fd, iov, iovcnt);
         } while (written < 0 && errno == EINTR);
 
-        if (written >= 0) {
-            writeOffset += written;
-        } else {   // written < 0
+        if (written < 0) {
             LOGE ("RIL Response: unexpected error on write errno:%d", errno);
             close(fd);
             return -1;
         }
+
+        // skip what went out, then resume a partially written entry
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
     }
 
     return 0;
 }
 
+/*
+ * Write a response and anything still waiting in the unsolicited batch,
+ * batch first so responses reach the socket in the order they were issued.
+ * Must be called with s_writeMutex held.
+ */
+static int
+writeResponseLocked(int fd, const void *data, size_t dataSize) {
+    struct iovec iov[3];
+    int iovcnt = 0;
+    uint32_t header;
+    int ret;
+
+    if (s_unsolBatchLen > 0) {
+        iov[iovcnt].iov_base = s_unsolBatch;
+        iov[iovcnt].iov_len = s_unsolBatchLen;
+        iovcnt++;
+    }
+
+    if (data != NULL) {
+        header = htonl(dataSize);
+        iov[iovcnt].iov_base = &header;
+        iov[iovcnt].iov_len = sizeof(header);
+        iovcnt++;
+        iov[iovcnt].iov_base = (void *)data;
+        iov[iovcnt].iov_len = dataSize;
+        iovcnt++;
+    }
+
+    if (iovcnt == 0) {
+        return 0;
+    }
+
+    ret = blockingWritev(fd, iov, iovcnt);
+    s_unsolBatchLen = 0;
+    return ret;
+}
+
 static int
 sendResponseRaw (const void *data, size_t dataSize) {
     int fd = s_fdCommand;
     int ret;
-    uint32_t header;
 
     if (s_fdCommand < 0) {
         return -1;
@@ -1264,25 +1374,44 @@ sendResponseRaw (const void *data, size_t dataSize) {
 
     pthread_mutex_lock(&s_writeMutex);
 
-    header = htonl(dataSize);
+    ret = writeResponseLocked(fd, data, dataSize);
 
-    ret = blockingWrite(fd, (void *)&header, sizeof(header));
+    pthread_mutex_unlock(&s_writeMutex);
 
-    if (ret < 0) {
-        pthread_mutex_unlock(&s_writeMutex);
-        return ret;
-    }
+    return ret;
+}
+
+static void
+freeResponseParcel(void *parcel) {
+    delete (Parcel *)parcel;
+}
 
-    ret = blockingWrite(fd, data, dataSize);
+static void
+createResponseParcelKey() {
+    pthread_key_create(&s_responseParcelKey, freeResponseParcel);
+}
 
-    if (ret < 0) {
-        pthread_mutex_unlock(&s_writeMutex);
-        return ret;
-    }
+/**
+ * Returns this thread's response parcel, emptied but keeping its buffer,
+ * so marshalling a response does not reallocate on every call.
+ */
+static Parcel &
+obtainResponseParcel() {
+    Parcel *p;
 
-    pthread_mutex_unlock(&s_writeMutex);
+    pthread_once(&s_responseParcelOnce, createResponseParcelKey);
 
-    return 0;
+    p = (Parcel *)pthread_getspecific(s_responseParcelKey);
+    if (p == NULL) {
+        p = new Parcel();
+        pthread_setspecific(s_responseParcelKey, p);
+    } else if (p->dataCapacity() > MAX_CACHED_PARCEL_BYTES) {
+        p->freeData();
+    }
+
+    p->setDataSize(0);
+    p->setDataPosition(0);
+    return *p;
 }
 
 static int
@@ -2247,17 +2376,22 @@ static void onCommandsSocketClosed() {
     ret = pthread_mutex_lock(&s_pendingRequestsMutex);
     assert (ret == 0);
 
-    p_cur = s_pendingRequests;
-
-    for (p_cur = s_pendingRequests
-            ; p_cur != NULL
-            ; p_cur  = p_cur->p_next
+    for (p_cur = s_requestSlots
+            ; p_cur < s_requestSlots + s_requestSlotsUsed
+            ; p_cur++
     ) {
-        p_cur->cancelled = 1;
+        if (p_cur->pending) {
+            p_cur->cancelled = 1;
+        }
     }
 
     ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
     assert (ret == 0);
+
+    /* unsolicited responses still batched were meant for the old client */
+    pthread_mutex_lock(&s_writeMutex);
+    s_unsolBatchLen = 0;
+    pthread_mutex_unlock(&s_writeMutex);
 }
 
 static void processCommandsCallback(int fd, short flags, void *param) {
@@ -2549,6 +2683,13 @@ static void debugCallback (int fd, short flags, void *param) {
             issueLocalRequest(RIL_REQUEST_HANGUP, &hangupData,
                               sizeof(hangupData));
             break;
+        case 11: {
+            char stats[256];
+            formatRequestStats(stats, sizeof(stats));
+            LOGI("Debug port: %s", stats);
+            send(acceptFD, stats, strlen(stats), 0);
+            break;
+        }
         default:
             LOGE ("Invalid request");
             break;
@@ -2666,6 +2807,12 @@ RIL_register (const RIL_RadioFunctions *callbacks) {
     }
     LOGE("RIL_register: RIL version %d", callbacks->version);
 
+    {
+        char coalesce[PROPERTY_VALUE_MAX];
+        property_get(PROPERTY_RIL_COALESCE_UNSOL, coalesce, "0");
+        s_coalesceUnsol = (atoi(coalesce) == 1);
+    }
+
     if (s_registerCalled > 0) {
         LOGE("RIL_register has been called more than once. "
                 "Subsequent call ignored");
@@ -2754,6 +2901,69 @@ RIL_register (const RIL_RadioFunctions *callbacks) {
 
 }
 
+/* Must be called with s_pendingRequestsMutex held */
+static void
+recordRequestLatency(nsecs_t latency) {
+    uint32_t ms = (uint32_t)(latency / 1000000);
+    int bucket = 0;
+
+    while (bucket < NUM_LATENCY_BUCKETS - 1 && ms > s_latencyBucketMs[bucket]) {
+        bucket++;
+    }
+
+    s_requestLatency.count++;
+    s_requestLatency.buckets[bucket]++;
+    s_requestLatency.total += latency;
+    if (latency > s_requestLatency.max) {
+        s_requestLatency.max = latency;
+    }
+}
+
+/* Upper bound in ms of the bucket holding the given percentile, 0 for the overflow bucket */
+static uint32_t
+latencyPercentile(const RequestLatencyStats *stats, uint32_t percent) {
+    uint32_t target = (stats->count * percent + 99) / 100;
+    uint32_t seen = 0;
+
+    for (int i = 0; i < NUM_LATENCY_BUCKETS - 1; i++) {
+        seen += stats->buckets[i];
+        if (seen >= target) {
+            return s_latencyBucketMs[i];
+        }
+    }
+    return 0;
+}
+
+static void
+formatRequestStats(char *buf, size_t len) {
+    RequestLatencyStats stats;
+    int pending = 0;
+
+    pthread_mutex_lock(&s_pendingRequestsMutex);
+    stats = s_requestLatency;
+    for (int i = 0; i < s_requestSlotsUsed; i++) {
+        pending += s_requestSlots[i].pending;
+    }
+    pthread_mutex_unlock(&s_pendingRequestsMutex);
+
+    if (stats.count == 0) {
+        snprintf(buf, len, "requests: 0 completed, %d pending\n", pending);
+        return;
+    }
+
+    uint32_t p50 = latencyPercentile(&stats, 50);
+    uint32_t p90 = latencyPercentile(&stats, 90);
+    uint32_t p99 = latencyPercentile(&stats, 99);
+
+    // percentiles are bucket upper bounds, "-1" means beyond the last bucket
+    snprintf(buf, len, "requests: %u completed, %d pending, latency ms: "
+            "p50<=%d p90<=%d p99<=%d mean=%lld max=%lld\n",
+            stats.count, pending,
+            p50 ? (int)p50 : -1, p90 ? (int)p90 : -1, p99 ? (int)p99 : -1,
+            (long long)(stats.total / stats.count / 1000000),
+            (long long)(stats.max / 1000000));
+}
+
 static int
 checkAndDequeueRequestInfo(struct RequestInfo *pRI) {
     int ret = 0;
@@ -2764,16 +2974,13 @@ checkAndDequeueRequestInfo(struct RequestInfo *pRI) {
 
     pthread_mutex_lock(&s_pendingRequestsMutex);
 
-    for(RequestInfo **ppCur = &s_pendingRequests
-        ; *ppCur != NULL
-        ; ppCur = &((*ppCur)->p_next)
-    ) {
-        if (pRI == *ppCur) {
-            ret = 1;
-
-            *ppCur = (*ppCur)->p_next;
-            break;
-        }
+    // a token is valid only if it points at a slot that is still pending
+    if (pRI >= s_requestSlots && pRI < s_requestSlots + s_requestSlotsUsed
+            && ((char *)pRI - (char *)s_requestSlots) % sizeof(RequestInfo) == 0
+            && pRI->pending) {
+        ret = 1;
+        pRI->pending = 0;
+        recordRequestLatency(systemTime(SYSTEM_TIME_MONOTONIC) - pRI->startTime);
     }
 
     pthread_mutex_unlock(&s_pendingRequestsMutex);
@@ -2781,6 +2988,16 @@ checkAndDequeueRequestInfo(struct RequestInfo *pRI) {
     return ret;
 }
 
+static void
+freeRequestInfo(RequestInfo *pRI) {
+    pthread_mutex_lock(&s_pendingRequestsMutex);
+
+    pRI->p_next = s_freeRequests;
+    s_freeRequests = pRI;
+
+    pthread_mutex_unlock(&s_pendingRequestsMutex);
+}
+
 
 extern "C" void
 RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void *response, size_t responselen) {
@@ -2807,7 +3024,7 @@ RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void *response, size_t responsel
         pRI->token, requestToString(pRI->pCI->requestNumber));
 
     if (pRI->cancelled == 0) {
-        Parcel p;
+        Parcel &p = obtainResponseParcel();
 
         p.writeInt32 (RESPONSE_SOLICITED);
         p.writeInt32 (pRI->token);
@@ -2837,7 +3054,7 @@ RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void *response, size_t responsel
     }
 
 done:
-    free(pRI);
+    freeRequestInfo(pRI);
 }
 
 
@@ -2866,6 +3083,66 @@ wakeTimeoutCallback (void *param) {
     }
 }
 
+static void
+flushUnsolCallback(void *param) {
+    pthread_mutex_lock(&s_writeMutex);
+
+    s_unsolFlushScheduled = false;
+    if (s_fdCommand >= 0) {
+        writeResponseLocked(s_fdCommand, NULL, 0);
+    }
+    s_unsolBatchLen = 0;
+
+    pthread_mutex_unlock(&s_writeMutex);
+}
+
+/**
+ * Append a framed unsolicited response to the batch. Everything queued
+ * before the event loop runs flushUnsolCallback goes out in one write.
+ */
+static int
+queueUnsolResponse(Parcel &p) {
+    size_t dataSize = p.dataSize();
+    uint32_t header;
+    bool schedule;
+    int ret = 0;
+
+    printResponse;
+
+    if (s_fdCommand < 0) {
+        return -1;
+    }
+
+    if (dataSize > MAX_COMMAND_BYTES) {
+        LOGE("RIL: packet larger than %u (%u)",
+                MAX_COMMAND_BYTES, (unsigned int )dataSize);
+
+        return -1;
+    }
+
+    pthread_mutex_lock(&s_writeMutex);
+
+    if (s_unsolBatchLen + sizeof(header) + dataSize > sizeof(s_unsolBatch)) {
+        ret = writeResponseLocked(s_fdCommand, NULL, 0);
+    }
+
+    header = htonl(dataSize);
+    memcpy(s_unsolBatch + s_unsolBatchLen, &header, sizeof(header));
+    memcpy(s_unsolBatch + s_unsolBatchLen + sizeof(header), p.data(), dataSize);
+    s_unsolBatchLen += sizeof(header) + dataSize;
+
+    schedule = !s_unsolFlushScheduled;
+    s_unsolFlushScheduled = true;
+
+    pthread_mutex_unlock(&s_writeMutex);
+
+    if (schedule) {
+        internalRequestTimedCallback(flushUnsolCallback, NULL, NULL);
+    }
+
+    return ret;
+}
+
 extern "C"
 void RIL_onUnsolicitedResponse(int unsolResponse, void *data,
                                 size_t datalen)
@@ -2915,7 +3192,7 @@ void RIL_onUnsolicitedResponse(int unsolResponse, void *data,
 
     appendPrintBuf("[UNSL]< %s", requestToString(unsolResponse));
 
-    Parcel p;
+    Parcel &p = obtainResponseParcel();
 
     p.writeInt32 (RESPONSE_UNSOLICITED);
     p.writeInt32 (unsolResponse);
@@ -2946,7 +3223,12 @@ void RIL_onUnsolicitedResponse(int unsolResponse, void *data,
         break;
     }
 
-    ret = sendResponse(p);
+    // NITZ is kept for a later client if the write fails, so it is never deferred
+    if (s_coalesceUnsol && unsolResponse != RIL_UNSOL_NITZ_TIME_RECEIVED) {
+        ret = queueUnsolResponse(p);
+    } else {
+        ret = sendResponse(p);
+    }
     if (ret != 0 && unsolResponse == RIL_UNSOL_NITZ_TIME_RECEIVED) {
 
         // Unfortunately, NITZ time is not poll/update like everything
@@ -25,6 +25,7 @@
 #include <ril_event.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <time.h>
 
 #include <pthread.h>
@@ -65,11 +66,19 @@ static pthread_mutex_t listMutex;
     } while(0);
 #endif
 
-static fd_set readFds;
-static int nfds = 0;
+// Initial size of the epoll result buffer and the timer heap; both grow on demand
+#define INITIAL_EPOLL_EVENTS 8
+#define INITIAL_TIMER_HEAP 16
 
-static struct ril_event * watch_table[MAX_FD_EVENTS];
-static struct ril_event timer_list;
+static int epollFd = -1;
+static struct epoll_event * epollEvents = NULL;
+static int epollEventsSize = 0;
+static int watchCount = 0;
+
+// Binary min-heap of timers ordered by expiry; ev->index holds the heap slot
+static struct ril_event ** timer_heap = NULL;
+static int timerCount = 0;
+static int timerHeapSize = 0;
 static struct ril_event pending_list;
 
 #define DEBUG 0
@@ -134,25 +143,72 @@ static void removeFromList(struct ril_event * ev)
 }
 
 
-static void removeWatch(struct ril_event * ev, int index)
+static void removeWatch(struct ril_event * ev)
 {
-    watch_table[index] = NULL;
     ev->index = -1;
+    watchCount--;
+
+    // the fd may already be closed, which drops it from the epoll set anyway
+    if (epoll_ctl(epollFd, EPOLL_CTL_DEL, ev->fd, NULL) < 0 && errno != EBADF && errno != ENOENT) {
+        LOGE("ril_event: epoll_ctl(DEL, %d) error (%d)", ev->fd, errno);
+    }
+}
 
-    FD_CLR(ev->fd, &readFds);
+static void swapTimers(int a, int b)
+{
+    struct ril_event * tmp = timer_heap[a];
+    timer_heap[a] = timer_heap[b];
+    timer_heap[b] = tmp;
+    timer_heap[a]->index = a;
+    timer_heap[b]->index = b;
+}
 
-    if (ev->fd+1 == nfds) {
-        int n = 0;
+static void siftUp(int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!timercmp(&timer_heap[i]->timeout, &timer_heap[parent]->timeout, <)) {
+            break;
+        }
+        swapTimers(i, parent);
+        i = parent;
+    }
+}
 
-        for (int i = 0; i < MAX_FD_EVENTS; i++) {
-            struct ril_event * rev = watch_table[i];
+static void siftDown(int i)
+{
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
 
-            if ((rev != NULL) && (rev->fd > n)) {
-                n = rev->fd;
-            }
+        if (left < timerCount
+                && timercmp(&timer_heap[left]->timeout, &timer_heap[smallest]->timeout, <)) {
+            smallest = left;
+        }
+        if (right < timerCount
+                && timercmp(&timer_heap[right]->timeout, &timer_heap[smallest]->timeout, <)) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
         }
-        nfds = n + 1;
-        dlog("~~~~ nfds = %d ~~~~", nfds);
+        swapTimers(i, smallest);
+        i = smallest;
+    }
+}
+
+static void removeTimer(struct ril_event * ev)
+{
+    int i = ev->index;
+
+    ev->index = -1;
+    timerCount--;
+    if (i != timerCount) {
+        timer_heap[i] = timer_heap[timerCount];
+        timer_heap[i]->index = i;
+        siftDown(i);
+        siftUp(i);
     }
 }
 
@@ -161,38 +217,36 @@ static void processTimeouts()
     dlog("~~~~ +processTimeouts ~~~~");
     MUTEX_ACQUIRE();
     struct timeval now;
-    struct ril_event * tev = timer_list.next;
-    struct ril_event * next;
 
     getNow(&now);
-    // walk list, see if now >= ev->timeout for any events
+    // pop every timer with now > ev->timeout
 
     dlog("~~~~ Looking for timers <= %ds + %dus ~~~~", (int)now.tv_sec, (int)now.tv_usec);
-    while ((tev != &timer_list) && (timercmp(&now, &tev->timeout, >))) {
+    while (timerCount > 0 && timercmp(&now, &timer_heap[0]->timeout, >)) {
         // Timer expired
         dlog("~~~~ firing timer ~~~~");
-        next = tev->next;
-        removeFromList(tev);
+        struct ril_event * tev = timer_heap[0];
+        removeTimer(tev);
         addToList(tev, &pending_list);
-        tev = next;
     }
     MUTEX_RELEASE();
     dlog("~~~~ -processTimeouts ~~~~");
 }
 
-static void processReadReadies(fd_set * rfds, int n)
+static void processReadReadies(struct epoll_event * events, int n)
 {
     dlog("~~~~ +processReadReadies (%d) ~~~~", n);
     MUTEX_ACQUIRE();
 
-    for (int i = 0; (i < MAX_FD_EVENTS) && (n > 0); i++) {
-        struct ril_event * rev = watch_table[i];
-        if (rev != NULL && FD_ISSET(rev->fd, rfds)) {
-            addToList(rev, &pending_list);
-            if (rev->persist == false) {
-                removeWatch(rev, i);
-            }
-            n--;
+    for (int i = 0; i < n; i++) {
+        struct ril_event * rev = (struct ril_event *) events[i].data.ptr;
+        // another thread may have removed the watch after epoll_wait returned
+        if (rev->index < 0) {
+            continue;
+        }
+        addToList(rev, &pending_list);
+        if (rev->persist == false) {
+            removeWatch(rev);
         }
     }
 
@@ -213,29 +267,37 @@ static void firePending()
     dlog("~~~~ -firePending ~~~~");
 }
 
-static int calcNextTimeout(struct timeval * tv)
+// Returns the epoll_wait() timeout in ms, -1 if there are no timers
+static int calcNextTimeout()
 {
-    struct ril_event * tev = timer_list.next;
     struct timeval now;
+    struct timeval tv;
 
-    getNow(&now);
+    MUTEX_ACQUIRE();
 
-    // Sorted list, so calc based on first node
-    if (tev == &timer_list) {
+    if (timerCount == 0) {
         // no pending timers
+        MUTEX_RELEASE();
         return -1;
     }
 
+    getNow(&now);
+
+    // Heap, so the first node expires soonest
+    struct ril_event * tev = timer_heap[0];
     dlog("~~~~ now = %ds + %dus ~~~~", (int)now.tv_sec, (int)now.tv_usec);
     dlog("~~~~ next = %ds + %dus ~~~~",
             (int)tev->timeout.tv_sec, (int)tev->timeout.tv_usec);
     if (timercmp(&tev->timeout, &now, >)) {
-        timersub(&tev->timeout, &now, tv);
+        timersub(&tev->timeout, &now, &tv);
     } else {
         // timer already expired.
-        tv->tv_sec = tv->tv_usec = 0;
+        tv.tv_sec = tv.tv_usec = 0;
     }
-    return 0;
+    MUTEX_RELEASE();
+
+    // round up so we never wake before the timer is due
+    return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
 }
 
 // Initialize internal data structs
@@ -243,10 +305,21 @@ void ril_event_init()
 {
     MUTEX_INIT();
 
-    FD_ZERO(&readFds);
-    init_list(&timer_list);
     init_list(&pending_list);
-    memset(watch_table, 0, sizeof(watch_table));
+
+    epollFd = epoll_create(INITIAL_EPOLL_EVENTS);
+    if (epollFd < 0) {
+        LOGE("ril_event: epoll_create error (%d)", errno);
+    }
+    fcntl(epollFd, F_SETFD, FD_CLOEXEC);
+
+    epollEventsSize = INITIAL_EPOLL_EVENTS;
+    epollEvents = (struct epoll_event *) malloc(epollEventsSize * sizeof(struct epoll_event));
+    watchCount = 0;
+
+    timerHeapSize = INITIAL_TIMER_HEAP;
+    timer_heap = (struct ril_event **) malloc(timerHeapSize * sizeof(struct ril_event *));
+    timerCount = 0;
 }
 
 // Initialize an event
@@ -267,18 +340,22 @@ void ril_event_add(struct ril_event * ev)
 {
     dlog("~~~~ +ril_event_add ~~~~");
     MUTEX_ACQUIRE();
-    for (int i = 0; i < MAX_FD_EVENTS; i++) {
-        if (watch_table[i] == NULL) {
-            watch_table[i] = ev;
-            ev->index = i;
-            dlog("~~~~ added at %d ~~~~", i);
-            dump_event(ev);
-            FD_SET(ev->fd, &readFds);
-            if (ev->fd >= nfds) nfds = ev->fd+1;
-            dlog("~~~~ nfds = %d ~~~~", nfds);
-            break;
-        }
+
+    struct epoll_event eev;
+    memset(&eev, 0, sizeof(eev));
+    eev.events = EPOLLIN;
+    eev.data.ptr = ev;
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, ev->fd, &eev) < 0) {
+        LOGE("ril_event: epoll_ctl(ADD, %d) error (%d)", ev->fd, errno);
+    } else {
+        // index only marks the event as watched; epoll keeps the fd itself
+        ev->index = 0;
+        watchCount++;
+        dlog("~~~~ added fd %d, %d watched ~~~~", ev->fd, watchCount);
+        dump_event(ev);
     }
+
     MUTEX_RELEASE();
     dlog("~~~~ -ril_event_add ~~~~");
 }
@@ -289,23 +366,30 @@ void ril_timer_add(struct ril_event * ev, struct timeval * tv)
     dlog("~~~~ +ril_timer_add ~~~~");
     MUTEX_ACQUIRE();
 
-    struct ril_event * list;
     if (tv != NULL) {
-        // add to timer list
-        list = timer_list.next;
+        // add to timer heap
         ev->fd = -1; // make sure fd is invalid
 
         struct timeval now;
         getNow(&now);
         timeradd(&now, tv, &ev->timeout);
 
-        // keep list sorted
-        while (timercmp(&list->timeout, &ev->timeout, < )
-                && (list != &timer_list)) {
-            list = list->next;
+        if (timerCount == timerHeapSize) {
+            struct ril_event ** heap = (struct ril_event **)
+                    realloc(timer_heap, 2 * timerHeapSize * sizeof(struct ril_event *));
+            if (heap == NULL) {
+                LOGE("ril_event: out of memory growing timer heap");
+                MUTEX_RELEASE();
+                return;
+            }
+            timer_heap = heap;
+            timerHeapSize *= 2;
         }
-        // list now points to the first event older than ev
-        addToList(ev, list);
+
+        timer_heap[timerCount] = ev;
+        ev->index = timerCount;
+        timerCount++;
+        siftUp(ev->index);
     }
 
     MUTEX_RELEASE();
@@ -318,59 +402,55 @@ void ril_event_del(struct ril_event * ev)
     dlog("~~~~ +ril_event_del ~~~~");
     MUTEX_ACQUIRE();
 
-    if (ev->index < 0 || ev->index >= MAX_FD_EVENTS) {
+    if (ev->index < 0) {
         MUTEX_RELEASE();
         return;
     }
 
-    removeWatch(ev, ev->index);
+    if (ev->fd < 0) {
+        if (ev->index < timerCount && timer_heap[ev->index] == ev) {
+            removeTimer(ev);
+        }
+    } else {
+        removeWatch(ev);
+    }
 
     MUTEX_RELEASE();
     dlog("~~~~ -ril_event_del ~~~~");
 }
 
-#if DEBUG
-static void printReadies(fd_set * rfds)
-{
-    for (int i = 0; (i < MAX_FD_EVENTS); i++) {
-        struct ril_event * rev = watch_table[i];
-        if (rev != NULL && FD_ISSET(rev->fd, rfds)) {
-          dlog("DON: fd=%d is ready", rev->fd);
-        }
-    }
-}
-#else
-#define printReadies(rfds) do {} while(0)
-#endif
-
 void ril_event_loop()
 {
     int n;
-    fd_set rfds;
-    struct timeval tv;
-    struct timeval * ptv;
-
+    int timeout;
 
     for (;;) {
 
-        // make local copy of read fd_set
-        memcpy(&rfds, &readFds, sizeof(fd_set));
-        if (-1 == calcNextTimeout(&tv)) {
+        if (-1 == (timeout = calcNextTimeout())) {
             // no pending timers; block indefinitely
             dlog("~~~~ no timers; blocking indefinitely ~~~~");
-            ptv = NULL;
         } else {
-            dlog("~~~~ blocking for %ds + %dus ~~~~", (int)tv.tv_sec, (int)tv.tv_usec);
-            ptv = &tv;
+            dlog("~~~~ blocking for %dms ~~~~", timeout);
         }
-        printReadies(&rfds);
-        n = select(nfds, &rfds, NULL, NULL, ptv);
-        printReadies(&rfds);
+
+        // make room for every watched fd to be ready at once
+        MUTEX_ACQUIRE();
+        if (watchCount > epollEventsSize) {
+            struct epoll_event * events = (struct epoll_event *)
+                    realloc(epollEvents, watchCount * sizeof(struct epoll_event));
+            if (events != NULL) {
+                epollEvents = events;
+                epollEventsSize = watchCount;
+            }
+        }
+        MUTEX_RELEASE();
+
+        n = epoll_wait(epollFd, epollEvents, epollEventsSize, timeout);
         dlog("~~~~ %d events fired ~~~~", n);
         if (n < 0) {
             if (errno == EINTR) continue;
 
-            LOGE("ril_event: select error (%d)", errno);
+            LOGE("ril_event: epoll_wait error (%d)", errno);
             // bail?
             return;
         }
@@ -378,7 +458,7 @@ void ril_event_loop()
         // Check for timeouts
         processTimeouts();
         // Check for read-ready
-        processReadReadies(&rfds, n);
+        processReadReadies(epollEvents, n);
         // Fire away
         firePending();
     }
@@ -15,9 +15,6 @@
 ** limitations under the License.
 */
 
-// Max number of fd's we watch at any one time.  Increase if necessary.
-#define MAX_FD_EVENTS 8
-
 typedef void (*ril_event_cb)(int fd, short events, void *userdata);
 
 struct ril_event {
@@ -25,7 +22,7 @@ struct ril_event {
     struct ril_event *prev;
 
     int fd;
-    int index;
+    int index;      // timer heap slot for timers, >= 0 while an fd is watched
     bool persist;
     struct timeval timeout;
     ril_event_cb func;
@@ -24,6 +24,7 @@ LOCAL_SRC_FILES:= \
     $(src_cpp)/node_buffer.cpp \
     $(src_cpp)/node_util.cpp \
     $(src_cpp)/protobuf_v8.cpp \
+    $(src_cpp)/replay.cpp \
     $(src_cpp)/responses.cpp \
     $(src_cpp)/requests.cpp \
     $(src_cpp)/util.cpp \
@@ -27,6 +27,7 @@
 
 #include "logging.h"
 #include "node_buffer.h"
+#include "replay.h"
 #include "status.h"
 #include "util.h"
 #include "worker.h"
@@ -319,6 +320,57 @@ class CtrlServerThread : public WorkerThread {
         return status;
     }
 
+    /**
+     * Replay a trace natively and report the throughput and the
+     * request latency. Requests reach the JavaScript side through
+     * libril like the phone's do.
+     */
+    int replay(MsgHeader *mh, Buffer *buffer) {
+        DBG("replay E: token=%lld", mh->token());
+
+        ril_proto::CtrlReqReplay req;
+        ReplayResult result;
+        int status;
+
+        if ((buffer == NULL)
+                || !req.ParseFromArray(buffer->data(), buffer->length())) {
+            status = STATUS_BAD_DATA;
+        } else {
+            int rate = req.has_rate() ? req.rate() : REPLAY_RATE_UNLIMITED;
+            int repeat = req.has_repeat() ? req.repeat() : 1;
+
+            // Don't hold the lock while replaying so the js thread can run
+            v8::Unlocker unlocker;
+            status = replayTrace(req.trace_file().c_str(), rate, repeat, &result);
+        }
+
+        Buffer *rsp_buffer = NULL;
+        if (status == STATUS_OK) {
+            ril_proto::CtrlRspReplay rsp;
+            rsp.set_unsolicited(result.unsolicited);
+            rsp.set_elapsed_ms(result.elapsed_us / 1000);
+            rsp.set_msgs_per_sec(result.msgs_per_sec);
+            rsp.set_requests(result.requests);
+            rsp.set_responses(result.responses);
+            rsp.set_failed(result.failed);
+            rsp.set_latency_p50_us(result.latency_p50_us);
+            rsp.set_latency_p90_us(result.latency_p90_us);
+            rsp.set_latency_p99_us(result.latency_p99_us);
+            rsp.set_latency_max_us(result.latency_max_us);
+
+            rsp_buffer = ObtainBuffer(rsp.ByteSize());
+            rsp.SerializeToArray(rsp_buffer->data(), rsp_buffer->length());
+            mh->set_status(ril_proto::CTRL_STATUS_OK);
+        } else {
+            LOGE("replay Error: status=%d", status);
+            mh->set_status(ril_proto::CTRL_STATUS_ERR);
+        }
+
+        status = WriteMessage(mh, rsp_buffer);
+        DBG("replay X: status=%d", status);
+        return status;
+    }
+
     virtual void * Worker(void *param) {
         DBG("CtrlServerThread::Worker E param=%p stopper_fd_=%d",
                 param, stopper_fd_);
@@ -359,6 +411,10 @@ class CtrlServerThread : public WorkerThread {
                         LOGD("CtrlServerThread::Worker echo");
                         status = WriteMessage(&mh, buffer);
                         if (status != STATUS_OK) break;
+                    } else if (mh.cmd() == ril_proto::CTRL_CMD_REPLAY) {
+                        LOGD("CtrlServerThread::Worker replay");
+                        status = replay(&mh, buffer);
+                        if (status != STATUS_OK) break;
                     } else {
                         DBG("CtrlServerThread::Worker sendToCtrlServer");
                         status = sendToCtrlServer(&mh, buffer);
@@ -0,0 +1,569 @@
+/**
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/sockets.h>
+#include <v8.h>
+#include "ril.h"
+
+#include "js_support.h"
+#include "logging.h"
+#include "mock_ril.h"
+#include "status.h"
+
+#include "replay.h"
+
+//#define REPLAY_DEBUG
+#ifdef  REPLAY_DEBUG
+
+#define DBG(...) LOGD(__VA_ARGS__)
+
+#else
+
+#define DBG(...)
+
+#endif
+
+static int64_t nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleepUntilUs(int64_t deadline_us) {
+    int64_t delay_us = deadline_us - nowUs();
+    if (delay_us > 0) {
+        struct timespec ts;
+        ts.tv_sec = delay_us / 1000000;
+        ts.tv_nsec = (delay_us % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+/**
+ * A parsed record, data points into the trace buffer
+ */
+struct ReplayRecord {
+    int kind;
+    int id;
+    bool strings;           // data is a char **
+    uint32_t time_us;
+    void *data;
+    size_t datalen;
+};
+
+// Socket and parcel layout of libril, see libril/ril.cpp
+#define RILD_SOCKET_NAME        "rild"
+#define RESPONSE_SOLICITED      0
+
+static int writeFully(int fd, const void *data, size_t length) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int readFully(int fd, void *data, size_t length) {
+    uint8_t *p = (uint8_t *)data;
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Builds a request the way android.os.Parcel lays it out for libril:
+ * native endian int32s, strings as String16 padded to 4 bytes.
+ */
+class RequestParcel {
+  public:
+    void writeInt32(int32_t value) {
+        const uint8_t *p = (const uint8_t *)&value;
+        data_.insert(data_.end(), p, p + sizeof(value));
+    }
+
+    void writeString16(const char *s) {
+        if (s == NULL) {
+            writeInt32(-1);
+            return;
+        }
+        size_t len = strlen(s);
+        writeInt32(len);
+        for (size_t i = 0; i <= len; i++) {
+            uint16_t c = (uint8_t)s[i];
+            const uint8_t *p = (const uint8_t *)&c;
+            data_.insert(data_.end(), p, p + sizeof(c));
+        }
+        while (data_.size() % 4) {
+            data_.push_back(0);
+        }
+    }
+
+    // The record as libril reads it from its socket: a big endian length
+    // followed by the parcel
+    void frame(std::vector<uint8_t> *out) const {
+        uint32_t header = htonl(data_.size());
+        const uint8_t *p = (const uint8_t *)&header;
+        out->assign(p, p + sizeof(header));
+        out->insert(out->end(), data_.begin(), data_.end());
+    }
+
+  private:
+    std::vector<uint8_t> data_;
+};
+
+/**
+ * A connection to libril's command socket, as the phone process opens
+ * it. Requests are written by the replaying thread, the reader thread
+ * matches responses to them by serial number and drains the unsolicited
+ * responses libril sends to its client.
+ */
+class ReplayClient {
+  public:
+    ReplayClient() : fd_(-1), reader_started_(false), closed_(false),
+            sent_us_(NULL), max_requests_(0), requests_(0), responses_(0),
+            failed_(0), last_response_us_(0) {
+        pthread_mutex_init(&mutex_, NULL);
+        pthread_cond_init(&cond_, NULL);
+    }
+
+    ~ReplayClient() {
+        Close();
+        delete [] sent_us_;
+        pthread_cond_destroy(&cond_);
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    int Open(int max_requests) {
+        fd_ = socket_local_client(RILD_SOCKET_NAME,
+                ANDROID_SOCKET_NAMESPACE_RESERVED, SOCK_STREAM);
+        if (fd_ < 0) {
+            LOGE("ReplayClient: could not connect to %s: %s",
+                    RILD_SOCKET_NAME, strerror(errno));
+            return STATUS_ERR;
+        }
+
+        sent_us_ = new int64_t[max_requests];
+        max_requests_ = max_requests;
+        latencies_.reserve(max_requests);
+
+        int ret = pthread_create(&reader_, NULL, ReaderThread, this);
+        if (ret != 0) {
+            LOGE("ReplayClient: pthread_create failed err=%s", strerror(ret));
+            close(fd_);
+            fd_ = -1;
+            return STATUS_ERR;
+        }
+        reader_started_ = true;
+        return STATUS_OK;
+    }
+
+    int SendRequest(const ReplayRecord &record) {
+        RequestParcel parcel;
+        std::vector<uint8_t> frame;
+        int serial;
+
+        pthread_mutex_lock(&mutex_);
+        serial = requests_;
+        pthread_mutex_unlock(&mutex_);
+        if (serial >= max_requests_) {
+            return STATUS_ERR;
+        }
+
+        parcel.writeInt32(record.id);
+        parcel.writeInt32(serial);
+        if (record.strings) {
+            char **strings = (char **)record.data;
+            int count = record.datalen / sizeof(char *);
+            parcel.writeInt32(count);
+            for (int i = 0; i < count; i++) {
+                parcel.writeString16(strings[i]);
+            }
+        } else if (record.datalen > 0) {
+            const uint8_t *p = (const uint8_t *)record.data;
+            int count = record.datalen / sizeof(int32_t);
+            parcel.writeInt32(count);
+            for (int i = 0; i < count; i++, p += sizeof(int32_t)) {
+                uint32_t value;
+                memcpy(&value, p, sizeof(value));
+                parcel.writeInt32(int32_t(letoh32(value)));
+            }
+        }
+        parcel.frame(&frame);
+
+        // Published before the write so the reader always finds it
+        pthread_mutex_lock(&mutex_);
+        sent_us_[serial] = nowUs();
+        requests_ += 1;
+        pthread_mutex_unlock(&mutex_);
+
+        if (writeFully(fd_, &frame[0], frame.size()) < 0) {
+            LOGE("ReplayClient: write failed: %s", strerror(errno));
+            return STATUS_CLIENT_CLOSED_CONNECTION;
+        }
+        return STATUS_OK;
+    }
+
+    /**
+     * Wait until every request sent has been answered, libril closed the
+     * socket or no response came for REPLAY_RESPONSE_TIMEOUT_MS
+     */
+    void WaitForResponses() {
+        pthread_mutex_lock(&mutex_);
+        int64_t progress_us = std::max(nowUs(), last_response_us_);
+        while ((responses_ < requests_) && !closed_) {
+            int64_t deadline_us = progress_us
+                    + int64_t(REPLAY_RESPONSE_TIMEOUT_MS) * 1000;
+            int64_t delay_us = deadline_us - nowUs();
+            if (delay_us <= 0) {
+                LOGE("ReplayClient: %d of %d requests not answered",
+                        requests_ - responses_, requests_);
+                break;
+            }
+
+            struct timeval tv;
+            struct timespec ts;
+            gettimeofday(&tv, NULL);
+            int64_t abs_us = int64_t(tv.tv_sec) * 1000000 + tv.tv_usec + delay_us;
+            ts.tv_sec = abs_us / 1000000;
+            ts.tv_nsec = (abs_us % 1000000) * 1000;
+            pthread_cond_timedwait(&cond_, &mutex_, &ts);
+
+            progress_us = std::max(progress_us, last_response_us_);
+        }
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    void Close() {
+        if (fd_ >= 0) {
+            // Wakes the reader, libril goes back to listening for the phone
+            shutdown(fd_, SHUT_RDWR);
+            if (reader_started_) {
+                pthread_join(reader_, NULL);
+                reader_started_ = false;
+            }
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    // Only valid once Close() returned
+    int responses() const { return responses_; }
+    int failed() const { return failed_; }
+    int64_t last_response_us() const { return last_response_us_; }
+    std::vector<int> &latencies() { return latencies_; }
+
+  private:
+    static void *ReaderThread(void *param) {
+        ((ReplayClient *)param)->ReadResponses();
+        return NULL;
+    }
+
+    void ReadResponses() {
+        std::vector<uint8_t> buffer;
+
+        for (;;) {
+            uint32_t header;
+            if (readFully(fd_, &header, sizeof(header)) < 0) {
+                break;
+            }
+            buffer.resize(ntohl(header));
+            if (buffer.size() == 0) {
+                continue;
+            }
+            if (readFully(fd_, &buffer[0], buffer.size()) < 0) {
+                break;
+            }
+
+            int32_t response[3];    // type, serial, error
+            if (buffer.size() < sizeof(response)) {
+                continue;           // unsolicited
+            }
+            memcpy(response, &buffer[0], sizeof(response));
+            if (response[0] != RESPONSE_SOLICITED) {
+                continue;
+            }
+
+            int64_t now_us = nowUs();
+            pthread_mutex_lock(&mutex_);
+            if ((response[1] >= 0) && (response[1] < requests_)) {
+                latencies_.push_back(int(now_us - sent_us_[response[1]]));
+                responses_ += 1;
+                if (response[2] != RIL_E_SUCCESS) failed_ += 1;
+                last_response_us_ = now_us;
+                pthread_cond_signal(&cond_);
+            }
+            pthread_mutex_unlock(&mutex_);
+        }
+
+        pthread_mutex_lock(&mutex_);
+        closed_ = true;
+        pthread_cond_signal(&cond_);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    int fd_;
+    pthread_t reader_;
+    bool reader_started_;
+
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+    bool closed_;
+    int64_t *sent_us_;      // by serial
+    int max_requests_;
+    int requests_;
+    int responses_;
+    int failed_;
+    int64_t last_response_us_;
+    std::vector<int> latencies_;
+};
+
+/**
+ * Split the trace into records, building the string arrays for
+ * REPLAY_DATA_STRINGS payloads. The arrays are added to 'strings'
+ * which the caller frees.
+ */
+static int parseTrace(char *trace, size_t length,
+        std::vector<ReplayRecord> *records, std::vector<char **> *strings) {
+    ReplayFileHeader fh;
+
+    if (length < sizeof(fh)) {
+        return STATUS_BAD_DATA;
+    }
+    memcpy(&fh, trace, sizeof(fh));
+    if (letoh32(fh.magic) != REPLAY_MAGIC
+            || letoh32(fh.version) != REPLAY_VERSION) {
+        LOGE("parseTrace: not a version %d trace", REPLAY_VERSION);
+        return STATUS_BAD_DATA;
+    }
+
+    size_t offset = sizeof(fh);
+    while (offset < length) {
+        ReplayRecordHeader rh;
+        ReplayRecord record;
+
+        if (length - offset < sizeof(rh)) {
+            LOGE("parseTrace: truncated record header at %d", int(offset));
+            return STATUS_BAD_DATA;
+        }
+        memcpy(&rh, trace + offset, sizeof(rh));
+        offset += sizeof(rh);
+
+        record.kind = letoh16(rh.kind);
+        record.id = int32_t(letoh32(rh.id));
+        record.strings = false;
+        record.time_us = letoh32(rh.time_us);
+        record.datalen = letoh32(rh.length_data);
+        if (length - offset < record.datalen) {
+            LOGE("parseTrace: truncated record data at %d", int(offset));
+            return STATUS_BAD_DATA;
+        }
+        record.data = record.datalen ? trace + offset : NULL;
+        offset += record.datalen;
+
+        if ((record.kind != REPLAY_KIND_REQUEST)
+                && (record.kind != REPLAY_KIND_UNSOL)) {
+            LOGE("parseTrace: unknown record kind %d", record.kind);
+            return STATUS_BAD_DATA;
+        }
+
+        if ((letoh16(rh.flags) & REPLAY_DATA_STRINGS) && (record.data != NULL)) {
+            char *s = (char *)record.data;
+            char *end = s + record.datalen;
+            int count = 0;
+
+            if (end[-1] != '\0') {
+                LOGE("parseTrace: unterminated string at %d", int(offset));
+                return STATUS_BAD_DATA;
+            }
+            for (char *p = s; p < end; p++) {
+                if (*p == '\0') count += 1;
+            }
+
+            char **array = new char *[count];
+            for (int i = 0; i < count; i++) {
+                array[i] = s;
+                s += strlen(s) + 1;
+            }
+            strings->push_back(array);
+
+            record.data = array;
+            record.datalen = count * sizeof(char *);
+            record.strings = true;
+        } else if ((record.kind == REPLAY_KIND_REQUEST)
+                && (record.datalen % sizeof(int32_t) != 0)) {
+            LOGE("parseTrace: request data at %d is not int32s", int(offset));
+            return STATUS_BAD_DATA;
+        }
+
+        records->push_back(record);
+    }
+
+    return STATUS_OK;
+}
+
+static int percentile(const std::vector<int> &sorted, int percent) {
+    if (sorted.size() == 0) {
+        return 0;
+    }
+    size_t i = (sorted.size() * percent) / 100;
+    return sorted[i < sorted.size() ? i : sorted.size() - 1];
+}
+
+int replayTrace(const char *trace_file, int rate, int repeat,
+                ReplayResult *result) {
+    DBG("replayTrace E trace_file=%s rate=%d repeat=%d",
+            trace_file, rate, repeat);
+
+    if (repeat <= 0) {
+        LOGE("replayTrace: repeat must be positive, got %d", repeat);
+        return STATUS_BAD_PARAMETER;
+    }
+
+    char *trace;
+    size_t length;
+    int status = ReadFile(trace_file, &trace, &length);
+    if (status != STATUS_OK) {
+        LOGE("replayTrace: could not read '%s'", trace_file);
+        return status;
+    }
+
+    std::vector<ReplayRecord> records;
+    std::vector<char **> strings;
+    status = parseTrace(trace, length, &records, &strings);
+
+    int requests = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (records[i].kind == REPLAY_KIND_REQUEST) requests += 1;
+    }
+    if ((status == STATUS_OK) && (requests > INT_MAX / repeat)) {
+        LOGE("replayTrace: %d requests repeated %d times is too many",
+                requests, repeat);
+        status = STATUS_BAD_PARAMETER;
+    }
+
+    // Only traces with requests need libril's client socket
+    ReplayClient *client = NULL;
+    if ((status == STATUS_OK) && (requests > 0)) {
+        client = new ReplayClient();
+        status = client->Open(requests * repeat);
+    }
+
+    if (status == STATUS_OK) {
+        memset(result, 0, sizeof(*result));
+
+        int64_t interval_us = rate > 0 ? 1000000 / rate : 0;
+        int64_t start_us = nowUs();
+        int64_t next_us = start_us;
+
+        for (int pass = 0; (pass < repeat) && (status == STATUS_OK); pass++) {
+            for (size_t i = 0; i < records.size(); i++) {
+                const ReplayRecord &record = records[i];
+
+                if (rate == 0) {
+                    next_us += record.time_us;
+                    sleepUntilUs(next_us);
+                } else if (rate > 0) {
+                    sleepUntilUs(next_us);
+                    next_us += interval_us;
+                }
+
+                if (record.kind == REPLAY_KIND_UNSOL) {
+                    s_rilenv->OnUnsolicitedResponse(record.id,
+                            record.data, record.datalen);
+                    result->unsolicited += 1;
+                } else {
+                    status = client->SendRequest(record);
+                    if (status != STATUS_OK) break;
+                    result->requests += 1;
+                }
+            }
+        }
+        int64_t end_us = nowUs();
+
+        if (client != NULL) {
+            client->WaitForResponses();
+            client->Close();
+
+            result->responses = client->responses();
+            result->failed = client->failed();
+            end_us = std::max(end_us, client->last_response_us());
+
+            std::vector<int> &latencies = client->latencies();
+            std::sort(latencies.begin(), latencies.end());
+            result->latency_p50_us = percentile(latencies, 50);
+            result->latency_p90_us = percentile(latencies, 90);
+            result->latency_p99_us = percentile(latencies, 99);
+            result->latency_max_us = latencies.size() ? latencies.back() : 0;
+
+            if ((status == STATUS_OK) && (result->requests > 0)
+                    && (result->responses == 0)) {
+                LOGE("replayTrace: rild answered none of %d requests,"
+                        " is the phone process connected?", result->requests);
+                status = STATUS_ERR;
+            }
+        }
+
+        result->elapsed_us = end_us - start_us;
+        if (result->elapsed_us > 0) {
+            result->msgs_per_sec = int((int64_t(result->requests
+                    + result->unsolicited) * 1000000) / result->elapsed_us);
+        }
+
+        LOGD("replayTrace %s: %d requests (%d answered, %d failed),"
+                " %d unsolicited in %lldms, %d msgs/sec,"
+                " latency p50=%dus p90=%dus p99=%dus max=%dus",
+                trace_file, result->requests, result->responses,
+                result->failed, result->unsolicited,
+                result->elapsed_us / 1000, result->msgs_per_sec,
+                result->latency_p50_us, result->latency_p90_us,
+                result->latency_p99_us, result->latency_max_us);
+    }
+
+    delete client;
+    for (size_t i = 0; i < strings.size(); i++) {
+        delete [] strings[i];
+    }
+    delete [] trace;
+
+    DBG("replayTrace X status=%d", status);
+    return status;
+}
@@ -0,0 +1,108 @@
+/**
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MOCK_RIL_REPLAY_H_
+#define MOCK_RIL_REPLAY_H_
+
+#include <stdint.h>
+
+/**
+ * Replay of recorded RIL traffic, used as a load generator and a
+ * repeatable benchmark. A replay runs natively, nothing goes through
+ * mock_ril.js.
+ *
+ * A trace file is a ReplayFileHeader followed by records, each a
+ * ReplayRecordHeader followed by length_data bytes. All fields are
+ * little endian.
+ *
+ * REPLAY_KIND_UNSOL records are sent to rild as unsolicited responses
+ * with id as the RIL_UNSOL_* code, data is the payload as passed to
+ * RIL_onUnsolicitedResponse.
+ *
+ * REPLAY_KIND_REQUEST records (id is the RIL_REQUEST_* code) are sent
+ * through libril the way the phone process sends them: the replay
+ * connects to the "rild" command socket, so libril parses each request,
+ * hands it to the mock ril and sends its response back. Data is a
+ * sequence of int32s, marshalled as for libril's dispatchInts, or empty
+ * for requests that take no arguments. libril serves one client at a
+ * time, the phone process must not be connected while requests are
+ * replayed.
+ *
+ * With REPLAY_DATA_STRINGS set in flags data is instead a sequence of
+ * NUL terminated ASCII strings, replayed as a char ** (dispatchStrings
+ * for requests).
+ */
+
+#define REPLAY_MAGIC            0x544c4952  // "RILT"
+#define REPLAY_VERSION          1
+
+#define REPLAY_KIND_REQUEST     0
+#define REPLAY_KIND_UNSOL       1
+
+#define REPLAY_DATA_STRINGS     0x1
+
+struct ReplayFileHeader {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct ReplayRecordHeader {
+    uint16_t kind;
+    uint16_t flags;
+    int32_t id;
+    int32_t error;          // RIL_Errno of a request, 0 for unsolicited
+    uint32_t time_us;       // since the previous record, as recorded
+    uint32_t length_data;
+};
+
+/**
+ * Pacing: a positive rate sends that many messages per second, 0
+ * keeps the recorded spacing and REPLAY_RATE_UNLIMITED sends as fast
+ * as possible.
+ */
+#define REPLAY_RATE_UNLIMITED   -1
+
+/**
+ * How long the replay waits for outstanding responses once the last
+ * record has been sent, without any response arriving
+ */
+#define REPLAY_RESPONSE_TIMEOUT_MS  10000
+
+struct ReplayResult {
+    int requests;           // request records sent
+    int responses;          // responses received for them
+    int failed;             // responses with an error other than RIL_E_SUCCESS
+    int unsolicited;        // unsolicited records sent
+    int64_t elapsed_us;     // first record to last response
+    int msgs_per_sec;       // requests and unsolicited records
+    int latency_p50_us;     // request written to response read
+    int latency_p90_us;
+    int latency_p99_us;
+    int latency_max_us;
+};
+
+/**
+ * Replay trace_file 'repeat' times at 'rate', repeat must be positive.
+ *
+ * Blocks until the last record has been sent and every request has been
+ * answered or REPLAY_RESPONSE_TIMEOUT_MS passed without a response.
+ *
+ * @return STATUS_OK and fills in result, or an error status
+ */
+int replayTrace(const char *trace_file, int rate, int repeat,
+                ReplayResult *result);
+
+#endif  // MOCK_RIL_REPLAY_H_
@@ -18,7 +18,10 @@
 #include "status.h"
 #include "worker.h"
 
+#include <string.h>
+#include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 
 //#define WORKER_DEBUG
 #ifdef  WORKER_DEBUG
@@ -33,12 +36,19 @@
 
 void * WorkerThread::Work(void *param) {
     WorkerThread *t = (WorkerThread *)param;
-    android_atomic_acquire_store(STATE_RUNNING, &t->state_);
+    t->SetState(STATE_RUNNING);
     void * v = t->Worker(t->workerParam_);
-    android_atomic_acquire_store(STATE_STOPPED, &t->state_);
+    t->SetState(STATE_STOPPED);
     return v;
 }
 
+void WorkerThread::SetState(int32_t state) {
+    pthread_mutex_lock(&mutex_);
+    android_atomic_release_store(state, &state_);
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+}
+
 bool WorkerThread::isRunning() {
     DBG("WorkerThread::isRunning E");
     bool ret_value = android_atomic_acquire_load(&state_) == STATE_RUNNING;
@@ -57,6 +67,7 @@ WorkerThread::WorkerThread() {
 WorkerThread::~WorkerThread() {
     DBG("WorkerThread::~WorkerThread E");
     Stop();
+    pthread_cond_destroy(&cond_);
     pthread_mutex_destroy(&mutex_);
     DBG("WorkerThread::~WorkerThread X");
 }
@@ -72,10 +83,13 @@ bool WorkerThread::BeginStopping() {
 // Wait until state is not STATE_STOPPING
 void WorkerThread::WaitUntilStopped() {
     DBG("WorkerThread::WaitUntilStopped E");
-    pthread_cond_signal(&cond_);
-    while(android_atomic_release_load(&state_) == STATE_STOPPING) {
-        usleep(200000);
+    pthread_mutex_lock(&mutex_);
+    // Wake a Worker waiting on cond_ so it sees it is stopping
+    pthread_cond_broadcast(&cond_);
+    while (android_atomic_acquire_load(&state_) == STATE_STOPPING) {
+        pthread_cond_wait(&cond_, &mutex_);
     }
+    pthread_mutex_unlock(&mutex_);
     DBG("WorkerThread::WaitUntilStopped X");
 }
 
@@ -113,9 +127,11 @@ int WorkerThread::Run(void *workerParam) {
     }
 
     // Wait until worker is running
+    pthread_mutex_lock(&mutex_);
     while (android_atomic_acquire_load(&state_) == STATE_INITIALIZED) {
-        usleep(200000);
+        pthread_cond_wait(&cond_, &mutex_);
     }
+    pthread_mutex_unlock(&mutex_);
 
     DBG("WorkerThread::Run X workerParam=%p", workerParam);
     return STATUS_OK;
@@ -126,6 +142,18 @@ class WorkerQueueThread : public WorkerThread {
   private:
     friend class WorkerQueue;
 
+    // Wait on wq->cond_ for at most delay_ms
+    void TimedWait(WorkerQueue *wq, int64_t delay_ms) {
+        struct timeval tv;
+        struct timespec ts;
+
+        gettimeofday(&tv, NULL);
+        int64_t nsec = (tv.tv_usec * 1000LL) + ((delay_ms % 1000) * 1000000LL);
+        ts.tv_sec = tv.tv_sec + (delay_ms / 1000) + (nsec / 1000000000);
+        ts.tv_nsec = nsec % 1000000000;
+        pthread_cond_timedwait(&wq->cond_, &wq->mutex_, &ts);
+    }
+
   public:
     WorkerQueueThread() {
     }
@@ -138,62 +166,54 @@ class WorkerQueueThread : public WorkerThread {
         DBG("WorkerQueueThread::Worker E");
         WorkerQueue *wq = (WorkerQueue *)param;
 
-        // Do the work until we're told to stop
+        // Do the work until we're told to stop, the queue's
+        // mutex_ is held except while processing a record.
+        pthread_mutex_lock(&wq->mutex_);
         while (isRunning()) {
-            pthread_mutex_lock(&mutex_);
-            while (isRunning() && wq->q_.size() == 0) {
-                if (wq->delayed_q_.size() == 0) {
-                    // Both queue's are empty so wait
-                    pthread_cond_wait(&cond_, &mutex_);
-                } else {
-                    // delayed_q_ is not empty, move any
-                    // timed out records to q_.
-                    int64_t now = android::elapsedRealtime();
-                    while((wq->delayed_q_.size() != 0) &&
-                            ((wq->delayed_q_.top()->time - now) <= 0)) {
-                        struct WorkerQueue::Record *r = wq->delayed_q_.top();
-                        DBG("WorkerQueueThread::Worker move p=%p time=%lldms",
-                                r->p, r->time);
-                        wq->delayed_q_.pop();
-                        wq->q_.push_back(r);
-                    }
-
-                    if ((wq->q_.size() == 0) && (wq->delayed_q_.size() != 0)) {
-                        // We need to do a timed wait
-                        struct timeval tv;
-                        struct timespec ts;
-                        struct WorkerQueue::Record *r = wq->delayed_q_.top();
-                        int64_t delay_ms = r->time - now;
-                        DBG("WorkerQueueThread::Worker wait"
-                            " p=%p time=%lldms delay_ms=%lldms",
-                                r->p, r->time, delay_ms);
-                        gettimeofday(&tv, NULL);
-                        ts.tv_sec = tv.tv_sec + (delay_ms / 1000);
-                        ts.tv_nsec = (tv.tv_usec +
-                                        ((delay_ms % 1000) * 1000)) * 1000;
-                        pthread_cond_timedwait(&cond_, &mutex_, &ts);
-                    }
-                }
-            }
-            if (isRunning()) {
+            if (wq->q_.size() != 0) {
                 struct WorkerQueue::Record *r = wq->q_.front();
                 wq->q_.pop_front();
                 void *p = r->p;
                 wq->release_record(r);
-                pthread_mutex_unlock(&mutex_);
-                wq->Process(r->p);
+                pthread_mutex_unlock(&wq->mutex_);
+                wq->Process(p);
+                pthread_mutex_lock(&wq->mutex_);
+            } else if (wq->delayed_count_ == 0) {
+                // Both queue's are empty so wait
+                pthread_cond_wait(&wq->cond_, &wq->mutex_);
             } else {
-                pthread_mutex_unlock(&mutex_);
+                // Move any timed out records to q_
+                int64_t now = android::elapsedRealtime();
+                int moved = wq->expire_timers_locked(now);
+                if (moved > 1) {
+                    // Let the other threads in the pool help
+                    pthread_cond_broadcast(&wq->cond_);
+                } else if (moved == 0) {
+                    // We need to do a timed wait
+                    int64_t delay_ms = wq->next_time_ - now;
+                    DBG("WorkerQueueThread::Worker wait"
+                        " time=%lldms delay_ms=%lldms",
+                            wq->next_time_, delay_ms);
+                    TimedWait(wq, delay_ms);
+                }
             }
         }
+        pthread_mutex_unlock(&wq->mutex_);
         DBG("WorkerQueueThread::Worker X");
         return NULL;
     }
 };
 
-WorkerQueue::WorkerQueue() {
-    DBG("WorkerQueue::WorkerQueue E");
-    wqt_ = new WorkerQueueThread();
+WorkerQueue::WorkerQueue(int threads) {
+    DBG("WorkerQueue::WorkerQueue E threads=%d", threads);
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+    delayed_count_ = 0;
+    wheel_time_ = android::elapsedRealtime();
+    next_time_ = 0;
+    for (int i = 0; i < threads; i++) {
+        threads_.push_back(new WorkerQueueThread());
+    }
     DBG("WorkerQueue::WorkerQueue X");
 }
 
@@ -202,31 +222,61 @@ WorkerQueue::~WorkerQueue() {
     Stop();
 
     Record *r;
-    pthread_mutex_lock(&wqt_->mutex_);
+    pthread_mutex_lock(&mutex_);
     while(free_list_.size() != 0) {
         r = free_list_.front();
         free_list_.pop_front();
         DBG("WorkerQueue::~WorkerQueue delete free_list_ r=%p", r);
         delete r;
     }
-    while(delayed_q_.size() != 0) {
-        r = delayed_q_.top();
-        delayed_q_.pop();
-        DBG("WorkerQueue::~WorkerQueue delete delayed_q_ r=%p", r);
+    while(q_.size() != 0) {
+        r = q_.front();
+        q_.pop_front();
+        DBG("WorkerQueue::~WorkerQueue delete q_ r=%p", r);
         delete r;
     }
-    pthread_mutex_unlock(&wqt_->mutex_);
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        while(wheel_[i].size() != 0) {
+            r = wheel_[i].front();
+            wheel_[i].pop_front();
+            DBG("WorkerQueue::~WorkerQueue delete wheel_ r=%p", r);
+            delete r;
+        }
+    }
+    pthread_mutex_unlock(&mutex_);
 
-    delete wqt_;
+    for (size_t i = 0; i < threads_.size(); i++) {
+        delete threads_[i];
+    }
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
     DBG("WorkerQueue::~WorkerQueue X");
 }
 
 int WorkerQueue::Run() {
-    return wqt_->Run(this);
+    for (size_t i = 0; i < threads_.size(); i++) {
+        int status = threads_[i]->Run(this);
+        if (status != STATUS_OK) {
+            Stop();
+            return status;
+        }
+    }
+    return STATUS_OK;
 }
 
 void WorkerQueue::Stop() {
-    wqt_->Stop();
+    // Change the state with mutex_ held so no thread can miss the
+    // broadcast between testing isRunning() and waiting.
+    pthread_mutex_lock(&mutex_);
+    for (size_t i = 0; i < threads_.size(); i++) {
+        threads_[i]->BeginStopping();
+    }
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+
+    for (size_t i = 0; i < threads_.size(); i++) {
+        threads_[i]->WaitUntilStopped();
+    }
 }
 
 /**
@@ -260,18 +310,97 @@ void WorkerQueue::release_record(struct Record *r) {
     free_list_.push_front(r);
 }
 
+/**
+ * Hash a delayed record into its slot
+ */
+bool WorkerQueue::add_timer_locked(struct Record *r) {
+    if (r->time < wheel_time_) {
+        r->time = wheel_time_;
+    }
+    wheel_[r->time & WHEEL_MASK].push_back(r);
+    delayed_count_ += 1;
+    if ((delayed_count_ == 1) || (r->time < next_time_)) {
+        next_time_ = r->time;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Visit the slots from wheel_time_ up to now moving the records
+ * that are due to q_, then find the new earliest record.
+ */
+int WorkerQueue::expire_timers_locked(int64_t now) {
+    int moved = 0;
+
+    if ((delayed_count_ == 0) || (now < next_time_)) {
+        return 0;
+    }
+
+    int64_t ticks = now - wheel_time_ + 1;
+    if (ticks > WHEEL_SLOTS) {
+        ticks = WHEEL_SLOTS;
+    }
+    for (int64_t t = 0; t < ticks; t++) {
+        std::list<struct Record *> &slot = wheel_[(wheel_time_ + t) & WHEEL_MASK];
+        std::list<struct Record *>::iterator it = slot.begin();
+        while (it != slot.end()) {
+            if ((*it)->time <= now) {
+                DBG("WorkerQueue::expire_timers_locked move p=%p time=%lldms",
+                        (*it)->p, (*it)->time);
+                q_.push_back(*it);
+                it = slot.erase(it);
+                moved += 1;
+            } else {
+                ++it;
+            }
+        }
+    }
+    wheel_time_ = now + 1;
+    delayed_count_ -= moved;
+
+    if (delayed_count_ != 0) {
+        // Everything left is at or after wheel_time_, so the first
+        // record whose time matches its slot on this turn is the
+        // earliest. Failing that look at all of them.
+        next_time_ = -1;
+        for (int64_t t = wheel_time_; t < wheel_time_ + WHEEL_SLOTS; t++) {
+            std::list<struct Record *> &slot = wheel_[t & WHEEL_MASK];
+            std::list<struct Record *>::iterator it;
+            for (it = slot.begin(); it != slot.end(); ++it) {
+                if ((*it)->time == t) {
+                    next_time_ = t;
+                    break;
+                }
+            }
+            if (next_time_ >= 0) {
+                break;
+            }
+        }
+        if (next_time_ < 0) {
+            for (int i = 0; i < WHEEL_SLOTS; i++) {
+                std::list<struct Record *>::iterator it;
+                for (it = wheel_[i].begin(); it != wheel_[i].end(); ++it) {
+                    if ((next_time_ < 0) || ((*it)->time < next_time_)) {
+                        next_time_ = (*it)->time;
+                    }
+                }
+            }
+        }
+    }
+    return moved;
+}
+
 /**
  * Add a record to processing queue q_
  */
 void WorkerQueue::Add(void *p) {
     DBG("WorkerQueue::Add E:");
-    pthread_mutex_lock(&wqt_->mutex_);
+    pthread_mutex_lock(&mutex_);
     struct Record *r = obtain_record(p, 0);
     q_.push_back(r);
-    if (q_.size() == 1) {
-        pthread_cond_signal(&wqt_->cond_);
-    }
-    pthread_mutex_unlock(&wqt_->mutex_);
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&mutex_);
     DBG("WorkerQueue::Add X:");
 }
 
@@ -280,25 +409,19 @@ void WorkerQueue::AddDelayed(void *p, int delay_in_ms) {
     if (delay_in_ms <= 0) {
         Add(p);
     } else {
-        pthread_mutex_lock(&wqt_->mutex_);
+        pthread_mutex_lock(&mutex_);
         struct Record *r = obtain_record(p, delay_in_ms);
-        delayed_q_.push(r);
-#ifdef WORKER_DEBUG
-        int64_t now = android::elapsedRealtime();
+        bool earliest = add_timer_locked(r);
         DBG("WorkerQueue::AddDelayed"
-            " p=%p delay_in_ms=%d now=%lldms top->p=%p"
-            " top->time=%lldms diff=%lldms",
-                p, delay_in_ms, now, delayed_q_.top()->p,
-                delayed_q_.top()->time, delayed_q_.top()->time - now);
-#endif
-        if ((q_.size() == 0) && (delayed_q_.top() == r)) {
-            // q_ is empty and the new record is at delayed_q_.top
-            // so we signal the waiting thread so it can readjust
-            // the wait time.
-            DBG("WorkerQueue::AddDelayed signal");
-            pthread_cond_signal(&wqt_->cond_);
+            " p=%p delay_in_ms=%d time=%lldms next_time_=%lldms",
+                p, delay_in_ms, r->time, next_time_);
+        if (earliest) {
+            // The new record is the earliest so the waiting threads
+            // need to readjust the wait time.
+            DBG("WorkerQueue::AddDelayed broadcast");
+            pthread_cond_broadcast(&cond_);
         }
-        pthread_mutex_unlock(&wqt_->mutex_);
+        pthread_mutex_unlock(&mutex_);
     }
     DBG("WorkerQueue::AddDelayed X:");
 }
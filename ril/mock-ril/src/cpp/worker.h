@@ -17,7 +17,6 @@
 #ifndef MOCK_RIL_WORKER_H_
 #define MOCK_RIL_WORKER_H_
 
-#include <queue>
 #include <list>
 #include <vector>
 #include <pthread.h>
@@ -66,6 +65,9 @@ class WorkerThread {
 
     static void * Work(void *param);
 
+    // Change state_ under mutex_ and wake anyone waiting on cond_
+    void SetState(int32_t state);
+
     virtual bool isRunning();
 
   public:
@@ -81,6 +83,7 @@ class WorkerThread {
 
     virtual void Stop();
 
+    // Start the thread and return once Worker is about to be called
     virtual int Run(void *workerParam);
 
     /**
@@ -95,7 +98,9 @@ class WorkerThread {
  * A WorkerQueue.
  *
  * 0) Extend overriding Process
- * 1) Create an instance
+ * 1) Create an instance, optionally with the number of threads
+ *    that will call Process. With more than one thread records
+ *    may be processed concurrently and out of order.
  * 2) Call Run.
  * 3) Call Add, passing a pointer which is added to a queue
  * 4) Process will be called with a pointer as work can be done.
@@ -109,19 +114,30 @@ class WorkerQueue {
         void *p;
     };
 
-    class record_compare {
-      public:
-        // To get ascending order return true if lhs > rhs.
-        bool operator() (const struct Record* lhs, const struct Record* rhs) const {
-            return lhs->time > rhs->time;
-        }
-    };
+    /**
+     * Delayed records are hashed by their expiry time in ms into
+     * a timer wheel. A slot may hold records from later turns of
+     * the wheel, they stay there until their time comes around.
+     */
+    #define WHEEL_SLOTS         256
+    #define WHEEL_MASK          (WHEEL_SLOTS - 1)
 
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
     std::list<struct Record *> q_;                // list of records to be processed
     std::list<struct Record *> free_list_;        // list of records that have been released
-    std::priority_queue<struct Record *, std::vector<struct Record *>, record_compare> delayed_q_;
-                                                  // list of records that are delayed
-    class WorkerQueueThread *wqt_;
+    std::list<struct Record *> wheel_[WHEEL_SLOTS];
+                                                  // records that are delayed
+    int delayed_count_;                           // number of records in wheel_
+    int64_t wheel_time_;                          // all earlier slots have been expired
+    int64_t next_time_;                           // time of the earliest delayed record
+    std::vector<class WorkerQueueThread *> threads_;
+
+    // Add r to the wheel, return true if it is now the earliest record
+    bool add_timer_locked(struct Record *r);
+
+    // Move records due at now to q_, return the number moved
+    int expire_timers_locked(int64_t now);
 
   protected:
     struct Record *obtain_record(void *p, int delay_in_ms);
@@ -129,7 +145,7 @@ class WorkerQueue {
     void release_record(struct Record *r);
 
   public:
-    WorkerQueue();
+    WorkerQueue(int threads = 1);
 
     virtual ~WorkerQueue();
 
@@ -179,6 +179,11 @@ def main(argv):
   Then you can execute this test using:
 
     tms.py 127.0.0.1 11111
+
+  An optional trace file on the device, rate and repeat count
+  also runs a replay, see src/cpp/replay.h:
+
+    tms.py 127.0.0.1 11111 /data/ril.trace -1 10
   """
   s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
   host = sys.argv[1]        # server address
@@ -238,6 +243,31 @@ def main(argv):
   else:
       print "ERROR: expecting resp.cmd == ctrl_pb2.CTRL_CMD_GET_RADIO_STATE"
 
+  # Test CTRL_CMD_REPLAY
+  if (len(argv) > 3):
+    rr = ctrl_pb2.CtrlReqReplay()
+    rr.trace_file = argv[3]
+    if (len(argv) > 4):
+      rr.rate = int(argv[4])
+    if (len(argv) > 5):
+      rr.repeat = int(argv[5])
+    req.sendMsg(s, ctrl_pb2.CTRL_CMD_REPLAY, 5, rr.SerializeToString())
+    resp = Msg()
+    resp.recvMsg(s)
+
+    if ((resp.cmd == ctrl_pb2.CTRL_CMD_REPLAY) & (resp.status == 0)):
+      response = ctrl_pb2.CtrlRspReplay()
+      response.ParseFromString(resp.protobuf)
+      print "SUCCESS: replay unsolicited=%d requests=%d responses=%d failed=%d" % (
+          response.unsolicited, response.requests, response.responses,
+          response.failed)
+      print "  elapsed_ms=%d msgs/sec=%d latency_us p50=%d p90=%d p99=%d max=%d" % (
+          response.elapsed_ms, response.msgs_per_sec, response.latency_p50_us,
+          response.latency_p90_us, response.latency_p99_us,
+          response.latency_max_us)
+    else:
+      print "ERROR: replay cmd=%d status=%d" % (resp.cmd, resp.status)
+
   # Close socket
   print "closing socket"
   s.close()
@@ -28,6 +28,11 @@
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#include <stdint.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #define LOG_NDEBUG 0
 #define LOG_TAG "AT"
@@ -51,18 +56,67 @@
 #define HANDSHAKE_RETRY_COUNT 8
 #define HANDSHAKE_TIMEOUT_MSEC 250
 
-static pthread_t s_tid_reader;
-static int s_fd = -1;    /* fd of the AT channel */
-static ATUnsolHandler s_unsolHandler;
+/*
+ * One AT port. Each channel has its own reader thread and its own
+ * pending command, so commands on different channels are in flight
+ * at the same time. Commands on one channel are serialized by its
+ * commandmutex.
+ */
+typedef struct ATChannel {
+    pthread_t tid_reader;
+    int fd;    /* fd of the AT channel */
+    ATUnsolHandler unsolHandler;
+
+    /* for input buffering */
+
+    /* unconsumed input runs from ATBufferCur to ATBufferEnd;
+     * the bytes before ATBufferScan are known to hold no end of line */
+    char ATBuffer[MAX_AT_RESPONSE+1];
+    char *ATBufferCur;
+    char *ATBufferEnd;
+    char *ATBufferScan;
+
+    int ackPowerIoctl; /* true if TTY has android byte-count
+                          handshake for low power*/
+    int readCount;
+
+    /*
+     * for current pending command
+     * these are protected by commandmutex
+     */
+
+    pthread_mutex_t commandmutex;
+    pthread_cond_t commandcond;
+
+    ATCommandType type;
+    const char *responsePrefix;
+    const char *smsPDU;
+    ATResponse *p_response;
+
+    int readerClosed;
 
-/* for input buffering */
+    /* used for commands issued without an explicit timeout,
+     * 0 means infinite */
+    long long timeoutMsec;
+} ATChannel;
 
-static char s_ATBuffer[MAX_AT_RESPONSE+1];
-static char *s_ATBufferCur = s_ATBuffer;
+#define CHANNEL_INITIALIZER { 0, -1, NULL, "", NULL, NULL, NULL, 0, 0, \
+                              PTHREAD_MUTEX_INITIALIZER, \
+                              PTHREAD_COND_INITIALIZER, \
+                              NO_RESULT, NULL, NULL, NULL, 0, 0 }
+
+static ATChannel s_channels[AT_MAX_CHANNELS] = {
+    CHANNEL_INITIALIZER, CHANNEL_INITIALIZER,
+    CHANNEL_INITIALIZER, CHANNEL_INITIALIZER
+};
 
-static int s_ackPowerIoctl; /* true if TTY has android byte-count
-                                handshake for low power*/
-static int s_readCount = 0;
+/* the channel commands from the calling thread go to, see
+ * at_set_thread_channel(). Unbound threads use channel 0 */
+static pthread_key_t s_threadChannelKey;
+static pthread_once_t s_threadChannelOnce = PTHREAD_ONCE_INIT;
+
+/* stored under s_threadChannelKey for reader threads */
+#define READER_THREAD ((void *) -1)
 
 #if AT_DEBUG
 void  AT_DUMP(const char*  prefix, const char*  buff, int  len)
@@ -73,26 +127,12 @@ void  AT_DUMP(const char*  prefix, const char*  buff, int  len)
 }
 #endif
 
-/*
- * for current pending command
- * these are protected by s_commandmutex
- */
-
-static pthread_mutex_t s_commandmutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t s_commandcond = PTHREAD_COND_INITIALIZER;
-
-static ATCommandType s_type;
-static const char *s_responsePrefix = NULL;
-static const char *s_smsPDU = NULL;
-static ATResponse *sp_response = NULL;
-
 static void (*s_onTimeout)(void) = NULL;
 static void (*s_onReaderClosed)(void) = NULL;
-static int s_readerClosed;
 
-static void onReaderClosed();
-static int writeCtrlZ (const char *s);
-static int writeline (const char *s);
+static void onReaderClosed(ATChannel *ch);
+static int writeCtrlZ (ATChannel *ch, const char *s);
+static int writeline (ATChannel *ch, const char *s);
 
 #ifndef USE_NP
 static void setTimespecRelative(struct timespec *p_ts, long long msec)
@@ -124,8 +164,8 @@ static void sleepMsec(long long msec)
 
 
 
-/** add an intermediate response to sp_response*/
-static void addIntermediate(const char *line)
+/** add an intermediate response to ch->p_response*/
+static void addIntermediate(ATChannel *ch, const char *line)
 {
     ATLine *p_new;
 
@@ -136,13 +176,13 @@ static void addIntermediate(const char *line)
     /* note: this adds to the head of the list, so the list
        will be in reverse order of lines received. the order is flipped
        again before passing on to the command issuer */
-    p_new->p_next = sp_response->p_intermediates;
-    sp_response->p_intermediates = p_new;
+    p_new->p_next = ch->p_response->p_intermediates;
+    ch->p_response->p_intermediates = p_new;
 }
 
 
 /**
- * returns 1 if line is a final response indicating error
+ * final responses indicating error
  * See 27.007 annex B
  * WARNING: NO CARRIER and others are sometimes unsolicited
  */
@@ -154,21 +194,9 @@ static const char * s_finalResponsesError[] = {
     "NO ANSWER",
     "NO DIALTONE",
 };
-static int isFinalResponseError(const char *line)
-{
-    size_t i;
-
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesError) ; i++) {
-        if (strStartsWith(line, s_finalResponsesError[i])) {
-            return 1;
-        }
-    }
-
-    return 0;
-}
 
 /**
- * returns 1 if line is a final response indicating success
+ * final responses indicating success
  * See 27.007 annex B
  * WARNING: NO CARRIER and others are sometimes unsolicited
  */
@@ -176,146 +204,228 @@ static const char * s_finalResponsesSuccess[] = {
     "OK",
     "CONNECT"       /* some stacks start up data on another channel */
 };
-static int isFinalResponseSuccess(const char *line)
+
+/**
+ * first lines in (what will be) a two-line SMS unsolicited response
+ */
+static const char * s_smsUnsoliciteds[] = {
+    "+CMT:",
+    "+CDS:",
+    "+CBM:"
+};
+
+typedef enum {
+    LINE_OTHER,
+    LINE_FINAL_SUCCESS,
+    LINE_FINAL_ERROR,
+    LINE_SMS_UNSOLICITED
+} ATLineClass;
+
+typedef struct {
+    const char *prefix;
+    size_t len;
+    ATLineClass lineClass;
+} ATPrefix;
+
+#define NUM_AT_PREFIXES (NUM_ELEMS(s_finalResponsesSuccess) \
+                         + NUM_ELEMS(s_finalResponsesError) \
+                         + NUM_ELEMS(s_smsUnsoliciteds))
+
+/* the prefixes above grouped by first character, so each line is only
+ * compared against the few that can possibly match */
+static ATPrefix s_prefixes[NUM_AT_PREFIXES];
+static unsigned char s_prefixFirst[256];
+static unsigned char s_prefixCount[256];
+static pthread_once_t s_prefixOnce = PTHREAD_ONCE_INIT;
+
+static void addPrefixes(const char **prefixes, size_t count,
+                        ATLineClass lineClass, ATPrefix *all, size_t *p_n)
 {
     size_t i;
 
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesSuccess) ; i++) {
-        if (strStartsWith(line, s_finalResponsesSuccess[i])) {
-            return 1;
-        }
+    for (i = 0 ; i < count ; i++) {
+        all[*p_n].prefix = prefixes[i];
+        all[*p_n].len = strlen(prefixes[i]);
+        all[*p_n].lineClass = lineClass;
+        (*p_n)++;
     }
-
-    return 0;
 }
 
-/**
- * returns 1 if line is a final response, either  error or success
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
- */
-static int isFinalResponse(const char *line)
+static void buildPrefixIndex(void)
 {
-    return isFinalResponseSuccess(line) || isFinalResponseError(line);
+    ATPrefix all[NUM_AT_PREFIXES];
+    size_t n = 0;
+    size_t out = 0;
+    size_t i;
+    int c;
+
+    /* success is tested before error, as it always has been */
+    addPrefixes(s_finalResponsesSuccess, NUM_ELEMS(s_finalResponsesSuccess),
+                LINE_FINAL_SUCCESS, all, &n);
+    addPrefixes(s_finalResponsesError, NUM_ELEMS(s_finalResponsesError),
+                LINE_FINAL_ERROR, all, &n);
+    addPrefixes(s_smsUnsoliciteds, NUM_ELEMS(s_smsUnsoliciteds),
+                LINE_SMS_UNSOLICITED, all, &n);
+
+    for (c = 0 ; c < 256 ; c++) {
+        s_prefixFirst[c] = out;
+        for (i = 0 ; i < n ; i++) {
+            if ((unsigned char)all[i].prefix[0] == c) {
+                s_prefixes[out++] = all[i];
+            }
+        }
+        s_prefixCount[c] = out - s_prefixFirst[c];
+    }
 }
 
-
 /**
- * returns 1 if line is the first line in (what will be) a two-line
- * SMS unsolicited response
+ * returns which of the prefix tables above 'line' starts with, if any
  */
-static const char * s_smsUnsoliciteds[] = {
-    "+CMT:",
-    "+CDS:",
-    "+CBM:"
-};
-static int isSMSUnsolicited(const char *line)
+static ATLineClass classifyLine(const char *line)
 {
-    size_t i;
+    unsigned char c = (unsigned char)line[0];
+    const ATPrefix *p = s_prefixes + s_prefixFirst[c];
+    const ATPrefix *end = p + s_prefixCount[c];
 
-    for (i = 0 ; i < NUM_ELEMS(s_smsUnsoliciteds) ; i++) {
-        if (strStartsWith(line, s_smsUnsoliciteds[i])) {
-            return 1;
+    for ( ; p < end ; p++) {
+        if (0 == strncmp(line, p->prefix, p->len)) {
+            return p->lineClass;
         }
     }
 
-    return 0;
+    return LINE_OTHER;
 }
 
 
-/** assumes s_commandmutex is held */
-static void handleFinalResponse(const char *line)
+/** assumes ch->commandmutex is held */
+static void handleFinalResponse(ATChannel *ch, const char *line)
 {
-    sp_response->finalResponse = strdup(line);
+    ch->p_response->finalResponse = strdup(line);
 
-    pthread_cond_signal(&s_commandcond);
+    pthread_cond_signal(&ch->commandcond);
 }
 
-static void handleUnsolicited(const char *line)
+static void handleUnsolicited(ATChannel *ch, const char *line)
 {
-    if (s_unsolHandler != NULL) {
-        s_unsolHandler(line, NULL);
+    if (ch->unsolHandler != NULL) {
+        ch->unsolHandler(line, NULL);
     }
 }
 
-static void processLine(const char *line)
+static void processLine(ATChannel *ch, const char *line, ATLineClass lineClass)
 {
-    pthread_mutex_lock(&s_commandmutex);
+    pthread_mutex_lock(&ch->commandmutex);
 
-    if (sp_response == NULL) {
+    if (ch->p_response == NULL) {
         /* no command pending */
-        handleUnsolicited(line);
-    } else if (isFinalResponseSuccess(line)) {
-        sp_response->success = 1;
-        handleFinalResponse(line);
-    } else if (isFinalResponseError(line)) {
-        sp_response->success = 0;
-        handleFinalResponse(line);
-    } else if (s_smsPDU != NULL && 0 == strcmp(line, "> ")) {
+        handleUnsolicited(ch, line);
+    } else if (lineClass == LINE_FINAL_SUCCESS) {
+        ch->p_response->success = 1;
+        handleFinalResponse(ch, line);
+    } else if (lineClass == LINE_FINAL_ERROR) {
+        ch->p_response->success = 0;
+        handleFinalResponse(ch, line);
+    } else if (ch->smsPDU != NULL && 0 == strcmp(line, "> ")) {
         // See eg. TS 27.005 4.3
         // Commands like AT+CMGS have a "> " prompt
-        writeCtrlZ(s_smsPDU);
-        s_smsPDU = NULL;
-    } else switch (s_type) {
+        writeCtrlZ(ch, ch->smsPDU);
+        ch->smsPDU = NULL;
+    } else switch (ch->type) {
         case NO_RESULT:
-            handleUnsolicited(line);
+            handleUnsolicited(ch, line);
             break;
         case NUMERIC:
-            if (sp_response->p_intermediates == NULL
+            if (ch->p_response->p_intermediates == NULL
                 && isdigit(line[0])
             ) {
-                addIntermediate(line);
+                addIntermediate(ch, line);
             } else {
                 /* either we already have an intermediate response or
                    the line doesn't begin with a digit */
-                handleUnsolicited(line);
+                handleUnsolicited(ch, line);
             }
             break;
         case SINGLELINE:
-            if (sp_response->p_intermediates == NULL
-                && strStartsWith (line, s_responsePrefix)
+            if (ch->p_response->p_intermediates == NULL
+                && strStartsWith (line, ch->responsePrefix)
             ) {
-                addIntermediate(line);
+                addIntermediate(ch, line);
             } else {
                 /* we already have an intermediate response */
-                handleUnsolicited(line);
+                handleUnsolicited(ch, line);
             }
             break;
         case MULTILINE:
-            if (strStartsWith (line, s_responsePrefix)) {
-                addIntermediate(line);
+            if (strStartsWith (line, ch->responsePrefix)) {
+                addIntermediate(ch, line);
             } else {
-                handleUnsolicited(line);
+                handleUnsolicited(ch, line);
             }
         break;
 
         default: /* this should never be reached */
-            LOGE("Unsupported AT command type %d\n", s_type);
-            handleUnsolicited(line);
+            LOGE("Unsupported AT command type %d\n", ch->type);
+            handleUnsolicited(ch, line);
         break;
     }
 
-    pthread_mutex_unlock(&s_commandmutex);
+    pthread_mutex_unlock(&ch->commandmutex);
 }
 
 
+#define WORD_ONES   (~0UL / 0xff)
+#define WORD_HIGHS  (WORD_ONES * 0x80)
+#define WORD_HAS_ZERO_BYTE(v) (((v) - WORD_ONES) & ~(v) & WORD_HIGHS)
+
 /**
- * Returns a pointer to the end of the next line
- * special-cases the "> " SMS prompt
+ * Returns a pointer to the first \r or \n in [cur, end)
  *
- * returns NULL if there is no complete line
+ * returns NULL if there is none
  */
-static char * findNextEOL(char *cur)
+static char * findEOL(char *cur, const char *end)
 {
-    if (cur[0] == '>' && cur[1] == ' ' && cur[2] == '\0') {
-        /* SMS prompt character...not \r terminated */
-        return cur+2;
+#if defined(__ARM_NEON__)
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+
+    /* 16 bytes at a time until a block holds a \r or \n */
+    for ( ; end - cur >= 16 ; cur += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)cur);
+        uint8x16_t m = vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf));
+        uint32x2_t r = vreinterpret_u32_u8(
+                            vorr_u8(vget_low_u8(m), vget_high_u8(m)));
+
+        if (vget_lane_u32(vpmax_u32(r, r), 0) != 0) {
+            break;
+        }
     }
+#else
+    while (cur < end && ((uintptr_t)cur & (sizeof(unsigned long) - 1)) != 0) {
+        if (*cur == '\r' || *cur == '\n') {
+            return cur;
+        }
+        cur++;
+    }
+
+    /* a word at a time until a word holds a \r or \n */
+    for ( ; (size_t)(end - cur) >= sizeof(unsigned long)
+            ; cur += sizeof(unsigned long)) {
+        unsigned long v = *(const unsigned long *)cur;
 
-    // Find next newline
-    while (*cur != '\0' && *cur != '\r' && *cur != '\n') cur++;
+        if (WORD_HAS_ZERO_BYTE(v ^ (WORD_ONES * '\r'))
+                || WORD_HAS_ZERO_BYTE(v ^ (WORD_ONES * '\n'))) {
+            break;
+        }
+    }
+#endif
+
+    for ( ; cur < end ; cur++) {
+        if (*cur == '\r' || *cur == '\n') {
+            return cur;
+        }
+    }
 
-    return *cur == '\0' ? NULL : cur;
+    return NULL;
 }
 
 
@@ -329,72 +439,64 @@ static char * findNextEOL(char *cur)
  * have buffered stdio.
  */
 
-static const char *readline()
+static const char *readline(ATChannel *ch)
 {
     ssize_t count;
-
-    char *p_read = NULL;
-    char *p_eol = NULL;
+    char *p_eol;
     char *ret;
 
-    /* this is a little odd. I use *s_ATBufferCur == 0 to
-     * mean "buffer consumed completely". If it points to a character, than
-     * the buffer continues until a \0
-     */
-    if (*s_ATBufferCur == '\0') {
-        /* empty buffer */
-        s_ATBufferCur = s_ATBuffer;
-        *s_ATBufferCur = '\0';
-        p_read = s_ATBuffer;
-    } else {   /* *s_ATBufferCur != '\0' */
-        /* there's data in the buffer from the last read */
-
+    for (;;) {
         // skip over leading newlines
-        while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-            s_ATBufferCur++;
-
-        p_eol = findNextEOL(s_ATBufferCur);
+        while (ch->ATBufferCur < ch->ATBufferEnd
+                && (*ch->ATBufferCur == '\r' || *ch->ATBufferCur == '\n')) {
+            ch->ATBufferCur++;
+        }
 
-        if (p_eol == NULL) {
-            /* a partial line. move it up and prepare to read more */
-            size_t len;
+        if (ch->ATBufferCur == ch->ATBufferEnd) {
+            /* empty buffer */
+            ch->ATBufferCur = ch->ATBufferEnd = ch->ATBufferScan = ch->ATBuffer;
+        } else if (ch->ATBufferScan < ch->ATBufferCur) {
+            ch->ATBufferScan = ch->ATBufferCur;
+        }
 
-            len = strlen(s_ATBufferCur);
+        if (ch->ATBufferEnd - ch->ATBufferCur == 2
+                && ch->ATBufferCur[0] == '>' && ch->ATBufferCur[1] == ' ') {
+            /* SMS prompt character...not \r terminated */
+            p_eol = ch->ATBufferEnd;
+            break;
+        }
 
-            memmove(s_ATBuffer, s_ATBufferCur, len + 1);
-            p_read = s_ATBuffer + len;
-            s_ATBufferCur = s_ATBuffer;
+        /* only bytes that arrived since the last search need looking at */
+        p_eol = findEOL(ch->ATBufferScan, ch->ATBufferEnd);
+        if (p_eol != NULL) {
+            break;
         }
-        /* Otherwise, (p_eol !- NULL) there is a complete line  */
-        /* that will be returned the while () loop below        */
-    }
+        ch->ATBufferScan = ch->ATBufferEnd;
+
+        if (ch->ATBufferEnd == ch->ATBuffer + MAX_AT_RESPONSE) {
+            if (ch->ATBufferCur == ch->ATBuffer) {
+                LOGE("ERROR: Input line exceeded buffer\n");
+                /* ditch buffer and start over again */
+                ch->ATBufferCur = ch->ATBufferEnd = ch->ATBufferScan = ch->ATBuffer;
+            } else {
+                /* a partial line at the end. move it up to make room */
+                size_t len = ch->ATBufferEnd - ch->ATBufferCur;
 
-    while (p_eol == NULL) {
-        if (0 == MAX_AT_RESPONSE - (p_read - s_ATBuffer)) {
-            LOGE("ERROR: Input line exceeded buffer\n");
-            /* ditch buffer and start over again */
-            s_ATBufferCur = s_ATBuffer;
-            *s_ATBufferCur = '\0';
-            p_read = s_ATBuffer;
+                memmove(ch->ATBuffer, ch->ATBufferCur, len);
+                ch->ATBufferCur = ch->ATBuffer;
+                ch->ATBufferEnd = ch->ATBufferScan = ch->ATBuffer + len;
+            }
         }
 
         do {
-            count = read(s_fd, p_read,
-                            MAX_AT_RESPONSE - (p_read - s_ATBuffer));
+            count = read(ch->fd, ch->ATBufferEnd,
+                            MAX_AT_RESPONSE - (ch->ATBufferEnd - ch->ATBuffer));
         } while (count < 0 && errno == EINTR);
 
         if (count > 0) {
-            AT_DUMP( "<< ", p_read, count );
-            s_readCount += count;
-
-            p_read[count] = '\0';
-
-            // skip over leading newlines
-            while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-                s_ATBufferCur++;
-
-            p_eol = findNextEOL(s_ATBufferCur);
-            p_read += count;
+            AT_DUMP( "<< ", ch->ATBufferEnd, count );
+            ch->readCount += count;
+            ch->ATBufferEnd += count;
         } else if (count <= 0) {
             /* read error encountered or EOF reached */
             if(count == 0) {
@@ -408,27 +510,27 @@ static const char *readline()
 
     /* a full line in the buffer. Place a \0 over the \r and return */
 
-    ret = s_ATBufferCur;
+    ret = ch->ATBufferCur;
     *p_eol = '\0';
-    s_ATBufferCur = p_eol + 1; /* this will always be <= p_read,    */
-                              /* and there will be a \0 at *p_read */
+    /* the "> " prompt ends at ch->ATBufferEnd rather than on a \r */
+    ch->ATBufferCur = p_eol < ch->ATBufferEnd ? p_eol + 1 : ch->ATBufferEnd;
 
     LOGD("AT< %s\n", ret);
     return ret;
 }
 
 
-static void onReaderClosed()
+static void onReaderClosed(ATChannel *ch)
 {
-    if (s_onReaderClosed != NULL && s_readerClosed == 0) {
+    if (s_onReaderClosed != NULL && ch->readerClosed == 0) {
 
-        pthread_mutex_lock(&s_commandmutex);
+        pthread_mutex_lock(&ch->commandmutex);
 
-        s_readerClosed = 1;
+        ch->readerClosed = 1;
 
-        pthread_cond_signal(&s_commandcond);
+        pthread_cond_signal(&ch->commandcond);
 
-        pthread_mutex_unlock(&s_commandmutex);
+        pthread_mutex_unlock(&ch->commandmutex);
 
         s_onReaderClosed();
     }
@@ -437,16 +539,23 @@ static void onReaderClosed()
 
 static void *readerLoop(void *arg)
 {
+    ATChannel *ch = (ATChannel *)arg;
+
+    pthread_setspecific(s_threadChannelKey, READER_THREAD);
+
     for (;;) {
         const char * line;
+        ATLineClass lineClass;
 
-        line = readline();
+        line = readline(ch);
 
         if (line == NULL) {
             break;
         }
 
-        if(isSMSUnsolicited(line)) {
+        lineClass = classifyLine(line);
+
+        if(lineClass == LINE_SMS_UNSOLICITED) {
             char *line1;
             const char *line2;
 
@@ -454,30 +563,30 @@ static void *readerLoop(void *arg)
             // till next call to 'readline()' hence making a copy of line
             // before calling readline again.
             line1 = strdup(line);
-            line2 = readline();
+            line2 = readline(ch);
 
             if (line2 == NULL) {
                 break;
             }
 
-            if (s_unsolHandler != NULL) {
-                s_unsolHandler (line1, line2);
+            if (ch->unsolHandler != NULL) {
+                ch->unsolHandler (line1, line2);
             }
             free(line1);
         } else {
-            processLine(line);
+            processLine(ch, line, lineClass);
         }
 
 #ifdef HAVE_ANDROID_OS
-        if (s_ackPowerIoctl > 0) {
+        if (ch->ackPowerIoctl > 0) {
             /* acknowledge that bytes have been read and processed */
-            ioctl(s_fd, OMAP_CSMI_TTY_ACK, &s_readCount);
-            s_readCount = 0;
+            ioctl(ch->fd, OMAP_CSMI_TTY_ACK, &ch->readCount);
+            ch->readCount = 0;
         }
 #endif /*HAVE_ANDROID_OS*/
     }
 
-    onReaderClosed();
+    onReaderClosed(ch);
 
     return NULL;
 }
@@ -489,13 +598,13 @@ static void *readerLoop(void *arg)
  * This function exists because as of writing, android libc does not
  * have buffered stdio.
  */
-static int writeline (const char *s)
+static int writeline (ATChannel *ch, const char *s)
 {
     size_t cur = 0;
     size_t len = strlen(s);
     ssize_t written;
 
-    if (s_fd < 0 || s_readerClosed > 0) {
+    if (ch->fd < 0 || ch->readerClosed > 0) {
         return AT_ERROR_CHANNEL_CLOSED;
     }
 
@@ -506,7 +615,7 @@ static int writeline (const char *s)
     /* the main string */
     while (cur < len) {
         do {
-            written = write (s_fd, s + cur, len - cur);
+            written = write (ch->fd, s + cur, len - cur);
         } while (written < 0 && errno == EINTR);
 
         if (written < 0) {
@@ -519,7 +628,7 @@ static int writeline (const char *s)
     /* the \r  */
 
     do {
-        written = write (s_fd, "\r" , 1);
+        written = write (ch->fd, "\r" , 1);
     } while ((written < 0 && errno == EINTR) || (written == 0));
 
     if (written < 0) {
@@ -528,13 +637,13 @@ static int writeline (const char *s)
 
     return 0;
 }
-static int writeCtrlZ (const char *s)
+static int writeCtrlZ (ATChannel *ch, const char *s)
 {
     size_t cur = 0;
     size_t len = strlen(s);
     ssize_t written;
 
-    if (s_fd < 0 || s_readerClosed > 0) {
+    if (ch->fd < 0 || ch->readerClosed > 0) {
         return AT_ERROR_CHANNEL_CLOSED;
     }
 
@@ -545,7 +654,7 @@ static int writeCtrlZ (const char *s)
     /* the main string */
     while (cur < len) {
         do {
-            written = write (s_fd, s + cur, len - cur);
+            written = write (ch->fd, s + cur, len - cur);
         } while (written < 0 && errno == EINTR);
 
         if (written < 0) {
@@ -558,7 +667,7 @@ static int writeCtrlZ (const char *s)
     /* the ^Z  */
 
     do {
-        written = write (s_fd, "\032" , 1);
+        written = write (ch->fd, "\032" , 1);
     } while ((written < 0 && errno == EINTR) || (written == 0));
 
     if (written < 0) {
@@ -568,35 +677,70 @@ static int writeCtrlZ (const char *s)
     return 0;
 }
 
-static void clearPendingCommand()
+static void clearPendingCommand(ATChannel *ch)
 {
-    if (sp_response != NULL) {
-        at_response_free(sp_response);
+    if (ch->p_response != NULL) {
+        at_response_free(ch->p_response);
     }
 
-    sp_response = NULL;
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
+    ch->p_response = NULL;
+    ch->responsePrefix = NULL;
+    ch->smsPDU = NULL;
 }
 
 
+static void makeThreadChannelKey(void)
+{
+    pthread_key_create(&s_threadChannelKey, NULL);
+}
+
 /**
- * Starts AT handler on stream "fd'
+ * Returns the channel commands from this thread go to,
+ * or NULL when called on a reader thread
+ */
+static ATChannel *threadChannel()
+{
+    void *p;
+
+    pthread_once(&s_threadChannelOnce, makeThreadChannelKey);
+
+    p = pthread_getspecific(s_threadChannelKey);
+
+    if (p == READER_THREAD) {
+        return NULL;
+    }
+
+    return p != NULL ? (ATChannel *) p : &s_channels[0];
+}
+
+/**
+ * Starts AT handler on stream "fd" as channel 'channel'
  * returns 0 on success, -1 on error
  */
-int at_open(int fd, ATUnsolHandler h)
+int at_open_channel(int channel, int fd, ATUnsolHandler h)
 {
     int ret;
-    pthread_t tid;
     pthread_attr_t attr;
+    ATChannel *ch;
+
+    if (channel < 0 || channel >= AT_MAX_CHANNELS) {
+        return -1;
+    }
+
+    ch = &s_channels[channel];
+
+    pthread_once(&s_prefixOnce, buildPrefixIndex);
+    pthread_once(&s_threadChannelOnce, makeThreadChannelKey);
+
+    ch->fd = fd;
+    ch->unsolHandler = h;
+    ch->readerClosed = 0;
 
-    s_fd = fd;
-    s_unsolHandler = h;
-    s_readerClosed = 0;
+    ch->ATBufferCur = ch->ATBufferEnd = ch->ATBufferScan = ch->ATBuffer;
 
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
-    sp_response = NULL;
+    ch->responsePrefix = NULL;
+    ch->smsPDU = NULL;
+    ch->p_response = NULL;
 
     /* Android power control ioctl */
 #ifdef HAVE_ANDROID_OS
@@ -620,14 +764,14 @@ int at_open(int fd, ATUnsolHandler h)
             ioctl(fd, OMAP_CSMI_TTY_ACK, &ack_count);
          } while(ack_count > 0 || read_count > 0);
         fcntl(fd, F_SETFL, old_flags);
-        s_readCount = 0;
-        s_ackPowerIoctl = 1;
+        ch->readCount = 0;
+        ch->ackPowerIoctl = 1;
     }
     else
-        s_ackPowerIoctl = 0;
+        ch->ackPowerIoctl = 0;
 
 #else // OMAP_CSMI_POWER_CONTROL
-    s_ackPowerIoctl = 0;
+    ch->ackPowerIoctl = 0;
 
 #endif // OMAP_CSMI_POWER_CONTROL
 #endif /*HAVE_ANDROID_OS*/
@@ -635,7 +779,7 @@ int at_open(int fd, ATUnsolHandler h)
     pthread_attr_init (&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-    ret = pthread_create(&s_tid_reader, &attr, readerLoop, &attr);
+    ret = pthread_create(&ch->tid_reader, &attr, readerLoop, ch);
 
     if (ret < 0) {
         perror ("pthread_create");
@@ -646,25 +790,71 @@ int at_open(int fd, ATUnsolHandler h)
     return 0;
 }
 
-/* FIXME is it ok to call this from the reader and the command thread? */
-void at_close()
+/**
+ * Starts AT handler on stream "fd'
+ * returns 0 on success, -1 on error
+ */
+int at_open(int fd, ATUnsolHandler h)
+{
+    return at_open_channel(0, fd, h);
+}
+
+static void closeChannel(ATChannel *ch)
 {
-    if (s_fd >= 0) {
-        close(s_fd);
+    if (ch->fd >= 0) {
+        close(ch->fd);
     }
-    s_fd = -1;
+    ch->fd = -1;
 
-    pthread_mutex_lock(&s_commandmutex);
+    pthread_mutex_lock(&ch->commandmutex);
 
-    s_readerClosed = 1;
+    ch->readerClosed = 1;
 
-    pthread_cond_signal(&s_commandcond);
+    pthread_cond_signal(&ch->commandcond);
 
-    pthread_mutex_unlock(&s_commandmutex);
+    pthread_mutex_unlock(&ch->commandmutex);
 
     /* the reader thread should eventually die */
 }
 
+/* FIXME is it ok to call this from the reader and the command thread? */
+void at_close()
+{
+    int i;
+
+    for (i = 0 ; i < AT_MAX_CHANNELS ; i++) {
+        closeChannel(&s_channels[i]);
+    }
+}
+
+/**
+ * Sends the AT commands issued from the calling thread to 'channel'
+ * until the next call. Must not be called on a reader thread
+ */
+void at_set_thread_channel(int channel)
+{
+    if (channel < 0 || channel >= AT_MAX_CHANNELS) {
+        return;
+    }
+
+    pthread_once(&s_threadChannelOnce, makeThreadChannelKey);
+    pthread_setspecific(s_threadChannelKey, &s_channels[channel]);
+}
+
+/**
+ * Default timeout for commands on 'channel', 0 means infinite.
+ * A command that times out on channel 0 invokes the at_set_on_timeout()
+ * callback, on other channels it just fails with AT_ERROR_TIMEOUT
+ */
+void at_set_channel_timeout(int channel, long long timeoutMsec)
+{
+    if (channel < 0 || channel >= AT_MAX_CHANNELS) {
+        return;
+    }
+
+    s_channels[channel].timeoutMsec = timeoutMsec;
+}
+
 static ATResponse * at_response_new()
 {
     return (ATResponse *) calloc(1, sizeof(ATResponse));
@@ -718,7 +908,8 @@ static void reverseIntermediates(ATResponse *p_response)
  * timeoutMsec == 0 means infinite timeout
  */
 
-static int at_send_command_full_nolock (const char *command, ATCommandType type,
+static int at_send_command_full_nolock (ATChannel *ch,
+                    const char *command, ATCommandType type,
                     const char *responsePrefix, const char *smspdu,
                     long long timeoutMsec, ATResponse **pp_outResponse)
 {
@@ -727,21 +918,21 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
     struct timespec ts;
 #endif /*USE_NP*/
 
-    if(sp_response != NULL) {
+    if(ch->p_response != NULL) {
         err = AT_ERROR_COMMAND_PENDING;
         goto error;
     }
 
-    err = writeline (command);
+    err = writeline (ch, command);
 
     if (err < 0) {
         goto error;
     }
 
-    s_type = type;
-    s_responsePrefix = responsePrefix;
-    s_smsPDU = smspdu;
-    sp_response = at_response_new();
+    ch->type = type;
+    ch->responsePrefix = responsePrefix;
+    ch->smsPDU = smspdu;
+    ch->p_response = at_response_new();
 
 #ifndef USE_NP
     if (timeoutMsec != 0) {
@@ -749,15 +940,15 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
     }
 #endif /*USE_NP*/
 
-    while (sp_response->finalResponse == NULL && s_readerClosed == 0) {
+    while (ch->p_response->finalResponse == NULL && ch->readerClosed == 0) {
         if (timeoutMsec != 0) {
 #ifdef USE_NP
-            err = pthread_cond_timeout_np(&s_commandcond, &s_commandmutex, timeoutMsec);
+            err = pthread_cond_timeout_np(&ch->commandcond, &ch->commandmutex, timeoutMsec);
 #else
-            err = pthread_cond_timedwait(&s_commandcond, &s_commandmutex, &ts);
+            err = pthread_cond_timedwait(&ch->commandcond, &ch->commandmutex, &ts);
 #endif /*USE_NP*/
         } else {
-            err = pthread_cond_wait(&s_commandcond, &s_commandmutex);
+            err = pthread_cond_wait(&ch->commandcond, &ch->commandmutex);
         }
 
         if (err == ETIMEDOUT) {
@@ -767,53 +958,69 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
     }
 
     if (pp_outResponse == NULL) {
-        at_response_free(sp_response);
+        at_response_free(ch->p_response);
     } else {
         /* line reader stores intermediate responses in reverse order */
-        reverseIntermediates(sp_response);
-        *pp_outResponse = sp_response;
+        reverseIntermediates(ch->p_response);
+        *pp_outResponse = ch->p_response;
     }
 
-    sp_response = NULL;
+    ch->p_response = NULL;
 
-    if(s_readerClosed > 0) {
+    if(ch->readerClosed > 0) {
         err = AT_ERROR_CHANNEL_CLOSED;
         goto error;
     }
 
     err = 0;
 error:
-    clearPendingCommand();
+    clearPendingCommand(ch);
 
     return err;
 }
 
 /**
  * Internal send_command implementation
+ * Sends on the calling thread's channel
  *
- * timeoutMsec == 0 means infinite timeout
+ * timeoutMsec == 0 means the channel's timeout
  */
 static int at_send_command_full (const char *command, ATCommandType type,
                     const char *responsePrefix, const char *smspdu,
                     long long timeoutMsec, ATResponse **pp_outResponse)
 {
     int err;
+    ATChannel *ch;
+
+    ch = threadChannel();
 
-    if (0 != pthread_equal(s_tid_reader, pthread_self())) {
+    if (ch == NULL) {
         /* cannot be called from reader thread */
         return AT_ERROR_INVALID_THREAD;
     }
 
-    pthread_mutex_lock(&s_commandmutex);
+    if (timeoutMsec == 0) {
+        timeoutMsec = ch->timeoutMsec;
+    }
 
-    err = at_send_command_full_nolock(command, type,
+    pthread_mutex_lock(&ch->commandmutex);
+
+    err = at_send_command_full_nolock(ch, command, type,
                     responsePrefix, smspdu,
                     timeoutMsec, pp_outResponse);
 
-    pthread_mutex_unlock(&s_commandmutex);
-
-    if (err == AT_ERROR_TIMEOUT && s_onTimeout != NULL) {
-        s_onTimeout();
+    pthread_mutex_unlock(&ch->commandmutex);
+
+    if (err == AT_ERROR_TIMEOUT) {
+        if (ch != &s_channels[0]) {
+            /* only this command fails, the channel and the modem stay up.
+               A late final response finds nothing pending and goes to the
+               unsolicited handler */
+            LOGW("AT channel %d: '%s' timed out\n",
+                    (int) (ch - s_channels), command);
+        } else if (s_onTimeout != NULL) {
+            s_onTimeout();
+        }
     }
 
     return err;
@@ -922,7 +1129,10 @@ int at_send_command_multiline (const char *command,
 }
 
 
-/** This callback is invoked on the command thread */
+/**
+ * This callback is invoked on the command thread when a command on
+ * channel 0 times out
+ */
 void at_set_on_timeout(void (*onTimeout)(void))
 {
     s_onTimeout = onTimeout;
@@ -950,17 +1160,20 @@ int at_handshake()
 {
     int i;
     int err = 0;
+    ATChannel *ch;
+
+    ch = threadChannel();
 
-    if (0 != pthread_equal(s_tid_reader, pthread_self())) {
+    if (ch == NULL) {
         /* cannot be called from reader thread */
         return AT_ERROR_INVALID_THREAD;
     }
 
-    pthread_mutex_lock(&s_commandmutex);
+    pthread_mutex_lock(&ch->commandmutex);
 
     for (i = 0 ; i < HANDSHAKE_RETRY_COUNT ; i++) {
         /* some stacks start with verbose off */
-        err = at_send_command_full_nolock ("ATE0Q0V1", NO_RESULT,
+        err = at_send_command_full_nolock (ch, "ATE0Q0V1", NO_RESULT,
                     NULL, NULL, HANDSHAKE_TIMEOUT_MSEC, NULL);
 
         if (err == 0) {
@@ -975,7 +1188,7 @@ int at_handshake()
         sleepMsec(HANDSHAKE_TIMEOUT_MSEC);
     }
 
-    pthread_mutex_unlock(&s_commandmutex);
+    pthread_mutex_unlock(&ch->commandmutex);
 
     return err;
 }
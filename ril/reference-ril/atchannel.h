@@ -31,6 +31,9 @@ extern void  AT_DUMP(const char* prefix, const char*  buff, int  len);
 #define  AT_DUMP(prefix,buff,len)  do{}while(0)
 #endif
 
+/* number of AT ports that can be driven at once */
+#define AT_MAX_CHANNELS 4
+
 #define AT_ERROR_GENERIC -1
 #define AT_ERROR_COMMAND_PENDING -2
 #define AT_ERROR_CHANNEL_CLOSED -3
@@ -74,9 +77,24 @@ typedef struct {
 typedef void (*ATUnsolHandler)(const char *s, const char *sms_pdu);
 
 int at_open(int fd, ATUnsolHandler h);
+/* at_open() opens channel 0. Further channels carry their own commands
+   and are read by their own reader threads */
+int at_open_channel(int channel, int fd, ATUnsolHandler h);
+/* closes every open channel */
 void at_close();
 
-/* This callback is invoked on the command thread.
+/* AT commands issued by the calling thread go to 'channel' from now on.
+   Threads that never call this use channel 0 */
+void at_set_thread_channel(int channel);
+
+/* default command timeout for 'channel' in msec, 0 (the default) means
+   wait forever. A timeout on channel 0 invokes the at_set_on_timeout()
+   callback, on other channels only that command fails with
+   AT_ERROR_TIMEOUT */
+void at_set_channel_timeout(int channel, long long timeoutMsec);
+
+/* This callback is invoked on the command thread when a command on
+   channel 0 times out.
    You should reset or handshake here to avoid getting out of sync */
 void at_set_on_timeout(void (*onTimeout)(void));
 /* This callback is invoked on the reader thread (like ATUnsolHandler)
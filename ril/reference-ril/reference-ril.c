@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <alloca.h>
 #include "atchannel.h"
 #include "at_tok.h"
@@ -69,6 +70,7 @@ typedef enum {
 } SIM_Status;
 
 static void onRequest (int request, void *data, size_t datalen, RIL_Token t);
+static void processRequest (int request, void *data, size_t datalen, RIL_Token t);
 static RIL_RadioState currentState();
 static int onSupports (int requestCode);
 static void onCancel (RIL_Token t);
@@ -108,6 +110,18 @@ static int s_port = -1;
 static const char * s_device_path = NULL;
 static int          s_device_socket = 0;
 
+/* additional AT ports (-c), opened as channels 1 and up */
+static const char * s_channel_paths[AT_MAX_CHANNELS - 1];
+static int          s_channel_path_count = 0;
+
+/* number of AT channels currently open, including the main one */
+static int s_channelCount = 1;
+
+/* the modem may take minutes over a network scan, but a command on an
+   extra channel that stays unanswered longer than this fails. Unlike a
+   timeout on the main channel it does not reset the modem */
+#define CHANNEL_TIMEOUT_MSEC (180 * 1000)
+
 /* trigger change to this with s_state_cond */
 static int s_closed = 0;
 
@@ -135,6 +149,400 @@ static int s_expectAnswer = 0;
 static void pollSIMState (void *param);
 static void setRadioState(RIL_RadioState newState);
 
+/*** Query result cache ***/
+
+/*
+ * The framework polls signal strength, registration, operator and the
+ * call list far more often than they change. A query that arrives while
+ * the same query is already being run waits for that result instead of
+ * issuing its own AT commands, and a successful result is reused until
+ * its TTL runs out or a matching unsolicited response or state changing
+ * request invalidates it.
+ */
+
+#define QUERY_CACHE_LOG_INTERVAL 256
+
+static size_t stringSize(const char *s)
+{
+    return s == NULL ? 0 : strlen(s) + 1;
+}
+
+static char *copyString(char **p_cur, const char *s)
+{
+    char *ret;
+
+    if (s == NULL) {
+        return NULL;
+    }
+
+    ret = *p_cur;
+    strcpy(ret, s);
+    *p_cur += strlen(s) + 1;
+
+    return ret;
+}
+
+/**
+ * Copies an array of 'count' strings, some possibly NULL, into one
+ * allocation. Free with free()
+ */
+static char **copyStrings(const char **strings, size_t count)
+{
+    size_t size;
+    char **ret;
+    char *cur;
+    size_t i;
+
+    size = count * sizeof(char *);
+    for (i = 0 ; i < count ; i++) {
+        size += stringSize(strings[i]);
+    }
+
+    ret = (char **) malloc(size);
+    cur = (char *)(ret + count);
+
+    for (i = 0 ; i < count ; i++) {
+        ret[i] = copyString(&cur, strings[i]);
+    }
+
+    return ret;
+}
+
+
+typedef struct QueryWaiter {
+    struct QueryWaiter *p_next;
+    RIL_Token t;
+} QueryWaiter;
+
+typedef struct {
+    int request;
+    long long ttlMsec;
+
+    /* the request currently fetching this entry, and who waits for it */
+    int pending;
+    RIL_Token owner;
+    QueryWaiter *p_waiters;
+
+    /* bumped by every invalidation; a fetch that started before one
+       does not get cached */
+    unsigned int generation;
+    unsigned int fetchGeneration;
+
+    long long expiresMsec;    /* 0 if nothing is cached */
+    void *response;
+    size_t responselen;
+
+    unsigned int hits;
+    unsigned int coalesced;
+    unsigned int misses;
+    unsigned int invalidations;
+} QueryCacheEntry;
+
+enum {
+    QUERY_SIGNAL_STRENGTH,
+    QUERY_VOICE_REGISTRATION_STATE,
+    QUERY_DATA_REGISTRATION_STATE,
+    QUERY_OPERATOR,
+    QUERY_CURRENT_CALLS,
+    QUERY_COUNT
+};
+
+#define QUERY_BIT(query) (1 << (query))
+#define QUERY_ALL ((1 << QUERY_COUNT) - 1)
+#define QUERY_NETWORK (QUERY_BIT(QUERY_VOICE_REGISTRATION_STATE) \
+                       | QUERY_BIT(QUERY_DATA_REGISTRATION_STATE) \
+                       | QUERY_BIT(QUERY_OPERATOR))
+
+static QueryCacheEntry s_queryCache[QUERY_COUNT] = {
+    { RIL_REQUEST_SIGNAL_STRENGTH, 3000 },
+    { RIL_REQUEST_VOICE_REGISTRATION_STATE, 5000 },
+    { RIL_REQUEST_DATA_REGISTRATION_STATE, 5000 },
+    { RIL_REQUEST_OPERATOR, 5000 },
+    /* call state also changes without notice while dialing,
+       see sendCallStateChanged() */
+    { RIL_REQUEST_GET_CURRENT_CALLS, 1000 },
+};
+
+static pthread_mutex_t s_queryCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_queryCacheEnabled = 1;
+static unsigned int s_queryLookups = 0;
+
+static long long monotonicMsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static QueryCacheEntry *findQuery(int request)
+{
+    int i;
+
+    for (i = 0 ; i < QUERY_COUNT ; i++) {
+        if (s_queryCache[i].request == request) {
+            return &s_queryCache[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void *copyQueryResponse(int request, const void *response,
+                                size_t responselen)
+{
+    void *ret;
+
+    if (response == NULL) {
+        return NULL;
+    }
+
+    switch (request) {
+        case RIL_REQUEST_VOICE_REGISTRATION_STATE:
+        case RIL_REQUEST_DATA_REGISTRATION_STATE:
+        case RIL_REQUEST_OPERATOR:
+            return copyStrings((const char **)response,
+                                responselen / sizeof(char *));
+
+        case RIL_REQUEST_GET_CURRENT_CALLS: {
+            RIL_Call * const *pp_calls = (RIL_Call * const *)response;
+            size_t count = responselen / sizeof(RIL_Call *);
+            RIL_Call **pp_copy;
+            RIL_Call *p_call;
+            size_t size;
+            char *cur;
+            size_t i;
+
+            size = count * (sizeof(RIL_Call *) + sizeof(RIL_Call));
+            for (i = 0 ; i < count ; i++) {
+                size += stringSize(pp_calls[i]->number)
+                        + stringSize(pp_calls[i]->name);
+            }
+
+            pp_copy = (RIL_Call **) malloc(size);
+            p_call = (RIL_Call *)(pp_copy + count);
+            cur = (char *)(p_call + count);
+
+            for (i = 0 ; i < count ; i++, p_call++) {
+                *p_call = *pp_calls[i];
+                p_call->number = copyString(&cur, pp_calls[i]->number);
+                p_call->name = copyString(&cur, pp_calls[i]->name);
+                /* reference-ril never reports UUS information */
+                p_call->uusInfo = NULL;
+                pp_copy[i] = p_call;
+            }
+
+            return pp_copy;
+        }
+
+        default:
+            ret = malloc(responselen);
+            memcpy(ret, response, responselen);
+            return ret;
+    }
+}
+
+static void logQueryCacheStats()
+{
+    int i;
+
+    for (i = 0 ; i < QUERY_COUNT ; i++) {
+        QueryCacheEntry *p_entry = &s_queryCache[i];
+        unsigned int total;
+
+        total = p_entry->hits + p_entry->coalesced + p_entry->misses;
+
+        LOGI("query cache %s: %u hits, %u coalesced, %u misses (%u%% saved), "
+                "%u invalidations",
+                requestToString(p_entry->request),
+                p_entry->hits, p_entry->coalesced, p_entry->misses,
+                total ? (p_entry->hits + p_entry->coalesced) * 100 / total : 0,
+                p_entry->invalidations);
+    }
+}
+
+/**
+ * Answers 'request' from the cache or attaches it to an identical
+ * request in flight.
+ *
+ * Returns 1 if 't' has been taken care of, 0 if the caller has to run
+ * the request, which must then complete through queryCacheComplete()
+ */
+static int queryCacheLookup(int request, RIL_Token t)
+{
+    QueryCacheEntry *p_entry;
+    QueryWaiter *p_waiter;
+    int hit = 0;
+    void *p_hit = NULL;
+    size_t hitlen = 0;
+    int ret = 0;
+
+    if (!s_queryCacheEnabled) {
+        return 0;
+    }
+
+    p_entry = findQuery(request);
+
+    if (p_entry == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&s_queryCacheMutex);
+
+    if (p_entry->expiresMsec > monotonicMsec()) {
+        /* completed below, RIL_onRequestComplete() is not called with
+           the mutex held */
+        p_entry->hits++;
+        hit = 1;
+        p_hit = copyQueryResponse(request, p_entry->response,
+                                    p_entry->responselen);
+        hitlen = p_entry->responselen;
+        ret = 1;
+    } else if (p_entry->pending) {
+        p_waiter = (QueryWaiter *) malloc(sizeof(QueryWaiter));
+        p_waiter->t = t;
+        p_waiter->p_next = p_entry->p_waiters;
+        p_entry->p_waiters = p_waiter;
+
+        p_entry->coalesced++;
+        ret = 1;
+    } else {
+        p_entry->pending = 1;
+        p_entry->owner = t;
+        p_entry->fetchGeneration = p_entry->generation;
+
+        p_entry->misses++;
+    }
+
+    if (++s_queryLookups % QUERY_CACHE_LOG_INTERVAL == 0) {
+        logQueryCacheStats();
+    }
+
+    pthread_mutex_unlock(&s_queryCacheMutex);
+
+    if (hit) {
+        RIL_onRequestComplete(t, RIL_E_SUCCESS, p_hit, hitlen);
+        free(p_hit);
+    }
+
+    return ret;
+}
+
+/**
+ * RIL_onRequestComplete() for the cached queries. Hands the result to
+ * every request that waited for it and keeps a copy if it is still
+ * current
+ */
+static void queryCacheComplete(RIL_Token t, RIL_Errno e,
+                                void *response, size_t responselen)
+{
+    QueryCacheEntry *p_entry = NULL;
+    QueryWaiter *p_waiters = NULL;
+    QueryWaiter *p_next;
+    int i;
+
+    pthread_mutex_lock(&s_queryCacheMutex);
+
+    for (i = 0 ; i < QUERY_COUNT ; i++) {
+        if (s_queryCache[i].pending && s_queryCache[i].owner == t) {
+            p_entry = &s_queryCache[i];
+            break;
+        }
+    }
+
+    if (p_entry != NULL) {
+        p_waiters = p_entry->p_waiters;
+        p_entry->p_waiters = NULL;
+        p_entry->pending = 0;
+        p_entry->owner = NULL;
+
+        if (e == RIL_E_SUCCESS
+                && p_entry->generation == p_entry->fetchGeneration) {
+            free(p_entry->response);
+            p_entry->response = copyQueryResponse(p_entry->request,
+                                                    response, responselen);
+            p_entry->responselen = responselen;
+            p_entry->expiresMsec = monotonicMsec() + p_entry->ttlMsec;
+        }
+    }
+
+    pthread_mutex_unlock(&s_queryCacheMutex);
+
+    RIL_onRequestComplete(t, e, response, responselen);
+
+    for ( ; p_waiters != NULL ; p_waiters = p_next) {
+        p_next = p_waiters->p_next;
+        RIL_onRequestComplete(p_waiters->t, e, response, responselen);
+        free(p_waiters);
+    }
+}
+
+/* drops the cached results selected by 'queries', a set of QUERY_BIT()s */
+static void queryCacheInvalidate(int queries)
+{
+    int i;
+
+    pthread_mutex_lock(&s_queryCacheMutex);
+
+    for (i = 0 ; i < QUERY_COUNT ; i++) {
+        if (queries & QUERY_BIT(i)) {
+            QueryCacheEntry *p_entry = &s_queryCache[i];
+
+            p_entry->generation++;
+
+            if (p_entry->expiresMsec != 0) {
+                p_entry->invalidations++;
+            }
+
+            p_entry->expiresMsec = 0;
+            free(p_entry->response);
+            p_entry->response = NULL;
+            p_entry->responselen = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&s_queryCacheMutex);
+}
+
+/* the cached queries whose answer 'request' may change */
+static int queriesChangedBy(int request)
+{
+    switch (request) {
+        case RIL_REQUEST_DIAL:
+        case RIL_REQUEST_HANGUP:
+        case RIL_REQUEST_HANGUP_WAITING_OR_BACKGROUND:
+        case RIL_REQUEST_HANGUP_FOREGROUND_RESUME_BACKGROUND:
+        case RIL_REQUEST_SWITCH_WAITING_OR_HOLDING_AND_ACTIVE:
+        case RIL_REQUEST_ANSWER:
+        case RIL_REQUEST_CONFERENCE:
+        case RIL_REQUEST_UDUB:
+        case RIL_REQUEST_SEPARATE_CONNECTION:
+            return QUERY_BIT(QUERY_CURRENT_CALLS);
+
+        case RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC:
+        case RIL_REQUEST_SETUP_DATA_CALL:
+            return QUERY_NETWORK;
+
+        case RIL_REQUEST_RADIO_POWER:
+            return QUERY_ALL;
+
+        default:
+            return 0;
+    }
+}
+
+static void initQueryCache()
+{
+    char value[PROP_VALUE_MAX];
+
+    if (__system_property_get("ril.query_cache", value) > 0
+            && !strcmp(value, "0")) {
+        LOGI("query cache disabled\n");
+        s_queryCacheEnabled = 0;
+    }
+}
+
 static int clccStateToRILState(int state, RIL_CallState *p_state)
 
 {
@@ -523,6 +931,8 @@ error:
 
 static void sendCallStateChanged(void *param)
 {
+    queryCacheInvalidate(QUERY_BIT(QUERY_CURRENT_CALLS));
+
     RIL_onUnsolicitedResponse (
         RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
         NULL, 0);
@@ -550,7 +960,7 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
     err = at_send_command_multiline ("AT+CLCC", "+CLCC:", &p_response);
 
     if (err != 0 || p_response->success == 0) {
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        queryCacheComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
         return;
     }
 
@@ -631,7 +1041,7 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
     s_repollCallsCount = 0;
 #endif /*WORKAROUND_ERRONEOUS_ANSWER*/
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, pp_calls,
+    queryCacheComplete(t, RIL_E_SUCCESS, pp_calls,
             countValidCalls * sizeof (RIL_Call *));
 
     at_response_free(p_response);
@@ -647,7 +1057,7 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t)
 
     return;
 error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    queryCacheComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
 }
 
@@ -736,7 +1146,6 @@ static void requestSignalStrength(void *data, size_t datalen, RIL_Token t)
     err = at_send_command_singleline("AT+CSQ", "+CSQ:", &p_response);
 
     if (err < 0 || p_response->success == 0) {
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
         goto error;
     }
 
@@ -751,14 +1160,14 @@ static void requestSignalStrength(void *data, size_t datalen, RIL_Token t)
     err = at_tok_nextint(&line, &(response[1]));
     if (err < 0) goto error;
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
+    queryCacheComplete(t, RIL_E_SUCCESS, response, sizeof(response));
 
     at_response_free(p_response);
     return;
 
 error:
     LOGE("requestSignalStrength must never return an error when radio is on");
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    queryCacheComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
 }
 
@@ -887,13 +1296,13 @@ static void requestRegistrationState(int request, void *data,
     if (count > 3)
         asprintf(&responseStr[3], "%d", response[3]);
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, responseStr, count*sizeof(char*));
+    queryCacheComplete(t, RIL_E_SUCCESS, responseStr, count*sizeof(char*));
     at_response_free(p_response);
 
     return;
 error:
     LOGE("requestRegistrationState must never return an error when radio is on");
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    queryCacheComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
 }
 
@@ -958,13 +1367,13 @@ static void requestOperator(void *data, size_t datalen, RIL_Token t)
         goto error;
     }
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
+    queryCacheComplete(t, RIL_E_SUCCESS, response, sizeof(response));
     at_response_free(p_response);
 
     return;
 error:
     LOGE("requestOperator must not return error when radio is on");
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    queryCacheComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
 }
 
@@ -1253,6 +1662,268 @@ static void  requestSendUSSD(void *data, size_t datalen, RIL_Token t)
 }
 
 
+/*** Request scheduling across AT channels ***/
+
+/*
+ * With more than one AT channel (-c), requests are grouped by the
+ * kind of work they do and each group is served by a worker thread on
+ * its own channel, so that e.g. a slow network query does not hold up
+ * call control. Requests in the same group still run in order.
+ */
+typedef enum {
+    REQUEST_CLASS_CALL,     /* call control and radio power */
+    REQUEST_CLASS_SMS,
+    REQUEST_CLASS_DATA,
+    REQUEST_CLASS_QUERY     /* SIM, network and everything else */
+} RequestClass;
+
+typedef struct RequestJob {
+    struct RequestJob *p_next;
+    int request;
+    void *data;
+    size_t datalen;
+    RIL_Token t;
+} RequestJob;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    RequestJob *p_head;
+    RequestJob *p_tail;
+} RequestQueue;
+
+static RequestQueue s_requestQueues[AT_MAX_CHANNELS];
+
+static RequestClass requestClass(int request)
+{
+    switch (request) {
+        case RIL_REQUEST_GET_CURRENT_CALLS:
+        case RIL_REQUEST_DIAL:
+        case RIL_REQUEST_HANGUP:
+        case RIL_REQUEST_HANGUP_WAITING_OR_BACKGROUND:
+        case RIL_REQUEST_HANGUP_FOREGROUND_RESUME_BACKGROUND:
+        case RIL_REQUEST_SWITCH_WAITING_OR_HOLDING_AND_ACTIVE:
+        case RIL_REQUEST_ANSWER:
+        case RIL_REQUEST_CONFERENCE:
+        case RIL_REQUEST_UDUB:
+        case RIL_REQUEST_SEPARATE_CONNECTION:
+        case RIL_REQUEST_DTMF:
+        case RIL_REQUEST_RADIO_POWER:
+            return REQUEST_CLASS_CALL;
+
+        case RIL_REQUEST_SEND_SMS:
+        case RIL_REQUEST_SMS_ACKNOWLEDGE:
+        case RIL_REQUEST_WRITE_SMS_TO_SIM:
+        case RIL_REQUEST_DELETE_SMS_ON_SIM:
+            return REQUEST_CLASS_SMS;
+
+        case RIL_REQUEST_SETUP_DATA_CALL:
+        case RIL_REQUEST_DATA_CALL_LIST:
+            return REQUEST_CLASS_DATA;
+
+        default:
+            return REQUEST_CLASS_QUERY;
+    }
+}
+
+/* classes beyond the last open channel share it */
+static int channelForClass(RequestClass requestClass)
+{
+    int channel = (int) requestClass;
+
+    return channel < s_channelCount ? channel : s_channelCount - 1;
+}
+
+/**
+ * Returns a copy of the request arguments in one allocation, for
+ * running the request after libril has freed the original.
+ * Free with free()
+ */
+static void *copyRequestData(int request, const void *data, size_t datalen)
+{
+    size_t size;
+    char *ret;
+    char *cur;
+
+    if (data == NULL) {
+        return NULL;
+    }
+
+    switch (request) {
+        case RIL_REQUEST_DIAL: {
+            const RIL_Dial *p_dial = (const RIL_Dial *)data;
+            RIL_Dial *p_copy;
+
+            size = sizeof(RIL_Dial) + stringSize(p_dial->address);
+            if (p_dial->uusInfo != NULL) {
+                size += sizeof(RIL_UUS_Info) + p_dial->uusInfo->uusLength;
+            }
+
+            ret = malloc(size);
+            p_copy = (RIL_Dial *)ret;
+            cur = ret + sizeof(RIL_Dial);
+
+            *p_copy = *p_dial;
+            if (p_dial->uusInfo != NULL) {
+                p_copy->uusInfo = (RIL_UUS_Info *)cur;
+                *p_copy->uusInfo = *p_dial->uusInfo;
+                cur += sizeof(RIL_UUS_Info);
+
+                if (p_dial->uusInfo->uusData != NULL) {
+                    p_copy->uusInfo->uusData = cur;
+                    memcpy(cur, p_dial->uusInfo->uusData,
+                            p_dial->uusInfo->uusLength);
+                    cur += p_dial->uusInfo->uusLength;
+                }
+            }
+            p_copy->address = copyString(&cur, p_dial->address);
+
+            return ret;
+        }
+
+        case RIL_REQUEST_SIM_IO: {
+            const RIL_SIM_IO_v6 *p_args = (const RIL_SIM_IO_v6 *)data;
+            RIL_SIM_IO_v6 *p_copy;
+
+            size = sizeof(RIL_SIM_IO_v6) + stringSize(p_args->path)
+                    + stringSize(p_args->data) + stringSize(p_args->pin2)
+                    + stringSize(p_args->aidPtr);
+
+            ret = malloc(size);
+            p_copy = (RIL_SIM_IO_v6 *)ret;
+            cur = ret + sizeof(RIL_SIM_IO_v6);
+
+            *p_copy = *p_args;
+            p_copy->path = copyString(&cur, p_args->path);
+            p_copy->data = copyString(&cur, p_args->data);
+            p_copy->pin2 = copyString(&cur, p_args->pin2);
+            p_copy->aidPtr = copyString(&cur, p_args->aidPtr);
+
+            return ret;
+        }
+
+        case RIL_REQUEST_WRITE_SMS_TO_SIM: {
+            const RIL_SMS_WriteArgs *p_args = (const RIL_SMS_WriteArgs *)data;
+            RIL_SMS_WriteArgs *p_copy;
+
+            size = sizeof(RIL_SMS_WriteArgs) + stringSize(p_args->pdu)
+                    + stringSize(p_args->smsc);
+
+            ret = malloc(size);
+            p_copy = (RIL_SMS_WriteArgs *)ret;
+            cur = ret + sizeof(RIL_SMS_WriteArgs);
+
+            *p_copy = *p_args;
+            p_copy->pdu = copyString(&cur, p_args->pdu);
+            p_copy->smsc = copyString(&cur, p_args->smsc);
+
+            return ret;
+        }
+
+        /* a single string */
+        case RIL_REQUEST_DTMF:
+        case RIL_REQUEST_SEND_USSD:
+            return strdup((const char *)data);
+
+        /* an array of strings */
+        case RIL_REQUEST_SEND_SMS:
+        case RIL_REQUEST_SETUP_DATA_CALL:
+        case RIL_REQUEST_ENTER_SIM_PIN:
+        case RIL_REQUEST_ENTER_SIM_PUK:
+        case RIL_REQUEST_ENTER_SIM_PIN2:
+        case RIL_REQUEST_ENTER_SIM_PUK2:
+        case RIL_REQUEST_CHANGE_SIM_PIN:
+        case RIL_REQUEST_CHANGE_SIM_PIN2:
+        case RIL_REQUEST_OEM_HOOK_STRINGS:
+            return copyStrings((const char **)data, datalen / sizeof(char *));
+
+        /* everything else is flat: ints or raw bytes */
+        default:
+            ret = malloc(datalen);
+            memcpy(ret, data, datalen);
+            return ret;
+    }
+}
+
+static void *requestWorkerLoop(void *param)
+{
+    int channel = (int)(intptr_t)param;
+    RequestQueue *p_queue = &s_requestQueues[channel];
+    RequestJob *p_job;
+
+    at_set_thread_channel(channel);
+
+    for (;;) {
+        pthread_mutex_lock(&p_queue->mutex);
+
+        while (p_queue->p_head == NULL) {
+            pthread_cond_wait(&p_queue->cond, &p_queue->mutex);
+        }
+
+        p_job = p_queue->p_head;
+        p_queue->p_head = p_job->p_next;
+        if (p_queue->p_head == NULL) {
+            p_queue->p_tail = NULL;
+        }
+
+        pthread_mutex_unlock(&p_queue->mutex);
+
+        processRequest(p_job->request, p_job->data, p_job->datalen, p_job->t);
+
+        free(p_job->data);
+        free(p_job);
+    }
+
+    return NULL;
+}
+
+static void queueRequest(int channel, int request, void *data,
+                            size_t datalen, RIL_Token t)
+{
+    RequestQueue *p_queue = &s_requestQueues[channel];
+    RequestJob *p_job;
+
+    p_job = (RequestJob *) malloc(sizeof(RequestJob));
+    p_job->p_next = NULL;
+    p_job->request = request;
+    p_job->data = copyRequestData(request, data, datalen);
+    p_job->datalen = datalen;
+    p_job->t = t;
+
+    pthread_mutex_lock(&p_queue->mutex);
+
+    if (p_queue->p_tail == NULL) {
+        p_queue->p_head = p_job;
+    } else {
+        p_queue->p_tail->p_next = p_job;
+    }
+    p_queue->p_tail = p_job;
+
+    pthread_cond_signal(&p_queue->cond);
+    pthread_mutex_unlock(&p_queue->mutex);
+}
+
+/* one worker per channel, they outlive channel close and reopen */
+static void startRequestWorkers(int count)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    int i;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (i = 0 ; i < count ; i++) {
+        pthread_mutex_init(&s_requestQueues[i].mutex, NULL);
+        pthread_cond_init(&s_requestQueues[i].cond, NULL);
+        s_requestQueues[i].p_head = NULL;
+        s_requestQueues[i].p_tail = NULL;
+
+        pthread_create(&tid, &attr, requestWorkerLoop, (void *)(intptr_t)i);
+    }
+}
+
+
 /*** Callback methods from the RIL library to us ***/
 
 /**
@@ -1270,9 +1941,6 @@ static void  requestSendUSSD(void *data, size_t datalen, RIL_Token t)
 static void
 onRequest (int request, void *data, size_t datalen, RIL_Token t)
 {
-    ATResponse *p_response;
-    int err;
-
     LOGD("onRequest: %s", requestToString(request));
 
     /* Ignore all requests except RIL_REQUEST_GET_SIM_STATUS
@@ -1296,6 +1964,27 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
         return;
     }
 
+    if (queryCacheLookup(request, t)) {
+        return;
+    }
+
+    if (s_channelCount > 1) {
+        queueRequest(channelForClass(requestClass(request)),
+                        request, data, datalen, t);
+    } else {
+        processRequest(request, data, datalen, t);
+    }
+}
+
+/**
+ * Runs a request on the calling thread's AT channel
+ */
+static void
+processRequest (int request, void *data, size_t datalen, RIL_Token t)
+{
+    ATResponse *p_response;
+    int err;
+
     switch (request) {
         case RIL_REQUEST_GET_SIM_STATUS: {
             RIL_CardStatus_v6 *p_card_status;
@@ -1551,6 +2240,10 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
             RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
             break;
     }
+
+    if (queriesChangedBy(request) != 0) {
+        queryCacheInvalidate(queriesChangedBy(request));
+    }
 }
 
 /**
@@ -1617,6 +2310,8 @@ setRadioState(RIL_RadioState newState)
 
     /* do these outside of the mutex */
     if (sState != oldState) {
+        queryCacheInvalidate(QUERY_ALL);
+
         RIL_onUnsolicitedResponse (RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED,
                                     NULL, 0);
 
@@ -1855,6 +2550,27 @@ error:
     return -1;
 }
 
+/**
+ * Per-port settings for the additional AT channels. Unsolicited
+ * notifications stay enabled on the main channel only
+ */
+static void initializeChannels()
+{
+    int i;
+
+    for (i = 1 ; i < s_channelCount ; i++) {
+        at_set_thread_channel(i);
+
+        at_handshake();
+
+        at_send_command("ATE0Q0V1", NULL);
+        at_send_command("AT+CMEE=1", NULL);
+        at_send_command("AT+CMGF=0", NULL);
+    }
+
+    at_set_thread_channel(0);
+}
+
 /**
  * Initialize everything that can be configured while we're still in
  * AT+CFUN=0
@@ -1931,6 +2647,8 @@ static void initializeCallback(void *param)
 #endif /* USE_TI_COMMANDS */
 
 
+    initializeChannels();
+
     /* assume radio is off on error */
     if (isRadioOn() > 0) {
         setRadioState (RADIO_STATE_SIM_NOT_READY);
@@ -1986,6 +2704,7 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
                 || strStartsWith(s,"NO CARRIER")
                 || strStartsWith(s,"+CCWA")
     ) {
+        queryCacheInvalidate(QUERY_BIT(QUERY_CURRENT_CALLS));
         RIL_onUnsolicitedResponse (
             RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
             NULL, 0);
@@ -1995,6 +2714,7 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
     } else if (strStartsWith(s,"+CREG:")
                 || strStartsWith(s,"+CGREG:")
     ) {
+        queryCacheInvalidate(QUERY_NETWORK);
         RIL_onUnsolicitedResponse (
             RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED,
             NULL, 0);
@@ -2009,7 +2729,10 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
         RIL_onUnsolicitedResponse (
             RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT,
             sms_pdu, strlen(sms_pdu));
+    } else if (strStartsWith(s, "+CSQ:")) {
+        queryCacheInvalidate(QUERY_BIT(QUERY_SIGNAL_STRENGTH));
     } else if (strStartsWith(s, "+CGEV:")) {
+        queryCacheInvalidate(QUERY_BIT(QUERY_DATA_REGISTRATION_STATE));
         /* Really, we can ignore NW CLASS and ME CLASS events here,
          * but right now we don't since extranous
          * RIL_UNSOL_DATA_CALL_LIST_CHANGED calls are tolerated
@@ -2033,7 +2756,7 @@ static void onATReaderClosed()
     setRadioState (RADIO_STATE_UNAVAILABLE);
 }
 
-/* Called on command thread */
+/* Called on command thread, only for commands on the main channel */
 static void onATTimeout()
 {
     LOGI("AT channel timeout; closing\n");
@@ -2049,13 +2772,76 @@ static void onATTimeout()
 static void usage(char *s)
 {
 #ifdef RIL_SHLIB
-    fprintf(stderr, "reference-ril requires: -p <tcp port> or -d /dev/tty_device\n");
+    fprintf(stderr, "reference-ril requires: -p <tcp port> or -d /dev/tty_device\n"
+                    "  optionally -c /dev/tty_device for each extra AT port\n");
 #else
-    fprintf(stderr, "usage: %s [-p <tcp port>] [-d /dev/tty_device]\n", s);
+    fprintf(stderr, "usage: %s [-p <tcp port>] [-d /dev/tty_device] [-c /dev/tty_device]...\n", s);
     exit(-1);
 #endif
 }
 
+static int openTtyDevice(const char *path)
+{
+    int fd;
+
+    fd = open (path, O_RDWR);
+    if ( fd >= 0 && !memcmp( path, "/dev/ttyS", 9 ) ) {
+        /* disable echo on serial ports */
+        struct termios  ios;
+        tcgetattr( fd, &ios );
+        ios.c_lflag = 0;  /* disable ECHO, ICANON, etc... */
+        tcsetattr( fd, TCSANOW, &ios );
+    }
+
+    return fd;
+}
+
+/**
+ * Opens the -c ports as channels 1 and up. A port that fails to open
+ * leaves it and the ones after it unused until the next reopen
+ */
+static void openExtraChannels()
+{
+    int fd;
+    int i;
+
+    s_channelCount = 1;
+
+    for (i = 0 ; i < s_channel_path_count ; i++) {
+        fd = openTtyDevice(s_channel_paths[i]);
+
+        if (fd < 0) {
+            LOGE("could not open AT channel %s: %s\n",
+                    s_channel_paths[i], strerror(errno));
+            break;
+        }
+
+        if (at_open_channel(i + 1, fd, onUnsolicited) < 0) {
+            LOGE("AT error on at_open_channel %s\n", s_channel_paths[i]);
+            close(fd);
+            break;
+        }
+
+        at_set_channel_timeout(i + 1, CHANNEL_TIMEOUT_MSEC);
+        s_channelCount++;
+    }
+
+    LOGI("%d AT channel(s) open\n", s_channelCount);
+}
+
+static int addChannelPath(const char *path)
+{
+    if (s_channel_path_count >= AT_MAX_CHANNELS - 1) {
+        LOGE("too many AT channels, ignoring %s\n", path);
+        return -1;
+    }
+
+    s_channel_paths[s_channel_path_count++] = path;
+    LOGI("Opening extra AT channel %s\n", path);
+
+    return 0;
+}
+
 static void *
 mainLoop(void *param)
 {
@@ -2101,14 +2887,7 @@ mainLoop(void *param)
                                             ANDROID_SOCKET_NAMESPACE_FILESYSTEM,
                                             SOCK_STREAM );
             } else if (s_device_path != NULL) {
-                fd = open (s_device_path, O_RDWR);
-                if ( fd >= 0 && !memcmp( s_device_path, "/dev/ttyS", 9 ) ) {
-                    /* disable echo on serial ports */
-                    struct termios  ios;
-                    tcgetattr( fd, &ios );
-                    ios.c_lflag = 0;  /* disable ECHO, ICANON, etc... */
-                    tcsetattr( fd, TCSANOW, &ios );
-                }
+                fd = openTtyDevice(s_device_path);
             }
 
             if (fd < 0) {
@@ -2126,6 +2905,8 @@ mainLoop(void *param)
             return 0;
         }
 
+        openExtraChannels();
+
         RIL_requestTimedCallback(initializeCallback, NULL, &TIMEVAL_0);
 
         // Give initializeCallback a chance to dispatched, since
@@ -2150,7 +2931,7 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
 
     s_rilenv = env;
 
-    while ( -1 != (opt = getopt(argc, argv, "p:d:s:"))) {
+    while ( -1 != (opt = getopt(argc, argv, "p:d:s:c:"))) {
         switch (opt) {
             case 'p':
                 s_port = atoi(optarg);
@@ -2172,6 +2953,10 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
                 LOGI("Opening socket %s\n", s_device_path);
             break;
 
+            case 'c':
+                addChannelPath(optarg);
+            break;
+
             default:
                 usage(argv[0]);
                 return NULL;
@@ -2183,6 +2968,12 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
         return NULL;
     }
 
+    initQueryCache();
+
+    if (s_channel_path_count > 0) {
+        startRequestWorkers(s_channel_path_count + 1);
+    }
+
     pthread_attr_init (&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     ret = pthread_create(&s_tid_mainloop, &attr, mainLoop, NULL);
@@ -2196,7 +2987,7 @@ int main (int argc, char **argv)
     int fd = -1;
     int opt;
 
-    while ( -1 != (opt = getopt(argc, argv, "p:d:"))) {
+    while ( -1 != (opt = getopt(argc, argv, "p:d:s:c:"))) {
         switch (opt) {
             case 'p':
                 s_port = atoi(optarg);
@@ -2217,6 +3008,10 @@ int main (int argc, char **argv)
                 LOGI("Opening socket %s\n", s_device_path);
             break;
 
+            case 'c':
+                addChannelPath(optarg);
+            break;
+
             default:
                 usage(argv[0]);
         }
@@ -2226,6 +3021,12 @@ int main (int argc, char **argv)
         usage(argv[0]);
     }
 
+    initQueryCache();
+
+    if (s_channel_path_count > 0) {
+        startRequestWorkers(s_channel_path_count + 1);
+    }
+
     RIL_register(&s_callbacks);
 
     mainLoop(NULL);
@@ -34,6 +34,7 @@ enum options {
     DIAL_CALL,
     ANSWER_CALL,
     END_CALL,
+    REQUEST_STATS,
 };
 
 
@@ -49,7 +50,8 @@ static void print_usage() {
            7 - DEACTIVE_PDP, \n\
            8 number - DIAL_CALL number, \n\
            9 - ANSWER_CALL, \n\
-           10 - END_CALL \n");
+           10 - END_CALL, \n\
+           11 - REQUEST_STATS \n");
 }
 
 static int error_check(int argc, char * argv[]) {
@@ -57,7 +59,7 @@ static int error_check(int argc, char * argv[]) {
         return -1;
     }
     const int option = atoi(argv[1]);
-    if (option < 0 || option > 10) {
+    if (option < 0 || option > 11) {
         return 0;
     } else if ((option == DIAL_CALL || option == SETUP_PDP) && argc == 3) {
         return 0;
@@ -119,6 +121,15 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (atoi(argv[1]) == REQUEST_STATS) {
+        // rild answers with one line of text and then closes the connection
+        char buf[256];
+        while ((ret = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+            buf[ret] = '\0';
+            printf("%s", buf);
+        }
+    }
+
     close(fd);
     return 0;
 }